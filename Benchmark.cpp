@@ -0,0 +1,1058 @@
+// Benchmarks for the Smart Library Management System data structures.
+// Build: g++ -std=c++17 -O2 Benchmark.cpp -o benchmark
+#define LIBRARY_NO_MAIN
+#include "Library.cpp"
+#include "SyntheticCatalog.h"
+
+#include <chrono>
+#include <random>
+#include <sys/resource.h>
+
+// The original fixed-size chained table, kept as the benchmark baseline
+class ChainedBookHashTable {
+private:
+    static const int TABLE_SIZE = 100;
+    vector<vector<Book*>> table;
+
+    int hashFunction(IsbnKey key) {
+        return (int)(key % TABLE_SIZE);
+    }
+
+public:
+    ChainedBookHashTable() : table(TABLE_SIZE) {}
+
+    void insert(Book* book) {
+        table[hashFunction(book->isbn)].push_back(book);
+    }
+
+    Book* search(IsbnKey isbn) {
+        for (Book* book : table[hashFunction(isbn)]) {
+            if (book->isbn == isbn) return book;
+        }
+        return nullptr;
+    }
+
+    void remove(IsbnKey isbn) {
+        auto& chain = table[hashFunction(isbn)];
+        for (auto it = chain.begin(); it != chain.end(); ++it) {
+            if ((*it)->isbn == isbn) {
+                chain.erase(it);
+                return;
+            }
+        }
+    }
+};
+
+static double elapsedNs(chrono::steady_clock::time_point start, size_t ops) {
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+    return (double)elapsed.count() / ops;
+}
+
+// Times insert, hit/miss search and remove; reports nanoseconds per operation.
+// Lookup and remove counts are capped so the O(n) baseline finishes.
+template <typename Table>
+static void benchHashTable(const char* name, size_t books, size_t lookups) {
+    vector<IsbnKey> isbns(books);
+    for (size_t i = 0; i < books; i++) {
+        isbns[i] = syntheticIsbn(i * 7919 + 13);
+    }
+    mt19937_64 rng(42);
+    vector<size_t> order(lookups);
+    for (size_t& index : order) index = rng() % books;
+
+    ObjectPool<Book> pool; // outlives the table, which only links books
+    Table table;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < books; i++) {
+        table.insert(pool.create(isbns[i], "Title", "Author", "Genre"));
+    }
+    double insertNs = elapsedNs(start, books);
+
+    size_t found = 0;
+    start = chrono::steady_clock::now();
+    for (size_t index : order) {
+        found += table.search(isbns[index]) != nullptr;
+    }
+    double hitNs = elapsedNs(start, lookups);
+
+    IsbnKey missing[4] = {syntheticIsbn(1), syntheticIsbn(2), syntheticIsbn(3), syntheticIsbn(4)};
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; i++) {
+        found += table.search(missing[i % 4]) != nullptr;
+    }
+    double missNs = elapsedNs(start, lookups);
+
+    size_t removals = min(books, lookups);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < removals; i++) {
+        table.remove(isbns[i]);
+    }
+    double removeNs = elapsedNs(start, removals);
+
+    cout << left << setw(10) << name << setw(10) << books
+         << fixed << setprecision(1)
+         << setw(12) << insertNs << setw(12) << hitNs
+         << setw(12) << missNs << setw(12) << removeNs
+         << (found >= lookups ? "" : "  (lookup mismatch!)") << "\n";
+}
+
+static void runHashBenchmarks(size_t maxBooks) {
+    cout << "ISBN index microbenchmark (ns/op)\n";
+    cout << left << setw(10) << "Table" << setw(10) << "Books"
+         << setw(12) << "insert" << setw(12) << "search-hit"
+         << setw(12) << "search-miss" << setw(12) << "remove" << "\n";
+    cout << string(68, '-') << "\n";
+    for (size_t books = 10000; books <= maxBooks; books *= 10) {
+        benchHashTable<ChainedBookHashTable>("chained", books, 20000);
+        benchHashTable<BookHashTable>("robinhood", books, 1000000);
+    }
+}
+
+// Skewed word picker: index i is drawn with probability roughly 1/(i+1)
+static size_t skewedIndex(mt19937_64& rng, size_t n) {
+    double u = (double)(rng() >> 11) / (double)(1ULL << 53);
+    return min(n - 1, (size_t)(exp(u * log((double)n + 1)) - 1));
+}
+
+static double percentile(vector<double>& samples, double p) {
+    size_t index = min(samples.size() - 1, (size_t)(p * samples.size()));
+    nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// Builds a keyword index over a synthetic catalog and times top-10 AND/OR
+// queries of two skewed words
+static void benchKeywordSearch(size_t books) {
+    mt19937_64 rng(7);
+    vector<string> vocabulary(50000);
+    for (size_t i = 0; i < vocabulary.size(); i++) vocabulary[i] = "w" + to_string(i);
+
+    KeywordIndex index;
+    Book book;
+    auto start = chrono::steady_clock::now();
+    for (size_t doc = 0; doc < books; doc++) {
+        book.title.clear();
+        size_t words = 3 + rng() % 4;
+        for (size_t w = 0; w < words; w++) {
+            book.title += vocabulary[skewedIndex(rng, vocabulary.size())] + " ";
+        }
+        book.author = "author" + to_string(skewedIndex(rng, 200000));
+        book.genre = "genre" + to_string(skewedIndex(rng, 50));
+        index.addDocument((uint32_t)doc, book);
+    }
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << books << " books: built in " << fixed << setprecision(1) << buildSeconds << " s, "
+         << index.termCount() << " terms, " << index.memoryBytes() / (1024 * 1024) << " MB\n";
+
+    for (bool matchAll : {true, false}) {
+        vector<double> latencies;
+        size_t hits = 0;
+        for (int q = 0; q < 2000; q++) {
+            string query = vocabulary[skewedIndex(rng, 2000)] + " " + vocabulary[skewedIndex(rng, 2000)];
+            auto queryStart = chrono::steady_clock::now();
+            hits += index.search(query, matchAll, 10).size();
+            latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - queryStart).count());
+        }
+        double total = 0;
+        for (double latency : latencies) total += latency;
+        cout << "  " << (matchAll ? "AND" : "OR ") << " top-10: mean " << setprecision(1)
+             << total / latencies.size() << " us, p50 " << percentile(latencies, 0.5)
+             << " us, p99 " << percentile(latencies, 0.99) << " us, "
+             << hits / latencies.size() << " results/query\n";
+    }
+}
+
+// Builds a fuzzy title index over synthetic titles of pronounceable words
+// and times top-10 lookups of titles with one or two random typos, plus
+// queries for titles that do not exist
+static void benchFuzzySearch(size_t books) {
+    mt19937_64 rng(11);
+    const string consonants = "bcdfghklmnprstvwz", vowels = "aeiou";
+    vector<string> vocabulary(50000);
+    for (string& word : vocabulary) {
+        size_t syllables = 1 + rng() % 3;
+        for (size_t s = 0; s < syllables; s++) {
+            word += consonants[rng() % consonants.size()];
+            word += vowels[rng() % vowels.size()];
+            if (rng() % 3 == 0) word += consonants[rng() % consonants.size()];
+        }
+    }
+    vector<string> titles(books);
+    for (string& title : titles) {
+        size_t words = 2 + rng() % 4;
+        for (size_t w = 0; w < words; w++) {
+            if (w) title += ' ';
+            title += vocabulary[skewedIndex(rng, vocabulary.size())];
+        }
+        title[0] = (char)toupper((unsigned char)title[0]);
+    }
+
+    FuzzyIndex index;
+    auto start = chrono::steady_clock::now();
+    for (size_t id = 0; id < books; id++) index.add((uint32_t)id, titles[id]);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << books << " titles: built in " << fixed << setprecision(1) << buildSeconds << " s, "
+         << index.memoryBytes() / (1024 * 1024) << " MB\n";
+
+    auto textOf = [&](uint32_t id) { return &titles[id]; };
+    for (int typos : {1, 2, -1}) {
+        vector<double> latencies;
+        size_t found = 0;
+        for (int q = 0; q < 1000; q++) {
+            size_t target = rng() % books;
+            string query = titles[target];
+            if (typos < 0) {
+                query = vocabulary[rng() % vocabulary.size()] + " " + vocabulary[rng() % vocabulary.size()] + " zq";
+            }
+            for (int t = 0; t < typos; t++) {
+                size_t at = rng() % query.size();
+                switch (rng() % 3) {
+                    case 0: query[at] = (char)('a' + rng() % 26); break;
+                    case 1: query.erase(at, 1); break;
+                    default: query.insert(at, 1, (char)('a' + rng() % 26)); break;
+                }
+            }
+            auto queryStart = chrono::steady_clock::now();
+            auto matches = index.search(query, FuzzyIndex::suggestedDistance(query), 10, textOf);
+            latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - queryStart).count());
+            found += any_of(matches.begin(), matches.end(),
+                            [&](const FuzzyIndex::Match& match) { return titles[match.id] == titles[target]; });
+        }
+        double total = 0;
+        for (double latency : latencies) total += latency;
+        cout << "  " << (typos < 0 ? "absent " : typos == 1 ? "1 typo " : "2 typos")
+             << " top-10: mean " << setprecision(1) << total / latencies.size() << " us, p50 "
+             << percentile(latencies, 0.5) << " us, p99 " << percentile(latencies, 0.99) << " us";
+        if (typos > 0) cout << ", intended title found " << setprecision(1) << found / 10.0 << "%";
+        cout << "\n";
+    }
+}
+
+// Issues and then returns every book of a synthetic catalog through the
+// worker pool at increasing thread counts and reports throughput
+static void benchCirculationScaling(size_t books) {
+    LibrarySystem library;
+    size_t users = max<size_t>(1, books / 10);
+    populate(library, books, users);
+    library.setMessageStream(nullptr);
+
+    unsigned maxThreads = max(4u, thread::hardware_concurrency());
+    cout << books << " books, " << users << " users, "
+         << thread::hardware_concurrency() << " hardware threads\n";
+    cout << left << setw(10) << "Threads" << setw(16) << "issues/s" << setw(16) << "returns/s" << "\n";
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        vector<pair<int, IsbnKey>> issues, returns;
+        for (size_t i = 0; i < books; i++) {
+            int userId = (int)(i % users) + 1;
+            issues.push_back({userId, syntheticIsbn(i)});
+            returns.push_back({userId, syntheticIsbn(i)});
+        }
+        if (threads > 1) library.startWorkers(threads - 1, true);
+
+        auto start = chrono::steady_clock::now();
+        size_t issued = 0, returned = 0;
+        for (size_t offset = 0; offset < books; offset += 65536) {
+            vector<pair<int, IsbnKey>> batch(issues.begin() + offset,
+                                            issues.begin() + min(books, offset + 65536));
+            issued += library.submitBatch('I', batch);
+        }
+        double issueSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        for (size_t offset = 0; offset < books; offset += 65536) {
+            vector<pair<int, IsbnKey>> batch(returns.begin() + offset,
+                                            returns.begin() + min(books, offset + 65536));
+            returned += library.submitBatch('R', batch);
+        }
+        double returnSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        library.stopWorkers();
+
+        cout << left << setw(10) << threads << fixed << setprecision(0)
+             << setw(16) << issued / issueSeconds << setw(16) << returned / returnSeconds
+             << (issued == books && returned == books ? "" : "  (lost requests!)") << "\n";
+    }
+}
+
+// Hot-book contention: patronsPerBook patrons want each book and every loan
+// lasts one round. With holds off, every waiting patron re-sends the issue
+// each round until it succeeds; with holds on, a patron asks once and is
+// handed the book on a return (patrons beyond the hold queue's capacity
+// still retry). Reports the requests and time until every patron has had
+// the book.
+static void benchHoldContention(size_t books, size_t patronsPerBook, bool holds) {
+    LibrarySystem library;
+    library.setMessageStream(nullptr);
+    library.setHoldsEnabled(holds);
+    size_t patronCount = books * patronsPerBook;
+    vector<const User*> patrons; // patron p wants book p / patronsPerBook
+    for (int userId : populate(library, books, patronCount)) patrons.push_back(library.findUser(userId));
+
+    vector<uint8_t> served(patronCount, 0), queued(patronCount, 0);
+    vector<size_t> borrowing, handedOver;
+    size_t requests = 0, rounds = 0, remaining = patronCount;
+    auto start = chrono::steady_clock::now();
+    while (remaining > 0) {
+        rounds++;
+        for (size_t p = 0; p < patronCount; p++) {
+            if (served[p] || queued[p]) continue;
+            size_t waitingBefore = library.holdsWaiting();
+            requests++;
+            if (library.applyIssue(patrons[p]->userId, syntheticIsbn(p / patronsPerBook), nullptr)) {
+                served[p] = 1;
+                remaining--;
+                borrowing.push_back(p);
+            } else if (library.holdsWaiting() > waitingBefore) {
+                queued[p] = 1;
+            }
+        }
+        handedOver.clear();
+        for (size_t p : borrowing) {
+            size_t book = p / patronsPerBook;
+            requests++;
+            library.applyReturn(patrons[p]->userId, syntheticIsbn(book), nullptr);
+            for (size_t q = book * patronsPerBook; q < (book + 1) * patronsPerBook; q++) {
+                if (queued[q] && !patrons[q]->borrowedBooks.empty()) {
+                    queued[q] = 0;
+                    served[q] = 1;
+                    remaining--;
+                    handedOver.push_back(q);
+                }
+            }
+        }
+        borrowing.swap(handedOver);
+    }
+    for (size_t p : borrowing) {
+        requests++;
+        library.applyReturn(patrons[p]->userId, syntheticIsbn(p / patronsPerBook), nullptr);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << left << setw(10) << patronsPerBook << setw(8) << (holds ? "holds" : "retry")
+         << setw(12) << requests << fixed << setprecision(1)
+         << setw(14) << (double)requests / patronCount << setw(8) << rounds
+         << setw(10) << seconds * 1000 << setprecision(0) << patronCount / seconds << "\n";
+}
+
+// The same physical stock catalogued as titles of copiesPerTitle copies:
+// one record per title, so build time and index size follow the title
+// count. Every copy is then issued and returned once, copy c of title i to
+// user (i + c) mod 1000, and the issue and return rates are reported.
+static void benchCopies(size_t items, uint32_t copiesPerTitle) {
+    LibrarySystem library;
+    library.setMessageStream(nullptr);
+    library.setHoldsEnabled(false);
+    size_t titles = items / copiesPerTitle;
+    auto start = chrono::steady_clock::now();
+    populate(library, titles, 0, copiesPerTitle);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    vector<int> users = populate(library, 0, max<size_t>(copiesPerTitle, 1000));
+
+    size_t issued = 0, returned = 0;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < titles; i++) {
+        for (uint32_t c = 0; c < copiesPerTitle; c++) {
+            issued += library.applyIssue(users[(i + c) % users.size()], syntheticIsbn(i), nullptr);
+        }
+    }
+    double issueSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < titles; i++) {
+        for (uint32_t c = 0; c < copiesPerTitle; c++) {
+            returned += library.applyReturn(users[(i + c) % users.size()], syntheticIsbn(i), nullptr);
+        }
+    }
+    double returnSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << left << setw(10) << copiesPerTitle << setw(12) << titles << fixed << setprecision(1)
+         << setw(12) << buildSeconds * 1000 << setprecision(0)
+         << setw(16) << issued / issueSeconds << setw(16) << returned / returnSeconds
+         << (issued == titles * copiesPerTitle && returned == issued ? "" : "  (lost loans!)") << "\n";
+}
+
+// Issues loans spread evenly over four weeks, then moves the clock on a
+// day at a time and reports how long each step takes to expire the loans
+// falling due. The cost follows the loans expiring that day, not the
+// loans out.
+static void benchDueDates(size_t loans) {
+    const uint32_t COPIES = 16;
+    const int ISSUE_DAYS = 28;
+    LibrarySystem library;
+    library.setMessageStream(nullptr);
+    library.setHoldsEnabled(false);
+    size_t titles = (loans + COPIES - 1) / COPIES;
+    size_t users = max<size_t>(COPIES, loans / 10);
+    vector<int> userIds = populate(library, titles, users, COPIES);
+    // Consecutive loans share a title, so they go to different users
+    size_t issued = 0;
+    for (int day = 0; day < ISSUE_DAYS; day++) {
+        size_t end = loans * (day + 1) / ISSUE_DAYS;
+        for (; issued < end; issued++) {
+            library.applyIssue(userIds[issued % users], syntheticIsbn(issued / COPIES), nullptr);
+        }
+        library.advanceClock(LibraryClock::SECONDS_PER_DAY);
+    }
+
+    cout << loans << " loans issued over " << ISSUE_DAYS << " days, due after 14\n";
+    cout << left << setw(8) << "Day" << setw(12) << "Loans out" << setw(12) << "Fell due"
+         << setw(12) << "Overdue" << "Advance ms\n";
+    for (int day = ISSUE_DAYS; day < ISSUE_DAYS + 20; day++) {
+        size_t overdueBefore = library.gauges().overdue;
+        auto start = chrono::steady_clock::now();
+        library.advanceClock(LibraryClock::SECONDS_PER_DAY);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        Metrics::Gauges gauges = library.gauges();
+        cout << left << setw(8) << day + 1 << setw(12) << gauges.loans << setw(12) << gauges.overdue - overdueBefore
+             << setw(12) << gauges.overdue << fixed << setprecision(3) << seconds * 1000 << "\n"
+             << defaultfloat << setprecision(6);
+    }
+}
+
+// The plain row store an event log might otherwise be: one struct per event
+struct EventRow {
+    int64_t time;
+    uint32_t userId;
+    uint32_t bookId;
+    uint8_t kind;
+};
+
+static void benchEventLog(size_t events) {
+    const int DAYS = 90;
+    const uint32_t BOOKS = 1000000, USERS = 100000, GENRES = 50;
+    vector<uint32_t> genreOfBook(BOOKS);
+    mt19937_64 rng(42);
+    for (uint32_t& genre : genreOfBook) genre = (uint32_t)skewedIndex(rng, GENRES);
+
+    // A steady stream of issues and returns over the last DAYS days
+    int64_t start = 1700000000 - 1700000000 % LibraryClock::SECONDS_PER_DAY;
+    int64_t span = DAYS * LibraryClock::SECONDS_PER_DAY;
+    vector<EventRow> rows(events);
+    for (size_t i = 0; i < events; i++) {
+        rows[i] = {start + (int64_t)(i * span / events), (uint32_t)(1 + skewedIndex(rng, USERS)),
+                   (uint32_t)skewedIndex(rng, BOOKS), (uint8_t)(rng() & 1)};
+    }
+    CirculationEventLog log;
+    auto begin = chrono::steady_clock::now();
+    for (const EventRow& row : rows) {
+        log.append((CirculationEventLog::Kind)row.kind, row.time, (int32_t)row.userId, row.bookId);
+    }
+    double appendNs = elapsedNs(begin, events);
+    cout << events << " events over " << DAYS << " days: " << fixed << setprecision(2)
+         << (double)log.bytes() / events << " bytes/event in the log vs " << sizeof(EventRow)
+         << " as rows, append " << setprecision(1) << appendNs << " ns/event\n"
+         << defaultfloat << setprecision(6);
+
+    cout << left << setw(36) << "Query" << setw(14) << "Blocks read" << setw(12) << "Log ms" << "Row scan ms\n";
+    struct Case {
+        const char* name;
+        int days;
+        CirculationEventLog::GroupBy group;
+        int64_t bucketSeconds;
+    };
+    const Case cases[] = {
+        {"issues per genre per hour, 7 days", 7, CirculationEventLog::BY_BOOK_KEY, 3600},
+        {"issues per genre, 30 days", 30, CirculationEventLog::BY_BOOK_KEY, 0},
+        {"issues per user, 90 days", 90, CirculationEventLog::BY_USER, 0},
+        {"issues per day, 90 days", 90, CirculationEventLog::BY_NOTHING, LibraryClock::SECONDS_PER_DAY},
+    };
+    CirculationEventLog::View view = log.view();
+    for (const Case& test : cases) {
+        CirculationEventLog::Query query{start + span - test.days * LibraryClock::SECONDS_PER_DAY, start + span,
+                                         CirculationEventLog::ISSUES, CirculationEventLog::ANY, test.group,
+                                         &genreOfBook, test.bucketSeconds};
+        vector<uint64_t> counts;
+        begin = chrono::steady_clock::now();
+        CirculationEventLog::ScanStats scan = view.aggregate(query, counts);
+        double logMs = elapsedNs(begin, 1) / 1e6;
+
+        // Baseline: filter and group every row
+        uint64_t buckets = test.bucketSeconds ? (uint64_t)(query.to - query.from - 1) / test.bucketSeconds + 1 : 1;
+        vector<uint64_t> expected(counts.size(), 0);
+        begin = chrono::steady_clock::now();
+        for (const EventRow& row : rows) {
+            if (row.time < query.from || row.time >= query.to || row.kind != CirculationEventLog::ISSUE) continue;
+            uint64_t key = test.group == CirculationEventLog::BY_USER ? row.userId
+                         : test.group == CirculationEventLog::BY_BOOK_KEY ? genreOfBook[row.bookId] : 0;
+            uint64_t bucket = test.bucketSeconds ? (uint64_t)(row.time - query.from) / test.bucketSeconds : 0;
+            size_t slot = key * buckets + bucket;
+            if (slot >= expected.size()) expected.resize(slot + 1, 0);
+            expected[slot]++;
+        }
+        double rowMs = elapsedNs(begin, 1) / 1e6;
+        expected.resize(counts.size(), 0);
+        cout << left << setw(36) << test.name << setw(14)
+             << to_string(scan.decoded) + "/" + to_string(scan.blocks) << fixed << setprecision(2) << setw(12)
+             << logMs << rowMs << (expected == counts ? "" : "  MISMATCH") << "\n" << defaultfloat << setprecision(6);
+    }
+}
+
+// Counts what it is given and keeps none of it
+class DiscardBuffer : public streambuf {
+public:
+    size_t bytes = 0;
+
+protected:
+    int overflow(int c) override {
+        bytes++;
+        return c;
+    }
+    streamsize xsputn(const char*, streamsize n) override {
+        bytes += (size_t)n;
+        return n;
+    }
+};
+
+// Circulation and reports on one library with worker threads, then on
+// branch counts up to the core count. Each book is issued once, to a
+// random user, and returned; the Most Borrowed (top 20) and Active Users
+// reports are timed with every book out.
+static void benchShards(size_t books) {
+    size_t users = max<size_t>(1, books / 10);
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    cout << books << " books, " << users << " users, " << cores << " hardware threads\n";
+    cout << left << setw(10) << "Branches" << setw(14) << "issues/s" << setw(14) << "returns/s" << setw(12)
+         << "Transfers" << setw(16) << "Top 20 ms" << "Active users ms\n";
+
+    mt19937_64 rng(11);
+    vector<size_t> borrower(books);
+    for (size_t& user : borrower) user = rng() % users;
+
+    auto report = [&](unsigned branches, double issueSeconds, double returnSeconds, size_t issued, size_t returned,
+                      double transferShare, double topMs, double activeMs) {
+        cout << left << setw(10) << branches << fixed << setprecision(0) << setw(14) << issued / issueSeconds
+             << setw(14) << returned / returnSeconds << setw(12)
+             << to_string((int)(transferShare * 100)) + "%" << setprecision(2) << setw(16) << topMs << activeMs
+             << (issued == books && returned == books ? "" : "  (lost requests!)") << "\n"
+             << defaultfloat << setprecision(6);
+    };
+
+    {
+        LibrarySystem library;
+        library.setMessageStream(nullptr);
+        vector<int> userIds = populate(library, books, users);
+        vector<pair<int, IsbnKey>> requests;
+        for (size_t i = 0; i < books; i++) requests.push_back({userIds[borrower[i]], syntheticIsbn(i)});
+        if (cores > 1) library.startWorkers(cores - 1, true);
+        auto start = chrono::steady_clock::now();
+        vector<pair<int, IsbnKey>> batch(requests);
+        size_t issued = library.submitBatch('I', batch);
+        double issueSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        library.stopWorkers();
+        start = chrono::steady_clock::now();
+        size_t top = library.mostBorrowed(BorrowStatistics::ALL_TIME, 20).size();
+        double topMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        size_t active = library.activeUsers().size();
+        double activeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (cores > 1) library.startWorkers(cores - 1, true);
+        start = chrono::steady_clock::now();
+        batch = requests;
+        size_t returned = library.submitBatch('R', batch);
+        double returnSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        library.stopWorkers();
+        cout << "one library, " << cores << " thread(s):\n";
+        report(1, issueSeconds, returnSeconds, issued, returned, 0, topMs, activeMs);
+        if (top == 0 || active == 0) cout << "  (empty reports!)\n";
+    }
+
+    cout << "branches:\n";
+    for (unsigned branches = 1; branches <= max(4u, cores); branches *= 2) {
+        ShardedLibrary library(branches);
+        vector<int> userIds = populate(library, books, users);
+        vector<pair<int, IsbnKey>> requests;
+        size_t remote = 0;
+        for (size_t i = 0; i < books; i++) {
+            requests.push_back({userIds[borrower[i]], syntheticIsbn(i)});
+            remote += library.branchOf(syntheticIsbn(i)) != (unsigned)(userIds[borrower[i]] - 1) % branches;
+        }
+
+        auto start = chrono::steady_clock::now();
+        size_t issued = library.submitBatch('I', requests, nullptr);
+        double issueSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        size_t top = library.mostBorrowed(BorrowStatistics::ALL_TIME, 20).size();
+        double topMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        size_t active = library.activeUsers().size();
+        double activeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        size_t returned = library.submitBatch('R', requests, nullptr);
+        double returnSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        report(branches, issueSeconds, returnSeconds, issued, returned, (double)remote / books, topMs, activeMs);
+        if (top == 0 || active == 0) cout << "  (empty reports!)\n";
+    }
+}
+
+// The original field-at-a-time Book::display, kept as the render baseline
+static void streamBookFields(ostream& out, const Book* book) {
+    out << "ISBN: " << formatIsbn(book->isbn) << "\n"
+        << "Title: " << book->title << "\n"
+        << "Author: " << book->author << "\n"
+        << "Genre: " << book->genre << "\n";
+    if (book->totalCopies == 1) {
+        out << "Available: " << (book->isAvailable() ? "Yes" : "No") << "\n";
+    } else {
+        out << "Available: " << book->availableCopies << " of " << book->totalCopies << " copies\n";
+    }
+    out << "Borrow Count: " << book->borrowCount << "\n";
+    out << string(30, '-') << "\n";
+}
+
+// Renders the whole catalog in each listing format to a stream that
+// discards it, against the per-field stream insertions it replaced
+static void benchRender(size_t books) {
+    LibrarySystem library;
+    library.setMessageStream(nullptr);
+    vector<const Book*> catalog;
+    catalog.reserve(books);
+    for (size_t i = 0; i < books; i++) {
+        catalog.push_back(library.addBookRecord(syntheticIsbn(i), "Title " + to_string(i), "Author " + to_string(i % 5000),
+                                                "Genre " + to_string(i % 40), 1 + (uint32_t)(i % 3)));
+    }
+    const string rule = string(30, '-') + "\n";
+
+    cout << left << setw(18) << "Layout" << setw(12) << "ms" << setw(14) << "rows/s" << "MB/s\n";
+    auto report = [&](const char* name, double seconds, size_t bytes) {
+        cout << left << setw(18) << name << fixed << setprecision(1) << setw(12) << seconds * 1000
+             << setprecision(0) << setw(14) << books / seconds << setprecision(1) << bytes / seconds / 1e6 << "\n"
+             << defaultfloat << setprecision(6);
+    };
+    {
+        DiscardBuffer sink;
+        ostream out(&sink);
+        auto start = chrono::steady_clock::now();
+        for (const Book* book : catalog) streamBookFields(out, book);
+        report("per-field <<", chrono::duration<double>(chrono::steady_clock::now() - start).count(), sink.bytes);
+    }
+    const pair<const char*, ListingWriter::Format> layouts[] = {
+        {"records", ListingWriter::RECORDS}, {"table", ListingWriter::TABLE},
+        {"csv", ListingWriter::CSV}, {"jsonl", ListingWriter::JSONL},
+    };
+    for (const auto& layout : layouts) {
+        DiscardBuffer sink;
+        ostream out(&sink);
+        auto start = chrono::steady_clock::now();
+        {
+            ListingWriter writer(out, layout.second, Book::columns());
+            for (const Book* book : catalog) {
+                book->render(writer);
+                if (layout.second == ListingWriter::RECORDS) writer.text(rule);
+            }
+        }
+        report(layout.first, chrono::duration<double>(chrono::steady_clock::now() - start).count(), sink.bytes);
+    }
+}
+
+// Deterministic synthetic data for the operations suite. Every value is a
+// pure function of its index and a seed, so any size regenerates exactly
+// the same catalog, user base and workload without storing them.
+struct SplitMix64 {
+    typedef uint64_t result_type;
+    uint64_t state;
+
+    explicit SplitMix64(uint64_t seed) : state(seed) {}
+
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return UINT64_MAX; }
+
+    uint64_t operator()() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    double uniform() { return (double)((*this)() >> 11) / (double)(1ULL << 53); }
+};
+
+// Zipf-like ranks in [0, n): rank r is drawn with probability roughly
+// proportional to 1/(r+1)^exponent. Uses the continuous inverse CDF, so it
+// needs no table even for 10M items.
+class ZipfSampler {
+private:
+    double n;
+    double oneMinusS;
+    double span;
+
+public:
+    ZipfSampler(size_t items, double exponent)
+        : n((double)items), oneMinusS(1.0 - exponent), span(pow(n + 1.0, 1.0 - exponent) - 1.0) {}
+
+    size_t operator()(SplitMix64& rng) const {
+        double rank = pow(rng.uniform() * span + 1.0, 1.0 / oneMinusS) - 1.0;
+        return min((size_t)rank, (size_t)n - 1);
+    }
+};
+
+struct BookFields {
+    IsbnKey isbn;
+    string title;
+    string author;
+    string genre;
+};
+
+class CatalogGenerator {
+private:
+    static const uint64_t SEED = 0x5eed;
+    size_t books;
+    size_t users;
+    ZipfSampler authorRank;
+    ZipfSampler genreRank;
+    ZipfSampler wordRank;
+    ZipfSampler bookPopularity;
+    ZipfSampler userActivity;
+
+public:
+    static const vector<string>& genres() {
+        static const vector<string> names = {
+            "Fiction", "Mystery", "Science Fiction", "Fantasy", "Romance", "Thriller",
+            "Biography", "History", "Programming", "Software Engineering", "Mathematics",
+            "Physics", "Philosophy", "Poetry", "Travel", "Cooking", "Art", "Music",
+            "Children", "Young Adult", "Self Help", "Business", "Economics", "Politics",
+            "Religion", "Health", "Sports", "Nature", "Drama", "Horror"};
+        return names;
+    }
+
+    CatalogGenerator(size_t books, size_t users)
+        : books(books), users(users),
+          authorRank(max<size_t>(1, books / 20), 1.05), genreRank(genres().size(), 1.2),
+          wordRank(20000, 1.1), bookPopularity(books, 1.1), userActivity(users, 0.8) {}
+
+    size_t bookCount() const { return books; }
+    size_t userCount() const { return users; }
+
+    // ISBNs are a fixed permutation of the book index, so hot books are
+    // scattered across the key space
+    IsbnKey isbn(size_t index) const {
+        return syntheticIsbn((index * 2654435761ULL + 97) % 1000000000ULL);
+    }
+
+    BookFields book(size_t index) const {
+        SplitMix64 rng(SEED ^ (index * 0x100000001b3ULL));
+        string title;
+        size_t words = 2 + rng() % 4;
+        for (size_t w = 0; w < words; w++) {
+            if (w) title += ' ';
+            title += "w" + to_string(wordRank(rng));
+        }
+        return BookFields{isbn(index), title, "Author " + to_string(authorRank(rng)),
+                          genres()[genreRank(rng)]};
+    }
+
+    string userName(size_t index) const { return "User " + to_string(index); }
+    string userEmail(size_t index) const { return "user" + to_string(index) + "@example.com"; }
+
+    // Issue requests with skewed book popularity and user activity; user
+    // IDs follow registration order starting at 1
+    vector<pair<int, IsbnKey>> issueRequests(size_t count) const {
+        SplitMix64 rng(SEED * 31 + count);
+        vector<pair<int, IsbnKey>> requests;
+        requests.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            size_t user = userActivity(rng);
+            size_t popular = bookPopularity(rng);
+            requests.push_back({(int)user + 1, isbn((popular * 7919) % books)});
+        }
+        return requests;
+    }
+};
+
+// Per-operation latency samples for one benchmark
+struct OperationResult {
+    string name;
+    size_t ops;
+    double seconds;
+    double p50Ns;
+    double p99Ns;
+};
+
+// Times op(i) for i in [0, ops). Latencies are taken per call and include
+// roughly 20 ns of clock overhead.
+template <typename Operation>
+static OperationResult measure(const string& name, size_t ops, Operation op) {
+    vector<double> samples;
+    samples.reserve(ops);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++) {
+        auto callStart = chrono::steady_clock::now();
+        op(i);
+        samples.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - callStart).count());
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return OperationResult{name, ops, seconds, percentile(samples, 0.5), percentile(samples, 0.99)};
+}
+
+static long peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Runs generateReports with scripted menu input, discarding its output
+static void runReport(LibrarySystem& library, const string& input) {
+    istringstream script(input);
+    ostringstream discard;
+    streambuf* previousIn = cin.rdbuf(script.rdbuf());
+    streambuf* previousOut = cout.rdbuf(discard.rdbuf());
+    library.generateReports();
+    cin.rdbuf(previousIn);
+    cout.rdbuf(previousOut);
+}
+
+// Issue and return latency on worker threads, first alone and then with
+// the overdue, active users and all users reports running back to back on
+// another thread. The reports read loans and fines from ledger views, so
+// the circulation tail should barely move.
+static void benchReportIsolation(size_t books, unsigned threads) {
+    LibrarySystem library;
+    library.setMessageStream(nullptr);
+    library.setHoldsEnabled(false);
+    size_t users = max<size_t>(threads, books / 10);
+    populate(library, books, users);
+    // Half the catalog is out and overdue; workers circulate the other half
+    for (size_t i = 0; i < books / 2; i++) {
+        library.applyIssue((int)(i % users) + 1, syntheticIsbn(i), nullptr);
+    }
+    library.advanceClock(20 * LibraryClock::SECONDS_PER_DAY);
+
+    const size_t cycles = 100000; // issue and return pairs per worker
+    cout << books << " books, " << books / 2 << " loans out, " << threads << " workers\n";
+    cout << left << setw(10) << "Reports" << setw(12) << "p50 us" << setw(12) << "p99 us"
+         << setw(12) << "p99.9 us" << setw(12) << "max us" << "Reports run\n";
+    for (bool reporting : {false, true}) {
+        atomic<bool> stop(false);
+        size_t reportsRun = 0;
+        thread reporter;
+        if (reporting) {
+            reporter = thread([&]() {
+                while (!stop.load()) {
+                    runReport(library, "7\nq\n");
+                    runReport(library, "3\nq\n");
+                    runReport(library, "4\nq\n");
+                    reportsRun += 3;
+                }
+            });
+        }
+        vector<vector<double>> latencies(threads);
+        vector<thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                mt19937_64 rng(t);
+                size_t firstBook = books / 2, freeBooks = books - firstBook;
+                for (size_t i = 0; i < cycles; i++) {
+                    // Each worker keeps to its own books and users
+                    size_t book = firstBook + (rng() % (freeBooks / threads)) * threads + t;
+                    int userId = (int)((rng() % (users / threads)) * threads + t) + 1;
+                    auto start = chrono::steady_clock::now();
+                    library.applyIssue(userId, syntheticIsbn(book), nullptr);
+                    auto issued = chrono::steady_clock::now();
+                    library.applyReturn(userId, syntheticIsbn(book), nullptr);
+                    auto returned = chrono::steady_clock::now();
+                    latencies[t].push_back(chrono::duration<double, micro>(issued - start).count());
+                    latencies[t].push_back(chrono::duration<double, micro>(returned - issued).count());
+                }
+            });
+        }
+        for (thread& worker : workers) worker.join();
+        stop = true;
+        if (reporter.joinable()) reporter.join();
+
+        vector<double> all;
+        for (const vector<double>& samples : latencies) all.insert(all.end(), samples.begin(), samples.end());
+        double worst = *max_element(all.begin(), all.end());
+        cout << left << setw(10) << (reporting ? "running" : "none") << fixed << setprecision(2)
+             << setw(12) << percentile(all, 0.5) << setw(12) << percentile(all, 0.99)
+             << setw(12) << percentile(all, 0.999) << setw(12) << worst
+             << (reporting ? to_string(reportsRun) : "-") << "\n" << defaultfloat << setprecision(6);
+    }
+}
+
+static vector<OperationResult> benchOperations(const CatalogGenerator& generator) {
+    vector<OperationResult> results;
+    size_t books = generator.bookCount(), users = generator.userCount();
+    size_t lookups = min<size_t>(books, 1000000);
+    SplitMix64 rng(books);
+    vector<size_t> probes(lookups);
+    for (size_t& probe : probes) probe = rng() % books;
+
+    {
+        // Component structures over one shared set of books
+        ObjectPool<Book> pool;
+        vector<Book*> catalog(books);
+        for (size_t i = 0; i < books; i++) {
+            BookFields book = generator.book(i);
+            catalog[i] = pool.create(book.isbn, book.title, book.author, book.genre);
+        }
+
+        BookHashTable table;
+        results.push_back(measure("hash_table.insert", books, [&](size_t i) { table.insert(catalog[i]); }));
+        results.push_back(measure("hash_table.search", lookups, [&](size_t i) {
+            if (!table.search(catalog[probes[i]]->isbn)) cerr << "missing ISBN\n";
+        }));
+
+        BookBPlusTree tree;
+        results.push_back(measure("title_tree.insert", books, [&](size_t i) { tree.insert(catalog[i]); }));
+        results.push_back(measure("title_tree.search_by_title", lookups, [&](size_t i) {
+            if (!tree.searchByTitle(catalog[probes[i]]->title)) cerr << "missing title\n";
+        }));
+
+        results.push_back(measure("hash_table.remove", lookups, [&](size_t i) {
+            table.remove(catalog[i]->isbn);
+        }));
+
+        UserStore store;
+        results.push_back(measure("user_store.add", users, [&](size_t i) {
+            store.addUser(generator.userName(i), generator.userEmail(i));
+        }));
+        results.push_back(measure("user_store.find", lookups, [&](size_t i) {
+            if (!store.findUser((int)(probes[i] % users) + 1)) cerr << "missing user\n";
+        }));
+    }
+
+    LibrarySystem library;
+    library.setMessageStream(nullptr);
+    for (size_t i = 0; i < books; i++) {
+        BookFields book = generator.book(i);
+        library.addBookRecord(book.isbn, book.title, book.author, book.genre);
+    }
+    for (size_t i = 0; i < users; i++) {
+        library.registerUser(generator.userName(i), generator.userEmail(i));
+    }
+
+    // Popular books are often already out, so some issues are refused
+    // (holds stay off, keeping the workload comparable with older runs);
+    // every successful issue is returned afterwards in shuffled order
+    library.setHoldsEnabled(false);
+    vector<pair<int, IsbnKey>> issues = generator.issueRequests(min<size_t>(books, 1000000));
+    vector<pair<int, IsbnKey>> loans;
+    results.push_back(measure("circulation.issue", issues.size(), [&](size_t i) {
+        if (library.applyIssue(issues[i].first, issues[i].second, nullptr)) loans.push_back(issues[i]);
+    }));
+    shuffle(loans.begin(), loans.end(), rng);
+    vector<pair<int, IsbnKey>> outstanding(loans.begin(), loans.begin() + loans.size() / 2);
+
+    size_t reportRuns = max<size_t>(3, min<size_t>(100, 10000000 / books));
+    // The author filter names the first book's author
+    const vector<pair<string, string>> reports = {
+        {"report.currently_borrowed", "1\n\n\nq\n"},
+        {"report.currently_borrowed_by_genre", "1\nFiction\n\nq\n"},
+        {"report.currently_borrowed_by_author", "1\n\n" + generator.book(0).author + "\nq\n"},
+        {"report.most_borrowed_all_time", "2\n1\n"},
+        {"report.most_borrowed_7_days", "2\n2\n"},
+        {"report.most_borrowed_30_days", "2\n3\n"},
+        {"report.active_users", "3\nq\n"},
+        {"report.all_users", "4\nq\n"},
+        {"report.genre_summary", "5\n"},
+        {"report.operation_statistics", "6\n"},
+        {"report.activity_genre_by_hour", "8\n7\n1\n1\n1\nq\n"},
+    };
+    // Reports run with half the loans still out
+    results.push_back(measure("circulation.return", loans.size() - outstanding.size(), [&](size_t i) {
+        const pair<int, IsbnKey>& loan = loans[outstanding.size() + i];
+        library.applyReturn(loan.first, loan.second, nullptr);
+    }));
+    for (const auto& report : reports) {
+        results.push_back(measure(report.first, reportRuns, [&](size_t) { runReport(library, report.second); }));
+    }
+    // Last, as it moves the clock on until the outstanding loans are overdue
+    library.advanceClock(30 * LibraryClock::SECONDS_PER_DAY);
+    results.push_back(measure("report.overdue", reportRuns, [&](size_t) { runReport(library, "7\nq\n"); }));
+    return results;
+}
+
+static void printOperationsJson(ostream& out, const vector<pair<CatalogGenerator, vector<OperationResult>>>& runs,
+                                const vector<long>& peakRss) {
+    out << "{\n  \"suite\": \"operations\",\n  \"runs\": [";
+    for (size_t r = 0; r < runs.size(); r++) {
+        out << (r ? "," : "") << "\n    {\"books\": " << runs[r].first.bookCount()
+            << ", \"users\": " << runs[r].first.userCount()
+            << ", \"peak_rss_kb\": " << peakRss[r] << ", \"operations\": [";
+        const vector<OperationResult>& results = runs[r].second;
+        for (size_t i = 0; i < results.size(); i++) {
+            const OperationResult& result = results[i];
+            out << (i ? "," : "") << "\n      {\"name\": \"" << result.name << "\", \"ops\": " << result.ops
+                << fixed << setprecision(1)
+                << ", \"ops_per_sec\": " << (result.seconds > 0 ? result.ops / result.seconds : 0.0)
+                << ", \"p50_ns\": " << result.p50Ns << ", \"p99_ns\": " << result.p99Ns << "}";
+        }
+        out << "\n    ]}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+    string suite = argc > 1 ? argv[1] : "all";
+    size_t maxBooks = argc > 2 ? strtoull(argv[2], nullptr, 10) : 0;
+
+    if (suite == "hash" || suite == "all") {
+        runHashBenchmarks(maxBooks ? maxBooks : 1000000);
+    }
+    if (suite == "keyword" || suite == "all") {
+        cout << "\nKeyword search benchmark\n";
+        for (size_t books = 1000000; books <= (maxBooks ? maxBooks : 10000000); books *= 10) {
+            benchKeywordSearch(books);
+        }
+    }
+    if (suite == "fuzzy" || suite == "all") {
+        cout << "\nFuzzy title search benchmark\n";
+        for (size_t books = 1000000; books <= (maxBooks ? maxBooks : 5000000); books *= 5) {
+            benchFuzzySearch(books);
+        }
+    }
+    if (suite == "circulation" || suite == "all") {
+        cout << "\nCirculation scaling benchmark\n";
+        benchCirculationScaling(maxBooks ? maxBooks : 500000);
+    }
+    if (suite == "holds" || suite == "all") {
+        size_t books = maxBooks ? maxBooks : 10000;
+        cout << "\nHold queue contention benchmark, " << books << " hot books\n";
+        cout << left << setw(10) << "Patrons" << setw(8) << "Mode" << setw(12) << "Requests"
+             << setw(14) << "Per patron" << setw(8) << "Rounds" << setw(10) << "ms" << "Loans/s\n";
+        for (size_t patrons : {2, 8, 16, 32}) {
+            benchHoldContention(books, patrons, false);
+            benchHoldContention(books, patrons, true);
+        }
+    }
+    if (suite == "copies" || suite == "all") {
+        size_t items = maxBooks ? maxBooks : 1000000;
+        cout << "\nMulti-copy inventory benchmark, " << items << " physical items\n";
+        cout << left << setw(10) << "Copies" << setw(12) << "Titles" << setw(12) << "Build ms"
+             << setw(16) << "issues/s" << setw(16) << "returns/s" << "\n";
+        for (uint32_t copies : {1, 4, 16, 64}) {
+            benchCopies(items, copies);
+        }
+    }
+    if (suite == "due" || suite == "all") {
+        cout << "\nDue date expiry benchmark\n";
+        benchDueDates(maxBooks ? maxBooks : 1000000);
+    }
+    if (suite == "isolation" || suite == "all") {
+        cout << "\nReport isolation benchmark\n";
+        benchReportIsolation(maxBooks ? maxBooks : 1000000, max(3u, thread::hardware_concurrency()) - 1);
+    }
+    if (suite == "events" || suite == "all") {
+        size_t events = maxBooks ? maxBooks : 10000000;
+        cout << "\nCirculation event log benchmark\n";
+        benchEventLog(events);
+    }
+    if (suite == "shards" || suite == "all") {
+        cout << "\nSharded branches benchmark\n";
+        benchShards(maxBooks ? maxBooks : 500000);
+    }
+    if (suite == "render" || suite == "all") {
+        size_t books = maxBooks ? maxBooks : 1000000;
+        cout << "\nListing render benchmark, " << books << " books\n";
+        benchRender(books);
+    }
+    // Machine-readable, so it is only run when asked for by name
+    if (suite == "ops") {
+        vector<pair<CatalogGenerator, vector<OperationResult>>> runs;
+        vector<long> peakRss;
+        for (size_t books = 1000; books <= (maxBooks ? maxBooks : 1000000); books *= 10) {
+            cerr << "operations: " << books << " books\n";
+            CatalogGenerator generator(books, max<size_t>(1, books / 10));
+            runs.push_back({generator, benchOperations(generator)});
+            peakRss.push_back(peakRssKb()); // high-water mark so far; sizes run smallest first
+        }
+        printOperationsJson(cout, runs, peakRss);
+    }
+    return 0;
+}
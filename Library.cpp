@@ -1,12 +1,52 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <stack>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <iomanip>
+#include <cstdint>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <new>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <functional>
+#include <tuple>
+#include <type_traits>
+#include <cerrno>
+#include <ctime>
+#include <charconv>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sched.h>
 
 using namespace std;
 
@@ -15,39 +55,572 @@ class Book;
 class User;
 class LibrarySystem;
 
-// Book class to represent individual books
+// ISBNs are held as a packed key: the 13-digit ISBN-13 as an integer.
+// ISBN-10s are converted to their 978 form, so both spellings of a book
+// map to the same key. 0 is never a valid key.
+typedef uint64_t IsbnKey;
+static const IsbnKey NO_ISBN = 0;
+
+// Check digit for the first 12 digits of an ISBN-13 (weights 1,3,1,...)
+inline int isbn13CheckDigit(uint64_t first12) {
+    int sum = 0;
+    for (int weight = 3; first12 != 0; first12 /= 10, weight = 4 - weight) {
+        sum += weight * (int)(first12 % 10);
+    }
+    return (10 - sum % 10) % 10;
+}
+
+// A valid ISBN-13 for n < 10^9 (978 prefix, n, check digit). Benchmarks
+// and the load generator number synthetic catalogues with it.
+inline IsbnKey syntheticIsbn(uint64_t n) {
+    uint64_t first12 = 978000000000ULL + n % 1000000000ULL;
+    return first12 * 10 + isbn13CheckDigit(first12);
+}
+
+// Parses an ISBN-10 or ISBN-13, ignoring hyphens and spaces. Returns
+// NO_ISBN unless the length, the 978/979 prefix and the check digit are
+// all valid.
+inline IsbnKey parseIsbn(string_view text) {
+    int digits[13];
+    int count = 0;
+    for (char c : text) {
+        if (c == '-' || c == ' ') continue;
+        if (count == 13) return NO_ISBN;
+        if (c >= '0' && c <= '9') {
+            digits[count++] = c - '0';
+        } else if ((c == 'X' || c == 'x') && count == 9) {
+            digits[count++] = 10; // ISBN-10 check digit for 10
+        } else {
+            return NO_ISBN;
+        }
+    }
+
+    uint64_t first12 = 0;
+    if (count == 10) {
+        int sum = 0;
+        for (int i = 0; i < 10; i++) sum += (10 - i) * digits[i];
+        if (sum % 11 != 0) return NO_ISBN;
+        first12 = 978;
+        for (int i = 0; i < 9; i++) first12 = first12 * 10 + digits[i];
+    } else if (count == 13) {
+        for (int i = 0; i < 12; i++) first12 = first12 * 10 + digits[i];
+        uint64_t prefix = first12 / 1000000000ULL;
+        if ((prefix != 978 && prefix != 979) || digits[12] != isbn13CheckDigit(first12)) return NO_ISBN;
+    } else {
+        return NO_ISBN;
+    }
+    return first12 * 10 + isbn13CheckDigit(first12);
+}
+
+// Canonical text form, e.g. 978-0134685991
+inline string formatIsbn(IsbnKey isbn) {
+    char text[14];
+    for (int i = 13; i >= 0; i--) {
+        if (i == 3) {
+            text[i] = '-';
+            continue;
+        }
+        text[i] = (char)('0' + isbn % 10);
+        isbn /= 10;
+    }
+    return string(text, sizeof(text));
+}
+
+// Money is kept in whole cents, e.g. $1.25
+inline string formatCents(uint64_t cents) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "$%llu.%02llu", (unsigned long long)(cents / 100), (unsigned long long)(cents % 100));
+    return buffer;
+}
+
+// Buffered listing output. Rows are formatted into one reusable buffer
+// that goes to the stream in a single write once it passes FLUSH_BYTES,
+// instead of several stream insertions per field. The console layouts are
+// "Label: value" records and a compact table; CSV and JSON lines are for
+// exports. Columns can be limited to some layouts, so a field can be text
+// at the console and a number in an export.
+class ListingWriter {
+public:
+    enum Format { RECORDS, TABLE, CSV, JSONL };
+
+    static const int CONSOLE = 1 << RECORDS | 1 << TABLE;
+    static const int DATA = 1 << CSV | 1 << JSONL;
+    static const int ALL = CONSOLE | DATA;
+
+    struct Column {
+        const char* label; // record and table heading
+        const char* key;   // CSV heading and JSON key
+        int width;         // table column width
+        int layouts;       // formats the column appears in
+    };
+
+    // Parses "records", "table", "csv" or "jsonl"
+    static bool parseFormat(const string& name, Format& format) {
+        static const char* const NAMES[] = {"records", "table", "csv", "jsonl"};
+        for (int i = 0; i < 4; i++) {
+            if (name == NAMES[i]) {
+                format = (Format)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static const size_t FLUSH_BYTES = 1 << 20;
+
+    ostream& out;
+    Format layout;
+    const vector<Column>& columns;
+    vector<string> prefixes; // "Label: " for records, "key": for JSON lines
+    string buffer;
+    size_t column;      // next column of the current row
+    size_t fieldsInRow; // fields written to the current row
+    size_t rowCount;
+
+    bool shows(const Column& col) const { return (col.layouts & (1 << layout)) != 0; }
+
+    void appendNumber(int64_t value) {
+        char digits[24];
+        buffer.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+    }
+
+    // Quoted only when needed, including edge spaces the importer would trim
+    void appendCsv(string_view value) {
+        bool quote = !value.empty() && (value.front() == ' ' || value.back() == ' ');
+        for (size_t i = 0; i < value.size() && !quote; i++) {
+            char c = value[i];
+            quote = c == ',' || c == '"' || c == '\n' || c == '\r' || c == '\t';
+        }
+        if (!quote) {
+            buffer.append(value);
+            return;
+        }
+        buffer += '"';
+        for (size_t start = 0; start < value.size(); ) {
+            size_t quoteAt = min(value.find('"', start), value.size());
+            buffer.append(value.substr(start, quoteAt - start));
+            if (quoteAt < value.size()) buffer.append("\"\"");
+            start = quoteAt + 1;
+        }
+        buffer += '"';
+    }
+
+    // Copies runs of plain characters whole; only quotes, backslashes and
+    // control characters are escaped
+    void appendJson(string_view value) {
+        static const char HEX[] = "0123456789abcdef";
+        buffer += '"';
+        size_t start = 0;
+        for (size_t i = 0; i < value.size(); i++) {
+            unsigned char c = (unsigned char)value[i];
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            buffer.append(value.substr(start, i - start));
+            if (c == '"' || c == '\\') {
+                buffer += '\\';
+                buffer += (char)c;
+            } else {
+                buffer.append("\\u00");
+                buffer += HEX[c >> 4];
+                buffer += HEX[c & 15];
+            }
+            start = i + 1;
+        }
+        buffer.append(value.substr(start));
+        buffer += '"';
+    }
+
+    // Pads or cuts a table cell to its width; the last column is left as is
+    void appendCell(string_view value, const Column& col) {
+        bool last = true;
+        for (size_t i = &col - columns.data() + 1; i < columns.size() && last; i++) last = !shows(columns[i]);
+        if (last) {
+            buffer.append(value);
+            return;
+        }
+        size_t width = (size_t)col.width;
+        if (value.size() >= width) {
+            buffer.append(value.substr(0, width - 1));
+            buffer += ' ';
+        } else {
+            buffer.append(value);
+            buffer.append(width - value.size(), ' ');
+        }
+    }
+
+    // Starts the next shown field; false if the column is not shown
+    bool nextField(const Column*& col) {
+        col = &columns[column++];
+        if (!shows(*col)) return false;
+        if (layout == RECORDS) {
+            buffer.append(prefixes[column - 1]);
+        } else if (layout == CSV && fieldsInRow > 0) {
+            buffer += ',';
+        } else if (layout == JSONL) {
+            buffer += fieldsInRow > 0 ? ',' : '{';
+            buffer.append(prefixes[column - 1]);
+        }
+        fieldsInRow++;
+        return true;
+    }
+
+    void writeHeader() {
+        for (column = 0; column < columns.size(); column++) {
+            const Column& col = columns[column];
+            if (!shows(col)) continue;
+            if (layout == TABLE) {
+                appendCell(col.label, col);
+            } else {
+                if (fieldsInRow++ > 0) buffer += ',';
+                buffer.append(col.key);
+            }
+        }
+        buffer += '\n';
+        if (layout == TABLE) {
+            size_t width = 0;
+            for (const Column& col : columns) width += shows(col) ? (size_t)col.width : 0;
+            buffer.append(width, '-');
+            buffer += '\n';
+        }
+    }
+
+public:
+    ListingWriter(ostream& out, Format format, const vector<Column>& columns)
+        : out(out), layout(format), columns(columns), column(0), fieldsInRow(0), rowCount(0) {
+        for (const Column& col : columns) {
+            if (layout == RECORDS) prefixes.push_back(string(col.label) + ": ");
+            if (layout == JSONL) prefixes.push_back("\"" + string(col.key) + "\":"); // keys are plain identifiers
+        }
+        buffer.reserve(FLUSH_BYTES + 4096);
+    }
+
+    ~ListingWriter() { flush(); }
+
+    ListingWriter(const ListingWriter&) = delete;
+    ListingWriter& operator=(const ListingWriter&) = delete;
+
+    Format format() const { return layout; }
+    size_t rows() const { return rowCount; }
+
+    void beginRow() {
+        if (rowCount == 0 && (layout == TABLE || layout == CSV)) writeHeader();
+        column = 0;
+        fieldsInRow = 0;
+    }
+
+    void field(string_view value) {
+        const Column* col;
+        if (!nextField(col)) return;
+        switch (layout) {
+            case RECORDS: buffer.append(value); buffer += '\n'; break;
+            case TABLE: appendCell(value, *col); break;
+            case CSV: appendCsv(value); break;
+            case JSONL: appendJson(value); break;
+        }
+    }
+
+    void field(int64_t value) {
+        if (layout != TABLE) {
+            const Column* col;
+            if (!nextField(col)) return;
+            appendNumber(value);
+            if (layout == RECORDS) buffer += '\n';
+        } else {
+            char digits[24];
+            field(string_view(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+        }
+    }
+
+    // Text at the console, a number in exports
+    void field(string_view text, int64_t value) {
+        if (layout == RECORDS || layout == TABLE) {
+            field(text);
+        } else {
+            field(value);
+        }
+    }
+
+    // Leaves a field out of this row: an empty cell in tables and CSV
+    void skip() {
+        if (layout == TABLE || layout == CSV) {
+            field(string_view());
+        } else {
+            column++;
+        }
+    }
+
+    void endRow() {
+        if (layout == JSONL) buffer += fieldsInRow > 0 ? "}" : "{}";
+        if (layout != RECORDS) buffer += '\n';
+        rowCount++;
+        if (buffer.size() >= FLUSH_BYTES) flush();
+    }
+
+    // Free text between rows; console layouts only
+    void text(string_view value) {
+        if (layout == RECORDS || layout == TABLE) buffer.append(value);
+    }
+
+    // Moves the rows written so far onto the end of target, for callers
+    // that assemble their own output, such as server replies
+    void drainTo(string& target) {
+        target.append(buffer);
+        buffer.clear();
+    }
+
+    void flush() {
+        if (buffer.empty()) return;
+        out.write(buffer.data(), (streamsize)buffer.size());
+        out.flush();
+        buffer.clear();
+    }
+};
+
+// Which copies of a title are on the shelf, as a bitmap over copy numbers.
+// The first 64 copies live inline, so single-copy titles need no extra
+// allocation; larger holdings spill to a heap array of words.
+class CopyShelf {
+private:
+    atomic<uint64_t> first;              // copies 0-63
+    unique_ptr<atomic<uint64_t>[]> rest; // copies 64 and up
+    uint32_t words;
+
+    atomic<uint64_t>& word(uint32_t index) { return index == 0 ? first : rest[index - 1]; }
+    const atomic<uint64_t>& word(uint32_t index) const { return index == 0 ? first : rest[index - 1]; }
+
+    static uint64_t bitOf(uint32_t copy) { return 1ULL << (copy % 64); }
+
+public:
+    CopyShelf() : first(0), words(1) {}
+
+    // Shelves the new copies [from, to). Not safe alongside take and put.
+    void addCopies(uint32_t from, uint32_t to) {
+        uint32_t needed = max<uint32_t>(1, (to + 63) / 64);
+        if (needed > words) {
+            unique_ptr<atomic<uint64_t>[]> grown(new atomic<uint64_t>[needed - 1]);
+            for (uint32_t i = 1; i < needed; i++) grown[i - 1] = i < words ? rest[i - 1].load() : 0;
+            rest = move(grown);
+            words = needed;
+        }
+        for (uint32_t copy = from; copy < to; copy++) word(copy / 64).fetch_or(bitOf(copy));
+    }
+
+    // Takes the lowest-numbered copy on the shelf; -1 if none
+    int32_t take() {
+        for (uint32_t index = 0; index < words; index++) {
+            atomic<uint64_t>& bits = word(index);
+            uint64_t current = bits.load();
+            while (current) {
+                uint64_t lowest = current & (~current + 1);
+                if (bits.compare_exchange_weak(current, current & ~lowest)) {
+                    return (int32_t)(index * 64 + __builtin_ctzll(lowest));
+                }
+            }
+        }
+        return -1;
+    }
+
+    // Takes one particular copy; false if it is not on the shelf
+    bool take(uint32_t copy) {
+        return (word(copy / 64).fetch_and(~bitOf(copy)) & bitOf(copy)) != 0;
+    }
+
+    void put(uint32_t copy) { word(copy / 64).fetch_or(bitOf(copy)); }
+};
+
+// Book class to represent a title and its physical copies
 class Book {
 public:
-    string isbn;
+    static const uint32_t MAX_COPIES = 4096;
+
+    IsbnKey isbn;
     string title;
     string author;
     string genre;
-    bool isAvailable;
-    int borrowCount;
+    uint32_t totalCopies;
+    atomic<uint32_t> availableCopies; // reserved by CAS when issuing
+    CopyShelf shelf;                  // which copies are in
+    atomic<int> borrowCount;
+    uint32_t bookId; // dense ID assigned when the book is registered
 
-    Book() : isAvailable(true), borrowCount(0) {}
+    Book() : isbn(NO_ISBN), totalCopies(1), availableCopies(1), borrowCount(0), bookId(0) {
+        shelf.addCopies(0, 1);
+    }
     
-    Book(string isbn, string title, string author, string genre) 
+    Book(IsbnKey isbn, string title, string author, string genre) 
         : isbn(isbn), title(title), author(author), genre(genre), 
-          isAvailable(true), borrowCount(0) {}
+          totalCopies(1), availableCopies(1), borrowCount(0), bookId(0) {
+        shelf.addCopies(0, 1);
+    }
+
+    bool isAvailable() const { return availableCopies.load() > 0; }
+    bool allCopiesIn() const { return availableCopies.load() == totalCopies; }
+
+    // Claims any copy that is in and returns its number, or -1 if every
+    // copy is out. The counter is decremented first, which reserves one
+    // of the shelf bits for this caller.
+    int32_t claimCopy() {
+        uint32_t available = availableCopies.load();
+        do {
+            if (available == 0) return -1;
+        } while (!availableCopies.compare_exchange_weak(available, available - 1));
+        int32_t copy;
+        while ((copy = shelf.take()) < 0) {} // a racing return shelves its bit before counting it
+        return copy;
+    }
+
+    // Claims one particular copy, when restoring a logged or saved loan
+    bool claimCopy(uint32_t copy) {
+        if (copy >= totalCopies || !shelf.take(copy)) return false;
+        availableCopies--;
+        return true;
+    }
+
+    void returnCopy(uint32_t copy) {
+        shelf.put(copy);
+        availableCopies++;
+    }
+
+    // Adds copies, all in. Not safe alongside circulation workers.
+    void addCopies(uint32_t count) {
+        shelf.addCopies(totalCopies, totalCopies + count);
+        totalCopies += count;
+        availableCopies += count;
+    }
+
+    // Listing columns; copy counts are text at the console, numbers in exports
+    static const vector<ListingWriter::Column>& columns() {
+        static const vector<ListingWriter::Column> all = {
+            {"ISBN", "isbn", 16, ListingWriter::ALL},
+            {"Title", "title", 36, ListingWriter::ALL},
+            {"Author", "author", 22, ListingWriter::ALL},
+            {"Genre", "genre", 14, ListingWriter::ALL},
+            {"Copies", "copies", 0, ListingWriter::DATA},
+            {"Available", "available", 15, ListingWriter::ALL},
+            {"Borrow Count", "borrow_count", 12, ListingWriter::ALL},
+        };
+        return all;
+    }
+
+    void render(ListingWriter& out) const {
+        uint32_t available = availableCopies.load();
+        out.beginRow();
+        out.field(formatIsbn(isbn));
+        out.field(title);
+        out.field(author);
+        out.field(genre);
+        out.field((int64_t)totalCopies);
+        if (totalCopies == 1) {
+            out.field(available > 0 ? "Yes" : "No", available);
+        } else {
+            char text[48];
+            char* end = to_chars(text, text + 10, available).ptr;
+            end = copy_n(" of ", 4, end);
+            end = to_chars(end, end + 10, totalCopies).ptr;
+            end = copy_n(" copies", 7, end);
+            out.field(string_view(text, end - text), available);
+        }
+        out.field((int64_t)borrowCount.load());
+        out.endRow();
+    }
 
     void display() const {
-        cout << "ISBN: " << isbn << "\n"
-             << "Title: " << title << "\n"
-             << "Author: " << author << "\n"
-             << "Genre: " << genre << "\n"
-             << "Available: " << (isAvailable ? "Yes" : "No") << "\n"
-             << "Borrow Count: " << borrowCount << "\n";
+        ListingWriter out(cout, ListingWriter::RECORDS, columns());
+        render(out);
     }
 };
 
-// Node for User Linked List
-class UserNode {
+// A user's current loans as book IDs, kept in borrowing order, each with
+// the number of the copy issued and the handle of its due date (see
+// DueDateWheel). Up to eight loans live inline with a 64-bit signature
+// for quick misses; larger sets spill to heap arrays paired with a hash
+// set for membership tests.
+class LoanSet {
+private:
+    static const uint32_t INLINE_CAPACITY = 8;
+    uint32_t inlineIds[INLINE_CAPACITY];
+    uint16_t inlineCopies[INLINE_CAPACITY];
+    uint32_t inlineDue[INLINE_CAPACITY];
+    uint32_t count;
+    uint64_t signature; // bit (id % 64) set for each inline loan
+    vector<uint32_t> spilled;
+    vector<uint16_t> spilledCopies;
+    vector<uint32_t> spilledDue;
+    unordered_set<uint32_t> spilledMembers;
+
+    bool isSpilled() const { return !spilled.empty(); }
+
+    static uint64_t bitFor(uint32_t bookId) { return 1ULL << (bookId & 63); }
+
 public:
-    User* user;
-    UserNode* next;
-    
-    UserNode(User* u) : user(u), next(nullptr) {}
+    LoanSet() : count(0), signature(0) {}
+
+    const uint32_t* begin() const { return isSpilled() ? spilled.data() : inlineIds; }
+    const uint32_t* end() const { return begin() + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    bool contains(uint32_t bookId) const {
+        if (isSpilled()) return spilledMembers.count(bookId) != 0;
+        if (!(signature & bitFor(bookId))) return false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (inlineIds[i] == bookId) return true;
+        }
+        return false;
+    }
+
+    // Copy numbers and due date handles, parallel to begin()..end()
+    const uint16_t* copies() const { return isSpilled() ? spilledCopies.data() : inlineCopies; }
+    const uint32_t* dueHandles() const { return isSpilled() ? spilledDue.data() : inlineDue; }
+
+    void push(uint32_t bookId, uint32_t copy, uint32_t dueHandle) {
+        if (!isSpilled() && count == INLINE_CAPACITY) {
+            spilled.assign(inlineIds, inlineIds + count);
+            spilledCopies.assign(inlineCopies, inlineCopies + count);
+            spilledDue.assign(inlineDue, inlineDue + count);
+            spilledMembers.insert(inlineIds, inlineIds + count);
+            signature = 0;
+        }
+        if (isSpilled()) {
+            spilled.push_back(bookId);
+            spilledCopies.push_back((uint16_t)copy);
+            spilledDue.push_back(dueHandle);
+            spilledMembers.insert(bookId);
+        } else {
+            inlineIds[count] = bookId;
+            inlineCopies[count] = (uint16_t)copy;
+            inlineDue[count] = dueHandle;
+            signature |= bitFor(bookId);
+        }
+        count++;
+    }
+
+    // Removes a loan, keeping the others in order, and reports which copy
+    // it was and its due date handle; false if not held
+    bool remove(uint32_t bookId, uint32_t& copy, uint32_t& dueHandle) {
+        if (!contains(bookId)) return false;
+        uint32_t* ids = isSpilled() ? spilled.data() : inlineIds;
+        uint16_t* copyNumbers = isSpilled() ? spilledCopies.data() : inlineCopies;
+        uint32_t* due = isSpilled() ? spilledDue.data() : inlineDue;
+        uint32_t index = 0;
+        while (ids[index] != bookId) index++;
+        copy = copyNumbers[index];
+        dueHandle = due[index];
+        memmove(ids + index, ids + index + 1, (count - index - 1) * sizeof(uint32_t));
+        memmove(copyNumbers + index, copyNumbers + index + 1, (count - index - 1) * sizeof(uint16_t));
+        memmove(due + index, due + index + 1, (count - index - 1) * sizeof(uint32_t));
+        count--;
+        if (isSpilled()) {
+            spilled.pop_back();
+            spilledCopies.pop_back();
+            spilledDue.pop_back();
+            spilledMembers.erase(bookId);
+        } else {
+            signature = 0;
+            for (uint32_t i = 0; i < count; i++) signature |= bitFor(inlineIds[i]);
+        }
+        return true;
+    }
 };
 
 // User class
@@ -56,639 +629,7517 @@ public:
     int userId;
     string name;
     string email;
-    queue<string> borrowedBooks; // Queue for FIFO book management
+    LoanSet borrowedBooks; // borrowed books with their copies and due dates, oldest loan first
+    uint32_t fines; // cents owed for late returns
+    bool active; // false once the user is deregistered
     
-    User() : userId(0) {}
+    User() : userId(0), fines(0), active(true) {}
     
     User(int id, string name, string email) 
-        : userId(id), name(name), email(email) {}
+        : userId(id), name(name), email(email), fines(0), active(true) {}
+
+    static const vector<ListingWriter::Column>& columns() {
+        static const vector<ListingWriter::Column> all = {
+            {"User ID", "user_id", 9, ListingWriter::ALL},
+            {"Name", "name", 24, ListingWriter::ALL},
+            {"Email", "email", 32, ListingWriter::ALL},
+            {"Books Borrowed", "loans", 16, ListingWriter::ALL},
+            {"Fines Owed", "fines_cents", 10, ListingWriter::ALL},
+        };
+        return all;
+    }
+
+    // Records leave out fines when none are owed
+    void render(ListingWriter& out) const { render(out, borrowedBooks.size(), fines); }
+
+    // With loan and fine figures read elsewhere, e.g. from a ledger view
+    void render(ListingWriter& out, size_t loans, uint32_t fines) const {
+        out.beginRow();
+        out.field((int64_t)userId);
+        out.field(name);
+        out.field(email);
+        out.field((int64_t)loans);
+        if (fines == 0 && out.format() == ListingWriter::RECORDS) {
+            out.skip();
+        } else {
+            out.field(formatCents(fines), fines);
+        }
+        out.endRow();
+    }
 
     void display() const {
-        cout << "User ID: " << userId << "\n"
-             << "Name: " << name << "\n"
-             << "Email: " << email << "\n"
-             << "Books Borrowed: " << borrowedBooks.size() << "\n";
+        ListingWriter out(cout, ListingWriter::RECORDS, columns());
+        render(out);
     }
 };
 
-// Hash Table for Book Inventory with Chaining for collision resolution
-class BookHashTable {
-private:
-    static const int TABLE_SIZE = 100;
-    vector<vector<Book*>> table;
-    
-    int hashFunction(const string& key) {
-        int hash = 0;
-        for (char c : key) {
-            hash = (hash * 31 + c) % TABLE_SIZE;
+// 64-bit key hash (murmur3 finalizer); a bijection, so distinct keys never
+// collide in the full hash
+inline uint64_t hashKey(uint64_t key) {
+    uint64_t hash = key;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// CRC-32 (IEEE) used to detect torn or corrupt log records
+inline uint32_t crc32(const void* data, size_t size) {
+    static const vector<uint32_t> table = []() {
+        vector<uint32_t> entries(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
         }
-        return hash;
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// LEB128 varints for compressed posting lists
+inline void putVarint(vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
     }
+    out.push_back((uint8_t)value);
+}
 
-public:
-    BookHashTable() : table(TABLE_SIZE) {}
-    
-    void insert(Book* book) {
-        int index = hashFunction(book->isbn);
-        table[index].push_back(book);
+inline uint32_t getVarint(const uint8_t*& in) {
+    uint32_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t byte = *in++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) return value;
     }
-    
-    Book* search(const string& isbn) {
-        int index = hashFunction(isbn);
-        for (Book* book : table[index]) {
-            if (book->isbn == isbn) {
-                return book;
-            }
-        }
-        return nullptr;
+}
+
+// Appends fixed-width values and length-prefixed strings to a byte buffer
+class BinaryWriter {
+private:
+    vector<char>& out;
+
+public:
+    explicit BinaryWriter(vector<char>& out) : out(out) {}
+
+    template <typename T>
+    void put(const T& value) {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
     }
-    
-    void remove(const string& isbn) {
-        int index = hashFunction(isbn);
-        auto& chain = table[index];
-        for (auto it = chain.begin(); it != chain.end(); ++it) {
-            if ((*it)->isbn == isbn) {
-                delete *it;
-                chain.erase(it);
-                return;
-            }
-        }
+
+    void putBytes(const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        out.insert(out.end(), bytes, bytes + size);
     }
-    
-    vector<Book*> getAllBooks() {
-        vector<Book*> allBooks;
-        for (const auto& chain : table) {
-            for (Book* book : chain) {
-                allBooks.push_back(book);
-            }
-        }
-        return allBooks;
+
+    void putString(const string& value) {
+        put<uint32_t>((uint32_t)value.size());
+        putBytes(value.data(), value.size());
     }
-};
 
-// Binary Search Tree for efficient searching
-class BSTNode {
-public:
-    Book* book;
-    BSTNode* left;
-    BSTNode* right;
-    
-    BSTNode(Book* b) : book(b), left(nullptr), right(nullptr) {}
+    size_t size() const { return out.size(); }
 };
 
-class BookBST {
+// Bounds-checked reader over a byte range; ok() turns false on overrun
+class BinaryReader {
 private:
-    BSTNode* root;
-    
-    BSTNode* insert(BSTNode* node, Book* book) {
-        if (!node) return new BSTNode(book);
-        
-        if (book->title < node->book->title) {
-            node->left = insert(node->left, book);
-        } else {
-            node->right = insert(node->right, book);
+    const char* pos;
+    const char* end;
+    bool valid;
+
+public:
+    BinaryReader(const char* data, size_t size) : pos(data), end(data + size), valid(true) {}
+
+    template <typename T>
+    T get() {
+        T value{};
+        if ((size_t)(end - pos) < sizeof(T)) {
+            valid = false;
+            return value;
         }
-        return node;
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
     }
-    
-    Book* search(BSTNode* node, const string& title) {
-        if (!node) return nullptr;
-        
-        if (title == node->book->title) return node->book;
-        
-        if (title < node->book->title) {
-            return search(node->left, title);
-        } else {
-            return search(node->right, title);
+
+    const char* getBytes(size_t size) {
+        if ((size_t)(end - pos) < size) {
+            valid = false;
+            return nullptr;
         }
+        const char* bytes = pos;
+        pos += size;
+        return bytes;
     }
-    
-    void inorderTraversal(BSTNode* node, vector<Book*>& books) {
-        if (node) {
-            inorderTraversal(node->left, books);
-            books.push_back(node->book);
-            inorderTraversal(node->right, books);
+
+    string getString() {
+        uint32_t size = get<uint32_t>();
+        const char* bytes = getBytes(size);
+        return bytes ? string(bytes, size) : string();
+    }
+
+    bool ok() const { return valid; }
+    bool atEnd() const { return pos == end; }
+};
+
+// Normalised lookup key: trimmed, lower-cased, internal whitespace collapsed
+inline string normaliseKey(const string& value) {
+    string key;
+    key.reserve(value.size());
+    bool pendingSpace = false;
+    for (unsigned char c : value) {
+        if (isspace(c)) {
+            pendingSpace = !key.empty();
+            continue;
+        }
+        if (pendingSpace) {
+            key += ' ';
+            pendingSpace = false;
         }
+        key += (char)tolower(c);
     }
+    return key;
+}
+
+// Wall-clock time in seconds, shifted by an adjustable offset so that
+// day-based features can be exercised without waiting for days to pass
+class LibraryClock {
+private:
+    atomic<int64_t> offset;
 
 public:
-    BookBST() : root(nullptr) {}
-    
-    void insert(Book* book) {
-        root = insert(root, book);
+    static const int64_t SECONDS_PER_DAY = 86400;
+
+    LibraryClock() : offset(0) {}
+
+    int64_t now() const {
+        return chrono::duration_cast<chrono::seconds>(
+                   chrono::system_clock::now().time_since_epoch()).count() + offset;
     }
-    
-    Book* searchByTitle(const string& title) {
-        return search(root, title);
+
+    void advance(int64_t seconds) { offset += seconds; }
+
+    static int64_t dayOf(int64_t time) {
+        return time >= 0 ? time / SECONDS_PER_DAY : (time + 1) / SECONDS_PER_DAY - 1;
     }
-    
-    vector<Book*> getSortedBooks() {
-        vector<Book*> books;
-        inorderTraversal(root, books);
-        return books;
+
+    // UTC date, e.g. 2024-03-01
+    static string formatDate(int64_t time) {
+        time_t seconds = (time_t)time;
+        tm parts{};
+        gmtime_r(&seconds, &parts);
+        char buffer[16];
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d", &parts);
+        return buffer;
     }
 };
 
-// User Management using Linked List
-class UserLinkedList {
+// Typed slab allocator. Objects are constructed in place in large chunks, so
+// allocation is usually a pointer bump and objects created together share
+// pages. Freed slots are recycled through an intrusive free list. Teardown
+// releases whole chunks; only types with a non-trivial destructor need a
+// pass over the slots to destroy whatever is still live.
+template <typename T, size_t CHUNK_OBJECTS = 4096>
+class ObjectPool {
 private:
-    UserNode* head;
-    int nextUserId;
+    union Slot {
+        Slot* nextFree;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    vector<Slot*> chunks;
+    size_t used;     // slots handed out from the newest chunk
+    Slot* freeList;
+    size_t live;
 
 public:
-    UserLinkedList() : head(nullptr), nextUserId(1) {}
-    
-    User* addUser(const string& name, const string& email) {
-        User* newUser = new User(nextUserId++, name, email);
-        UserNode* newNode = new UserNode(newUser);
-        
-        if (!head) {
-            head = newNode;
-        } else {
-            newNode->next = head;
-            head = newNode;
+    ObjectPool() : used(CHUNK_OBJECTS), freeList(nullptr), live(0) {}
+
+    ~ObjectPool() {
+        if (!is_trivially_destructible<T>::value && live > 0) {
+            unordered_set<Slot*> freed;
+            for (Slot* slot = freeList; slot; slot = slot->nextFree) freed.insert(slot);
+            for (size_t i = 0; i < chunks.size(); i++) {
+                size_t end = i + 1 == chunks.size() ? used : CHUNK_OBJECTS;
+                for (size_t j = 0; j < end; j++) {
+                    if (!freed.count(&chunks[i][j])) reinterpret_cast<T*>(chunks[i][j].storage)->~T();
+                }
+            }
         }
-        return newUser;
+        for (Slot* chunk : chunks) operator delete(chunk);
     }
-    
-    User* findUser(int userId) {
-        UserNode* current = head;
-        while (current) {
-            if (current->user->userId == userId) {
-                return current->user;
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        Slot* slot;
+        if (freeList) {
+            slot = freeList;
+            freeList = slot->nextFree;
+        } else {
+            if (used == CHUNK_OBJECTS) {
+                chunks.push_back(static_cast<Slot*>(operator new(sizeof(Slot) * CHUNK_OBJECTS)));
+                used = 0;
             }
-            current = current->next;
+            slot = &chunks.back()[used++];
         }
-        return nullptr;
+        T* object = new (slot->storage) T(std::forward<Args>(args)...);
+        live++;
+        return object;
     }
-    
-    vector<User*> getAllUsers() {
-        vector<User*> users;
-        UserNode* current = head;
-        while (current) {
-            users.push_back(current->user);
-            current = current->next;
-        }
-        return users;
+
+    void destroy(T* object) {
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->nextFree = freeList;
+        freeList = slot;
+        live--;
     }
+
+    size_t size() const { return live; }
+    size_t memoryBytes() const { return chunks.size() * CHUNK_OBJECTS * sizeof(Slot); }
 };
 
-// Main Library System
-class LibrarySystem {
+// Hash Table for Book Inventory using open addressing with Robin Hood probing.
+// Slots are stored flat and cache a 32-bit fingerprint of the hash, so a probe
+// only dereferences a Book* when the fingerprint already matches.
+class BookHashTable {
 private:
-    BookHashTable bookInventory;
-    BookBST bookSearchTree;
-    UserLinkedList userManager;
-    queue<pair<int, string>> issueQueue; // Queue for book issue requests
-    queue<pair<int, string>> returnQueue; // Queue for book return requests
-    map<string, int> borrowFrequency; // For most borrowed books report
+    struct Slot {
+        uint32_t fingerprint;
+        uint32_t distance; // probe distance + 1, 0 marks an empty slot
+        Book* book;
+    };
 
-public:
-    void addBook() {
-        string isbn, title, author, genre;
-        cout << "\n--- Add New Book ---\n";
-        cout << "Enter ISBN: ";
-        cin.ignore();
-        getline(cin, isbn);
-        cout << "Enter Title: ";
-        getline(cin, title);
-        cout << "Enter Author: ";
-        getline(cin, author);
-        cout << "Enter Genre: ";
-        getline(cin, genre);
-        
-        // Check if book already exists
-        if (bookInventory.search(isbn)) {
-            cout << "Book with ISBN " << isbn << " already exists!\n";
-            return;
-        }
-        
-        Book* newBook = new Book(isbn, title, author, genre);
-        bookInventory.insert(newBook);
-        bookSearchTree.insert(newBook);
-        
-        cout << "Book added successfully!\n";
+    static const size_t MIN_CAPACITY = 16;
+    vector<Slot> slots;
+    size_t mask;
+    size_t count;
+
+    static uint32_t fingerprintOf(uint64_t hash) {
+        return (uint32_t)(hash >> 32);
     }
-    
-    void addUser() {
+
+    // Robin Hood insert: an entry that has probed further than the resident
+    // one takes its slot, keeping probe sequences short and uniform.
+    void place(Slot entry, uint64_t hash) {
+        size_t index = hash & mask;
+        entry.distance = 1;
+        while (true) {
+            Slot& slot = slots[index];
+            if (slot.distance == 0) {
+                slot = entry;
+                return;
+            }
+            if (slot.distance < entry.distance) {
+                swap(slot, entry);
+            }
+            index = (index + 1) & mask;
+            entry.distance++;
+        }
+    }
+
+    void rehash(size_t newCapacity) {
+        vector<Slot> old(newCapacity, Slot{0, 0, nullptr});
+        old.swap(slots);
+        mask = newCapacity - 1;
+        for (const Slot& slot : old) {
+            if (slot.distance != 0) {
+                place(slot, hashKey(slot.book->isbn));
+            }
+        }
+    }
+
+    // Maximum load factor is 7/8; growing doubles the table
+    void growIfNeeded(size_t required) {
+        size_t capacity = slots.size();
+        while (required * 8 > capacity * 7) {
+            capacity *= 2;
+        }
+        if (capacity != slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    long findIndex(IsbnKey isbn) const {
+        uint64_t hash = hashKey(isbn);
+        uint32_t fingerprint = fingerprintOf(hash);
+        size_t index = hash & mask;
+        for (uint32_t distance = 1; ; distance++) {
+            const Slot& slot = slots[index];
+            // Robin Hood invariant: once the resident is closer to home than
+            // we would be, the key cannot be further along.
+            if (slot.distance < distance) return -1;
+            if (slot.fingerprint == fingerprint && slot.book->isbn == isbn) {
+                return (long)index;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+public:
+    BookHashTable() : slots(MIN_CAPACITY, Slot{0, 0, nullptr}), mask(MIN_CAPACITY - 1), count(0) {}
+
+    // Pre-size the table for an expected number of books
+    void reserve(size_t expected) {
+        growIfNeeded(expected);
+    }
+
+    void insert(Book* book) {
+        growIfNeeded(count + 1);
+        uint64_t hash = hashKey(book->isbn);
+        place(Slot{fingerprintOf(hash), 0, book}, hash);
+        count++;
+    }
+
+    Book* search(IsbnKey isbn) const {
+        long index = findIndex(isbn);
+        return index < 0 ? nullptr : slots[index].book;
+    }
+
+    // Unlinks a book; the caller owns and frees it
+    Book* remove(IsbnKey isbn) {
+        long found = findIndex(isbn);
+        if (found < 0) return nullptr;
+
+        Book* book = slots[found].book;
+
+        // Backward-shift deletion: pull the following displaced entries one
+        // slot closer to home instead of leaving a tombstone.
+        size_t index = (size_t)found;
+        size_t next = (index + 1) & mask;
+        while (slots[next].distance > 1) {
+            slots[index] = slots[next];
+            slots[index].distance--;
+            index = next;
+            next = (next + 1) & mask;
+        }
+        slots[index] = Slot{0, 0, nullptr};
+        count--;
+        return book;
+    }
+
+    vector<Book*> getAllBooks() const {
+        vector<Book*> allBooks;
+        allBooks.reserve(count);
+        for (const Slot& slot : slots) {
+            if (slot.distance != 0) {
+                allBooks.push_back(slot.book);
+            }
+        }
+        return allBooks;
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return slots.size(); }
+    double loadFactor() const { return (double)count / slots.size(); }
+
+    size_t maxProbeLength() const {
+        uint32_t longest = 0;
+        for (const Slot& slot : slots) {
+            longest = max(longest, slot.distance);
+        }
+        return longest;
+    }
+};
+
+// B+ Tree title index. Entries are ordered by (title, isbn), so duplicate
+// titles are kept side by side. Nodes hold a fixed number of keys with the
+// first 8 title bytes cached inline, which resolves most comparisons without
+// touching the Book. Leaves are linked for ordered scans.
+class BookBPlusTree {
+private:
+    static const int NODE_CAPACITY = 32;
+    static const int MIN_KEYS = NODE_CAPACITY / 2;
+
+    struct Node {
+        bool isLeaf;
+        int count;
+        uint64_t prefixes[NODE_CAPACITY];
+        // Leaf: the entries. Internal: separators, each the smallest entry
+        // of the subtree to its right.
+        Book* books[NODE_CAPACITY];
+        Node* children[NODE_CAPACITY + 1]; // internal nodes only
+        Node* next;                        // leaf chain
+        Node* prev;
+
+        Node(bool leaf) : isLeaf(leaf), count(0), next(nullptr), prev(nullptr) {}
+    };
+
+    // Search key; NO_ISBN sorts before every entry with the same title
+    struct Key {
+        uint64_t prefix;
+        const string* title;
+        IsbnKey isbn;
+    };
+
+    ObjectPool<Node, 256> nodes; // every node of the tree; freed with it
+    Node* root;
+    size_t entryCount;
+
+    static uint64_t titlePrefix(const string& title) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; i++) {
+            prefix = (prefix << 8) | (i < title.size() ? (unsigned char)title[i] : 0);
+        }
+        return prefix;
+    }
+
+    static Key keyOf(const Book* book) {
+        return Key{titlePrefix(book->title), &book->title, book->isbn};
+    }
+
+    // Compares slot i of a node against a key: <0, 0 or >0
+    static int compare(const Node* node, int i, const Key& key) {
+        if (node->prefixes[i] != key.prefix) {
+            return node->prefixes[i] < key.prefix ? -1 : 1;
+        }
+        const Book* book = node->books[i];
+        int c = book->title.compare(*key.title);
+        if (c != 0) return c;
+        if (book->isbn == key.isbn) return 0;
+        return book->isbn < key.isbn ? -1 : 1;
+    }
+
+    // First slot whose entry is >= key
+    static int lowerBound(const Node* node, const Key& key) {
+        int low = 0, high = node->count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (compare(node, mid, key) < 0) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    // Child to descend into: number of separators <= key
+    static int childIndex(const Node* node, const Key& key) {
+        int low = 0, high = node->count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (compare(node, mid, key) <= 0) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    static void setKey(Node* node, int i, uint64_t prefix, Book* book) {
+        node->prefixes[i] = prefix;
+        node->books[i] = book;
+    }
+
+    static void copyKey(Node* to, int i, const Node* from, int j) {
+        to->prefixes[i] = from->prefixes[j];
+        to->books[i] = from->books[j];
+    }
+
+    static void shiftKeys(Node* node, int from, int by) {
+        int n = node->count - from;
+        memmove(node->prefixes + from + by, node->prefixes + from, n * sizeof(uint64_t));
+        memmove(node->books + from + by, node->books + from, n * sizeof(Book*));
+    }
+
+    static void shiftChildren(Node* node, int from, int by) {
+        int n = node->count + 1 - from;
+        memmove(node->children + from + by, node->children + from, n * sizeof(Node*));
+    }
+
+    // Descends to the leaf for key, recording (node, child index) pairs
+    Node* findLeaf(const Key& key, vector<pair<Node*, int>>* path) const {
+        Node* node = root;
+        while (!node->isLeaf) {
+            int index = childIndex(node, key);
+            if (path) path->push_back({node, index});
+            node = node->children[index];
+        }
+        return node;
+    }
+
+    // Inserts separator (prefix, book) and its right child into path[level]
+    void insertIntoParent(vector<pair<Node*, int>>& path, int level,
+                          uint64_t prefix, Book* book, Node* right) {
+        if (level < 0) {
+            Node* newRoot = nodes.create(false);
+            newRoot->children[0] = root;
+            newRoot->children[1] = right;
+            setKey(newRoot, 0, prefix, book);
+            newRoot->count = 1;
+            root = newRoot;
+            return;
+        }
+
+        Node* node = path[level].first;
+        int index = path[level].second;
+        if (node->count < NODE_CAPACITY) {
+            shiftKeys(node, index, 1);
+            shiftChildren(node, index + 1, 1);
+            setKey(node, index, prefix, book);
+            node->children[index + 1] = right;
+            node->count++;
+            return;
+        }
+
+        // Split a full internal node around its middle separator
+        uint64_t prefixes[NODE_CAPACITY + 1];
+        Book* books[NODE_CAPACITY + 1];
+        Node* children[NODE_CAPACITY + 2];
+        for (int i = 0, j = 0; i <= NODE_CAPACITY; i++) {
+            if (i == index) {
+                prefixes[i] = prefix;
+                books[i] = book;
+            } else {
+                prefixes[i] = node->prefixes[j];
+                books[i] = node->books[j];
+                j++;
+            }
+        }
+        for (int i = 0, j = 0; i <= NODE_CAPACITY + 1; i++) {
+            children[i] = (i == index + 1) ? right : node->children[j++];
+        }
+
+        int mid = (NODE_CAPACITY + 1) / 2;
+        Node* sibling = nodes.create(false);
+        node->count = mid;
+        for (int i = 0; i < mid; i++) setKey(node, i, prefixes[i], books[i]);
+        for (int i = 0; i <= mid; i++) node->children[i] = children[i];
+
+        sibling->count = NODE_CAPACITY - mid;
+        for (int i = 0; i < sibling->count; i++) {
+            setKey(sibling, i, prefixes[mid + 1 + i], books[mid + 1 + i]);
+        }
+        for (int i = 0; i <= sibling->count; i++) {
+            sibling->children[i] = children[mid + 1 + i];
+        }
+        insertIntoParent(path, level - 1, prefixes[mid], books[mid], sibling);
+    }
+
+    // Restores minimum occupancy of path[level]'s child after a removal
+    void rebalance(vector<pair<Node*, int>>& path, int level) {
+        Node* parent = path[level].first;
+        int index = path[level].second;
+        Node* node = parent->children[index];
+        if (node->count >= MIN_KEYS) return;
+
+        Node* left = index > 0 ? parent->children[index - 1] : nullptr;
+        Node* right = index < parent->count ? parent->children[index + 1] : nullptr;
+
+        if (left && left->count > MIN_KEYS) {
+            shiftKeys(node, 0, 1);
+            if (node->isLeaf) {
+                copyKey(node, 0, left, left->count - 1);
+                copyKey(parent, index - 1, node, 0);
+            } else {
+                shiftChildren(node, 0, 1);
+                copyKey(node, 0, parent, index - 1);
+                node->children[0] = left->children[left->count];
+                copyKey(parent, index - 1, left, left->count - 1);
+            }
+            left->count--;
+            node->count++;
+            return;
+        }
+
+        if (right && right->count > MIN_KEYS) {
+            if (node->isLeaf) {
+                copyKey(node, node->count, right, 0);
+                shiftKeys(right, 1, -1);
+                right->count--;
+                copyKey(parent, index, right, 0);
+            } else {
+                copyKey(node, node->count, parent, index);
+                node->children[node->count + 1] = right->children[0];
+                copyKey(parent, index, right, 0);
+                shiftKeys(right, 1, -1);
+                shiftChildren(right, 1, -1);
+                right->count--;
+            }
+            node->count++;
+            return;
+        }
+
+        // Merge with a sibling; the right node of the pair is freed
+        if (left) {
+            node = left;
+            index--;
+        }
+        Node* victim = parent->children[index + 1];
+        if (node->isLeaf) {
+            for (int i = 0; i < victim->count; i++) {
+                copyKey(node, node->count + i, victim, i);
+            }
+            node->count += victim->count;
+            node->next = victim->next;
+            if (victim->next) victim->next->prev = node;
+        } else {
+            copyKey(node, node->count, parent, index);
+            for (int i = 0; i < victim->count; i++) {
+                copyKey(node, node->count + 1 + i, victim, i);
+            }
+            for (int i = 0; i <= victim->count; i++) {
+                node->children[node->count + 1 + i] = victim->children[i];
+            }
+            node->count += victim->count + 1;
+        }
+        nodes.destroy(victim);
+
+        shiftKeys(parent, index + 1, -1);
+        shiftChildren(parent, index + 2, -1);
+        parent->count--;
+
+        if (level > 0) {
+            rebalance(path, level - 1);
+        } else if (parent->count == 0) {
+            root = parent->children[0];
+            nodes.destroy(parent);
+        }
+    }
+
+    Node* leftmostLeaf() const {
+        Node* node = root;
+        while (!node->isLeaf) node = node->children[0];
+        return node;
+    }
+
+public:
+    // Forward iterator over entries in title order
+    class Iterator {
+    private:
+        Node* leaf;
+        int index;
+
+    public:
+        Iterator(Node* leaf, int index) : leaf(leaf), index(index) {
+            skipExhaustedLeaves();
+        }
+
+        void skipExhaustedLeaves() {
+            while (leaf && index >= leaf->count) {
+                leaf = leaf->next;
+                index = 0;
+            }
+        }
+
+        Book* operator*() const { return leaf->books[index]; }
+
+        Iterator& operator++() {
+            index++;
+            skipExhaustedLeaves();
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return leaf == other.leaf && (leaf == nullptr || index == other.index);
+        }
+        bool operator!=(const Iterator& other) const { return !(*this == other); }
+    };
+
+    BookBPlusTree() : root(nodes.create(true)), entryCount(0) {}
+
+    BookBPlusTree(const BookBPlusTree&) = delete;
+    BookBPlusTree& operator=(const BookBPlusTree&) = delete;
+
+    void insert(Book* book) {
+        Key key = keyOf(book);
+        vector<pair<Node*, int>> path;
+        Node* leaf = findLeaf(key, &path);
+        int index = lowerBound(leaf, key);
+        entryCount++;
+
+        if (leaf->count < NODE_CAPACITY) {
+            shiftKeys(leaf, index, 1);
+            setKey(leaf, index, key.prefix, book);
+            leaf->count++;
+            return;
+        }
+
+        // Split a full leaf, linking the new right half into the chain
+        Node* sibling = nodes.create(true);
+        int mid = (NODE_CAPACITY + 1) / 2;
+        uint64_t prefixes[NODE_CAPACITY + 1];
+        Book* books[NODE_CAPACITY + 1];
+        for (int i = 0, j = 0; i <= NODE_CAPACITY; i++) {
+            if (i == index) {
+                prefixes[i] = key.prefix;
+                books[i] = book;
+            } else {
+                prefixes[i] = leaf->prefixes[j];
+                books[i] = leaf->books[j];
+                j++;
+            }
+        }
+        leaf->count = mid;
+        for (int i = 0; i < mid; i++) setKey(leaf, i, prefixes[i], books[i]);
+        sibling->count = NODE_CAPACITY + 1 - mid;
+        for (int i = 0; i < sibling->count; i++) {
+            setKey(sibling, i, prefixes[mid + i], books[mid + i]);
+        }
+        sibling->next = leaf->next;
+        sibling->prev = leaf;
+        if (leaf->next) leaf->next->prev = sibling;
+        leaf->next = sibling;
+
+        insertIntoParent(path, (int)path.size() - 1, sibling->prefixes[0], sibling->books[0], sibling);
+    }
+
+    // Empties the tree, leaving the books themselves alone
+    void clear() {
+        vector<Node*> pending{root};
+        while (!pending.empty()) {
+            Node* node = pending.back();
+            pending.pop_back();
+            if (!node->isLeaf) {
+                for (int i = 0; i <= node->count; i++) pending.push_back(node->children[i]);
+            }
+            nodes.destroy(node);
+        }
+        root = nodes.create(true);
+        entryCount = 0;
+    }
+
+    // Builds the tree bottom-up in O(n) from books already in (title, isbn)
+    // order. The tree must be empty. Nodes are filled evenly, which keeps
+    // every node at or above minimum occupancy.
+    void bulkLoad(const vector<Book*>& sorted) {
+        if (sorted.empty() || entryCount != 0) return;
+        nodes.destroy(root);
+
+        vector<Node*> level;
+        vector<Book*> minima; // smallest entry under each node of level
+        size_t leaves = (sorted.size() + NODE_CAPACITY - 1) / NODE_CAPACITY;
+        Node* previous = nullptr;
+        for (size_t i = 0; i < leaves; i++) {
+            size_t begin = i * sorted.size() / leaves, end = (i + 1) * sorted.size() / leaves;
+            Node* leaf = nodes.create(true);
+            for (size_t j = begin; j < end; j++) {
+                setKey(leaf, (int)(j - begin), titlePrefix(sorted[j]->title), sorted[j]);
+            }
+            leaf->count = (int)(end - begin);
+            leaf->prev = previous;
+            if (previous) previous->next = leaf;
+            previous = leaf;
+            level.push_back(leaf);
+            minima.push_back(sorted[begin]);
+        }
+
+        while (level.size() > 1) {
+            vector<Node*> parents;
+            vector<Book*> parentMinima;
+            size_t groups = (level.size() + NODE_CAPACITY) / (NODE_CAPACITY + 1);
+            for (size_t i = 0; i < groups; i++) {
+                size_t begin = i * level.size() / groups, end = (i + 1) * level.size() / groups;
+                Node* node = nodes.create(false);
+                for (size_t j = begin; j < end; j++) {
+                    node->children[j - begin] = level[j];
+                    if (j > begin) {
+                        setKey(node, (int)(j - begin - 1), titlePrefix(minima[j]->title), minima[j]);
+                    }
+                }
+                node->count = (int)(end - begin - 1);
+                parents.push_back(node);
+                parentMinima.push_back(minima[begin]);
+            }
+            level.swap(parents);
+            minima.swap(parentMinima);
+        }
+
+        root = level[0];
+        entryCount = sorted.size();
+    }
+
+    // Removes the entry for book; returns false if it is not indexed
+    bool remove(const Book* book) {
+        Key key = keyOf(book);
+        vector<pair<Node*, int>> path;
+        Node* leaf = findLeaf(key, &path);
+        int index = lowerBound(leaf, key);
+        if (index >= leaf->count || leaf->books[index] != book) return false;
+
+        shiftKeys(leaf, index + 1, -1);
+        leaf->count--;
+        entryCount--;
+
+        // The leaf's smallest entry doubles as a separator in the nearest
+        // ancestor where the leaf lies in a right subtree.
+        if (index == 0 && leaf->count > 0) {
+            for (int level = (int)path.size() - 1; level >= 0; level--) {
+                if (path[level].second > 0) {
+                    copyKey(path[level].first, path[level].second - 1, leaf, 0);
+                    break;
+                }
+            }
+        }
+
+        if (!path.empty()) {
+            rebalance(path, (int)path.size() - 1);
+        }
+        return true;
+    }
+
+    // First entry whose title is >= title
+    Iterator lowerBound(const string& title) const {
+        Key key{titlePrefix(title), &title, NO_ISBN};
+        Node* leaf = findLeaf(key, nullptr);
+        return Iterator(leaf, lowerBound(leaf, key));
+    }
+
+    // First entry after (title, isbn), which need not still be in the
+    // tree; resumes a paged listing from its last row
+    Iterator after(const string& title, IsbnKey isbn) const {
+        Key key{titlePrefix(title), &title, isbn};
+        Node* leaf = findLeaf(key, nullptr);
+        int index = lowerBound(leaf, key);
+        if (index < leaf->count && compare(leaf, index, key) == 0) index++;
+        return Iterator(leaf, index);
+    }
+
+    Iterator begin() const { return Iterator(leftmostLeaf(), 0); }
+    Iterator end() const { return Iterator(nullptr, 0); }
+
+    Book* searchByTitle(const string& title) const {
+        Iterator it = lowerBound(title);
+        if (it != end() && (*it)->title == title) return *it;
+        return nullptr;
+    }
+
+    // Visits every entry with from <= title < to, in order; stops early if
+    // the visitor returns false
+    template <typename Visitor>
+    void forEachInRange(const string& from, const string& to, Visitor visit) const {
+        for (Iterator it = lowerBound(from); it != end() && (*it)->title < to; ++it) {
+            if (!visit(*it)) return;
+        }
+    }
+
+    template <typename Visitor>
+    void forEachWithPrefix(const string& prefix, Visitor visit) const {
+        for (Iterator it = lowerBound(prefix); it != end(); ++it) {
+            if ((*it)->title.compare(0, prefix.size(), prefix) != 0) return;
+            if (!visit(*it)) return;
+        }
+    }
+
+    size_t size() const { return entryCount; }
+
+    int height() const {
+        int levels = 1;
+        for (Node* node = root; !node->isLeaf; node = node->children[0]) levels++;
+        return levels;
+    }
+};
+
+// Secondary index from a book attribute (author or genre) to its books.
+// Keys are normalised so lookups ignore case and stray whitespace.
+class BookAttributeIndex {
+private:
+    struct Entry {
+        string label; // spelling of the first book seen with this value
+        vector<Book*> books;
+    };
+    unordered_map<string, Entry> entries;
+
+public:
+    void insert(const string& value, Book* book) {
+        Entry& entry = entries[normaliseKey(value)];
+        if (entry.books.empty()) entry.label = value;
+        entry.books.push_back(book);
+    }
+
+    void remove(const string& value, const Book* book) {
+        auto it = entries.find(normaliseKey(value));
+        if (it == entries.end()) return;
+        vector<Book*>& books = it->second.books;
+        books.erase(std::remove(books.begin(), books.end(), book), books.end());
+        if (books.empty()) entries.erase(it);
+    }
+
+    // Books carrying value, or nullptr if there are none
+    const vector<Book*>* find(const string& value) const {
+        auto it = entries.find(normaliseKey(value));
+        return it == entries.end() ? nullptr : &it->second.books;
+    }
+
+    // Visits (label, books) for every distinct value
+    template <typename Visitor>
+    void forEachValue(Visitor visit) const {
+        for (const auto& entry : entries) {
+            visit(entry.second.label, entry.second.books);
+        }
+    }
+
+    size_t size() const { return entries.size(); }
+};
+
+// Struct-of-arrays view of the catalog, indexed by book ID, for reports that
+// scan every book. Membership and availability (every copy in) are packed
+// bitmaps, so a filter combines 64 books per word and counts them with
+// popcount instead of visiting each Book. Genres are dictionary-encoded with
+// a bitmap per genre; authors are dictionary-encoded into a code column.
+class CatalogColumns {
+public:
+    static constexpr uint32_t ANY = UINT32_MAX;
+
+    struct Filter {
+        bool borrowedOnly;
+        uint32_t genre;  // dictionary code, or ANY
+        uint32_t author; // dictionary code, or ANY
+    };
+
+private:
+    // Columns that circulation workers update are split into fixed chunks,
+    // so growing the catalog never moves a slot another thread is writing
+    static const size_t CHUNK_BOOKS = 1 << 16;
+    struct Chunk {
+        atomic<uint64_t> available[CHUNK_BOOKS / 64];
+        atomic<uint32_t> borrowCounts[CHUNK_BOOKS];
+    };
+
+    struct Dictionary {
+        vector<string> labels; // spelling of the first book seen with each code
+        unordered_map<string, uint32_t> codes; // normalised value -> code
+
+        uint32_t encode(const string& value) {
+            auto inserted = codes.emplace(normaliseKey(value), (uint32_t)labels.size());
+            if (inserted.second) labels.push_back(value);
+            return inserted.first->second;
+        }
+
+        bool find(const string& value, uint32_t& code) const {
+            auto it = codes.find(normaliseKey(value));
+            if (it == codes.end()) return false;
+            code = it->second;
+            return true;
+        }
+    };
+
+    vector<unique_ptr<Chunk>> chunks;
+    vector<uint64_t> live; // books currently in the catalog
+    vector<uint32_t> genreCodes;
+    vector<uint32_t> authorCodes;
+    vector<vector<uint64_t>> genreBits; // per genre code; may be shorter than live
+    Dictionary genres;
+    Dictionary authors;
+
+    atomic<uint64_t>& availableWord(size_t word) const {
+        return chunks[word / (CHUNK_BOOKS / 64)]->available[word % (CHUNK_BOOKS / 64)];
+    }
+
+    atomic<uint32_t>& borrowCount(uint32_t bookId) const {
+        return chunks[bookId / CHUNK_BOOKS]->borrowCounts[bookId % CHUNK_BOOKS];
+    }
+
+    static uint64_t bitOf(uint32_t bookId) { return 1ULL << (bookId % 64); }
+
+public:
+    // Not safe to run alongside circulation workers; the menu and recovery
+    // add and remove books only while no workers are running
+    void addBook(const Book& book) {
+        uint32_t id = book.bookId;
+        while (chunks.size() * CHUNK_BOOKS <= id) {
+            chunks.emplace_back(new Chunk()); // value-initialised, so all zero
+        }
+        size_t word = id / 64;
+        if (live.size() <= word) live.resize(word + 1, 0);
+        if (genreCodes.size() <= id) {
+            genreCodes.resize(id + 1, ANY);
+            authorCodes.resize(id + 1, ANY);
+        }
+
+        live[word] |= bitOf(id);
+        setAvailable(id, book.allCopiesIn());
+        borrowCount(id).store((uint32_t)book.borrowCount, memory_order_relaxed);
+
+        uint32_t genre = genres.encode(book.genre);
+        if (genreBits.size() <= genre) genreBits.resize(genre + 1);
+        if (genreBits[genre].size() <= word) genreBits[genre].resize(word + 1, 0);
+        genreBits[genre][word] |= bitOf(id);
+        genreCodes[id] = genre;
+        authorCodes[id] = authors.encode(book.author);
+    }
+
+    void removeBook(const Book& book) {
+        uint32_t id = book.bookId;
+        if (id >= genreCodes.size()) return;
+        live[id / 64] &= ~bitOf(id);
+        genreBits[genreCodes[id]][id / 64] &= ~bitOf(id);
+    }
+
+    // available: every copy of the title is in
+    void setAvailable(uint32_t bookId, bool available) {
+        if (available) {
+            availableWord(bookId / 64).fetch_or(bitOf(bookId), memory_order_relaxed);
+        } else {
+            availableWord(bookId / 64).fetch_and(~bitOf(bookId), memory_order_relaxed);
+        }
+    }
+
+    void recordBorrow(uint32_t bookId) {
+        borrowCount(bookId).fetch_add(1, memory_order_relaxed);
+    }
+
+    bool findGenre(const string& genre, uint32_t& code) const { return genres.find(genre, code); }
+    bool findAuthor(const string& author, uint32_t& code) const { return authors.find(author, code); }
+
+    // Author dictionary: codes are dense and assigned in order of first sight
+    uint32_t authorCount() const { return (uint32_t)authors.labels.size(); }
+    const string& authorLabel(uint32_t code) const { return authors.labels[code]; }
+    const string& genreLabel(uint32_t code) const { return genres.labels[code]; }
+
+    // Code columns by book ID, ANY where no book was added; removed books
+    // keep their codes, so history about them can still be grouped
+    const vector<uint32_t>& genreColumn() const { return genreCodes; }
+    const vector<uint32_t>& authorColumn() const { return authorCodes; }
+
+    // Counts the books matching filter and visits the IDs of matches
+    // [offset, offset + limit) in book ID order. Words that hold no visible
+    // match are counted by popcount alone.
+    template <typename Visitor>
+    size_t scan(const Filter& filter, size_t offset, size_t limit, Visitor visit) const {
+        const vector<uint64_t>* genre = filter.genre == ANY ? nullptr : &genreBits[filter.genre];
+        size_t total = 0;
+        for (size_t word = 0; word < live.size(); word++) {
+            uint64_t bits = live[word];
+            if (filter.borrowedOnly) bits &= ~availableWord(word).load(memory_order_relaxed);
+            if (genre) bits &= word < genre->size() ? (*genre)[word] : 0;
+            if (!bits) continue;
+            if (filter.author == ANY) {
+                size_t count = __builtin_popcountll(bits);
+                if (total + count <= offset || total >= offset + limit) {
+                    total += count;
+                    continue;
+                }
+            }
+            for (; bits; bits &= bits - 1) {
+                uint32_t id = (uint32_t)(word * 64 + __builtin_ctzll(bits));
+                if (filter.author != ANY && authorCodes[id] != filter.author) continue;
+                if (total >= offset && total - offset < limit) visit(id);
+                total++;
+            }
+        }
+        return total;
+    }
+
+    // Visits (label, books, borrowed now, total borrows) for every genre
+    // that still has books, in the order genres were first seen
+    template <typename Visitor>
+    void forEachGenre(Visitor visit) const {
+        for (uint32_t genre = 0; genre < genreBits.size(); genre++) {
+            const vector<uint64_t>& members = genreBits[genre];
+            size_t books = 0, borrowed = 0;
+            uint64_t borrows = 0;
+            for (size_t word = 0; word < members.size(); word++) {
+                uint64_t bits = members[word] & live[word];
+                if (!bits) continue;
+                books += __builtin_popcountll(bits);
+                borrowed += __builtin_popcountll(bits & ~availableWord(word).load(memory_order_relaxed));
+                for (; bits; bits &= bits - 1) {
+                    borrows += borrowCount((uint32_t)(word * 64 + __builtin_ctzll(bits))).load(memory_order_relaxed);
+                }
+            }
+            if (books > 0) visit(genres.labels[genre], books, borrowed, borrows);
+        }
+    }
+};
+
+// Keyword search over title, author and genre. Each term maps to a posting
+// list of (book ID, weighted term frequency) pairs, delta + varint encoded
+// in blocks of 128 with a skip entry per block. Book IDs only ever grow, so
+// new books append to the lists; removed books are masked out and a list
+// is re-encoded once half of its postings are dead.
+class KeywordIndex {
+private:
+    static const int BLOCK_SIZE = 128;
+    static const int TITLE_WEIGHT = 3;
+    static const int AUTHOR_WEIGHT = 2;
+    static const int GENRE_WEIGHT = 1;
+
+    struct SkipEntry {
+        uint32_t firstDoc;
+        uint32_t offset;
+    };
+
+    struct PostingList {
+        vector<uint8_t> bytes;
+        vector<SkipEntry> skips;
+        uint32_t count = 0;
+        uint32_t dead = 0;
+        uint32_t lastDoc = 0;
+
+        void append(uint32_t doc, uint32_t tf) {
+            uint32_t delta;
+            if (count % BLOCK_SIZE == 0) {
+                skips.push_back({doc, (uint32_t)bytes.size()});
+                delta = 0;
+            } else {
+                delta = doc - lastDoc;
+            }
+            putVarint(bytes, delta);
+            putVarint(bytes, tf);
+            lastDoc = doc;
+            count++;
+        }
+
+        uint32_t liveCount() const { return count - dead; }
+    };
+
+    // Sequential reader over a posting list with skip-based advance
+    class Cursor {
+    private:
+        const PostingList* list;
+        size_t block;
+        uint32_t index; // postings consumed so far
+        const uint8_t* pos;
+
+    public:
+        uint32_t doc;
+        uint32_t tf;
+        bool done;
+
+        explicit Cursor(const PostingList* list) : list(list), block(0), index(0), done(false) {
+            pos = list->bytes.data();
+            next();
+        }
+
+        void next() {
+            if (index >= list->count) {
+                done = true;
+                return;
+            }
+            uint32_t delta = getVarint(pos);
+            tf = getVarint(pos);
+            if (index % BLOCK_SIZE == 0) {
+                block = index / BLOCK_SIZE;
+                doc = list->skips[block].firstDoc;
+            } else {
+                doc += delta;
+            }
+            index++;
+        }
+
+        // Moves to the first posting with doc >= target, galloping over the
+        // skip entries before decoding inside the chosen block
+        void advanceTo(uint32_t target) {
+            if (done || doc >= target) return;
+            const vector<SkipEntry>& skips = list->skips;
+            size_t low = block, step = 1, high = block + 1;
+            while (high < skips.size() && skips[high].firstDoc <= target) {
+                low = high;
+                step *= 2;
+                high = low + step;
+            }
+            high = min(high, skips.size());
+            while (low + 1 < high) {
+                size_t mid = (low + high) / 2;
+                if (skips[mid].firstDoc <= target) low = mid;
+                else high = mid;
+            }
+            if (low > block) {
+                block = low;
+                index = (uint32_t)(low * BLOCK_SIZE);
+                pos = list->bytes.data() + skips[low].offset;
+                next();
+            }
+            while (!done && doc < target) next();
+        }
+    };
+
+    unordered_map<string, PostingList> terms;
+    vector<uint16_t> docLengths; // weighted token count, 0 for removed books
+    size_t liveDocs;
+    uint64_t totalLength;
+
+    // Splits text into lower-case alphanumeric tokens, keeping a trailing
+    // '+' or '#' so that "C++" and "C#" stay searchable
+    static void tokenise(const string& text, int weight, unordered_map<string, uint32_t>& counts) {
+        string token;
+        auto flush = [&]() {
+            if (!token.empty()) counts[token] += weight;
+            token.clear();
+        };
+        for (unsigned char c : text) {
+            if (isalnum(c)) {
+                token += (char)tolower(c);
+            } else if ((c == '+' || c == '#') && !token.empty()) {
+                token += (char)c;
+            } else {
+                flush();
+            }
+        }
+        flush();
+    }
+
+    static unordered_map<string, uint32_t> termsOf(const Book& book) {
+        unordered_map<string, uint32_t> counts;
+        tokenise(book.title, TITLE_WEIGHT, counts);
+        tokenise(book.author, AUTHOR_WEIGHT, counts);
+        tokenise(book.genre, GENRE_WEIGHT, counts);
+        return counts;
+    }
+
+    bool isLive(uint32_t doc) const {
+        return doc < docLengths.size() && docLengths[doc] != 0;
+    }
+
+    // Re-encodes a list without its removed postings
+    void compact(PostingList& list) {
+        PostingList rebuilt;
+        for (Cursor cursor(&list); !cursor.done; cursor.next()) {
+            if (isLive(cursor.doc)) rebuilt.append(cursor.doc, cursor.tf);
+        }
+        rebuilt.bytes.shrink_to_fit();
+        list = move(rebuilt);
+    }
+
+    double score(uint32_t doc, uint32_t tf, double idf, double averageLength) const {
+        const double k1 = 1.2, b = 0.75;
+        double norm = k1 * (1 - b + b * docLengths[doc] / averageLength);
+        return idf * tf * (k1 + 1) / (tf + norm);
+    }
+
+public:
+    struct Match {
+        uint32_t doc;
+        double score;
+    };
+
+    KeywordIndex() : liveDocs(0), totalLength(0) {}
+
+    void addDocument(uint32_t doc, const Book& book) {
+        unordered_map<string, uint32_t> counts = termsOf(book);
+        uint32_t length = 0;
+        for (const auto& term : counts) {
+            terms[term.first].append(doc, term.second);
+            length += term.second;
+        }
+        if (docLengths.size() <= doc) docLengths.resize(doc + 1, 0);
+        docLengths[doc] = (uint16_t)max<uint32_t>(1, min<uint32_t>(length, 0xffff));
+        liveDocs++;
+        totalLength += docLengths[doc];
+    }
+
+    void removeDocument(uint32_t doc, const Book& book) {
+        if (!isLive(doc)) return;
+        liveDocs--;
+        totalLength -= docLengths[doc];
+        docLengths[doc] = 0;
+        for (const auto& term : termsOf(book)) {
+            auto it = terms.find(term.first);
+            if (it == terms.end()) continue;
+            PostingList& list = it->second;
+            if (++list.dead == list.count) {
+                terms.erase(it);
+            } else if (list.dead * 2 > list.count) {
+                compact(list);
+            }
+        }
+    }
+
+    // Top-k books by BM25 score. With matchAll every query word must occur
+    // (AND), otherwise any word may (OR).
+    vector<Match> search(const string& query, bool matchAll, size_t k) const {
+        vector<Match> results;
+        if (liveDocs == 0 || k == 0) return results;
+
+        unordered_map<string, uint32_t> queryTerms;
+        tokenise(query, 1, queryTerms);
+        vector<const PostingList*> lists;
+        for (const auto& term : queryTerms) {
+            auto it = terms.find(term.first);
+            if (it != terms.end()) {
+                lists.push_back(&it->second);
+            } else if (matchAll) {
+                return results;
+            }
+        }
+        if (lists.empty()) return results;
+
+        // Rarest list first: it drives AND intersection
+        sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) {
+            return a->liveCount() < b->liveCount();
+        });
+        vector<double> idf;
+        for (const PostingList* list : lists) {
+            double df = list->liveCount();
+            idf.push_back(log(1 + (liveDocs - df + 0.5) / (df + 0.5)));
+        }
+        double averageLength = (double)totalLength / liveDocs;
+
+        // Bounded min-heap keeps the k best matches seen so far
+        auto worse = [](const Match& a, const Match& b) {
+            return a.score > b.score || (a.score == b.score && a.doc < b.doc);
+        };
+        priority_queue<Match, vector<Match>, decltype(worse)> heap(worse);
+        auto offer = [&](uint32_t doc, double value) {
+            if (heap.size() < k) {
+                heap.push({doc, value});
+            } else if (worse({doc, value}, heap.top())) {
+                heap.pop();
+                heap.push({doc, value});
+            }
+        };
+
+        vector<Cursor> cursors;
+        for (const PostingList* list : lists) cursors.emplace_back(list);
+
+        if (matchAll) {
+            Cursor& lead = cursors[0];
+            while (!lead.done) {
+                uint32_t doc = lead.doc;
+                bool inAll = true;
+                for (size_t i = 1; i < cursors.size() && inAll; i++) {
+                    cursors[i].advanceTo(doc);
+                    if (cursors[i].done) {
+                        inAll = false;
+                        lead.done = true;
+                    } else if (cursors[i].doc != doc) {
+                        inAll = false;
+                        lead.advanceTo(cursors[i].doc);
+                    }
+                }
+                if (!inAll) continue;
+                if (isLive(doc)) {
+                    double total = 0;
+                    for (size_t i = 0; i < cursors.size(); i++) {
+                        total += score(doc, cursors[i].tf, idf[i], averageLength);
+                    }
+                    offer(doc, total);
+                }
+                lead.next();
+            }
+        } else {
+            // Document-at-a-time union over all cursors
+            while (true) {
+                uint32_t doc = UINT32_MAX;
+                for (const Cursor& cursor : cursors) {
+                    if (!cursor.done) doc = min(doc, cursor.doc);
+                }
+                if (doc == UINT32_MAX) break;
+                double total = 0;
+                for (size_t i = 0; i < cursors.size(); i++) {
+                    if (!cursors[i].done && cursors[i].doc == doc) {
+                        total += score(doc, cursors[i].tf, idf[i], averageLength);
+                        cursors[i].next();
+                    }
+                }
+                if (isLive(doc)) offer(doc, total);
+            }
+        }
+
+        while (!heap.empty()) {
+            results.push_back(heap.top());
+            heap.pop();
+        }
+        reverse(results.begin(), results.end());
+        return results;
+    }
+
+    void serialize(BinaryWriter& out) const {
+        out.put<uint64_t>(liveDocs);
+        out.put<uint64_t>(totalLength);
+        out.put<uint64_t>(docLengths.size());
+        out.putBytes(docLengths.data(), docLengths.size() * sizeof(uint16_t));
+        out.put<uint64_t>(terms.size());
+        for (const auto& term : terms) {
+            const PostingList& list = term.second;
+            out.putString(term.first);
+            out.put<uint32_t>(list.count);
+            out.put<uint32_t>(list.dead);
+            out.put<uint32_t>(list.lastDoc);
+            out.put<uint64_t>(list.bytes.size());
+            out.putBytes(list.bytes.data(), list.bytes.size());
+            out.put<uint64_t>(list.skips.size());
+            out.putBytes(list.skips.data(), list.skips.size() * sizeof(SkipEntry));
+        }
+    }
+
+    // Restores an index written by serialize; false if the data is damaged
+    bool deserialize(BinaryReader& in) {
+        liveDocs = in.get<uint64_t>();
+        totalLength = in.get<uint64_t>();
+        uint64_t docs = in.get<uint64_t>();
+        const char* lengths = in.getBytes(docs * sizeof(uint16_t));
+        if (!lengths) return false;
+        docLengths.resize(docs);
+        memcpy(docLengths.data(), lengths, docs * sizeof(uint16_t));
+
+        uint64_t termTotal = in.get<uint64_t>();
+        terms.clear();
+        terms.reserve(termTotal);
+        for (uint64_t i = 0; i < termTotal && in.ok(); i++) {
+            string term = in.getString();
+            PostingList& list = terms[term];
+            list.count = in.get<uint32_t>();
+            list.dead = in.get<uint32_t>();
+            list.lastDoc = in.get<uint32_t>();
+            uint64_t byteCount = in.get<uint64_t>();
+            const char* bytes = in.getBytes(byteCount);
+            uint64_t skipCount = in.get<uint64_t>();
+            const char* skips = in.getBytes(skipCount * sizeof(SkipEntry));
+            if (!bytes || !skips || skipCount != (list.count + BLOCK_SIZE - 1) / BLOCK_SIZE) return false;
+            list.bytes.assign(bytes, bytes + byteCount);
+            list.skips.resize(skipCount);
+            memcpy(list.skips.data(), skips, skipCount * sizeof(SkipEntry));
+        }
+        return in.ok();
+    }
+
+    size_t termCount() const { return terms.size(); }
+
+    size_t memoryBytes() const {
+        size_t bytes = docLengths.capacity() * sizeof(uint16_t);
+        for (const auto& term : terms) {
+            bytes += term.first.capacity() + sizeof(PostingList)
+                   + term.second.bytes.capacity() + term.second.skips.capacity() * sizeof(SkipEntry);
+        }
+        return bytes;
+    }
+};
+
+// Typo-tolerant lookup of short texts (titles, author names) by edit
+// distance. Texts are case-folded with whitespace collapsed, padded with two
+// spaces at each end and cut into trigrams; each (trigram, text length) pair
+// maps to a delta + varint list of IDs. Each edit destroys at most three of
+// the query's trigrams, so a text within edit distance d lacks at most 3d of
+// them: candidates are the IDs found in all but 3d of the rarest query lists.
+// A 64-bit letter-count sketch per ID rejects most candidates without
+// touching the text, and survivors are verified with a bit-parallel
+// (Myers/Hyyro) edit distance that computes 64 DP cells per word operation.
+// IDs must be added in increasing order.
+class FuzzyIndex {
+public:
+    struct Match {
+        uint32_t id;
+        int distance;
+    };
+
+private:
+    static const uint32_t LENGTH_BUCKETS = 256; // texts of 255+ bytes share the last
+    static const uint32_t ALL_TEXTS = 0;        // "trigram" listing every text of a length
+
+    struct IdList {
+        vector<uint8_t> bytes;
+        uint32_t count = 0;
+        uint32_t dead = 0;
+        uint32_t lastId = 0;
+
+        void append(uint32_t id) {
+            putVarint(bytes, count == 0 ? id : id - lastId);
+            lastId = id;
+            count++;
+        }
+
+        template <typename Visitor>
+        void forEach(Visitor visit) const {
+            const uint8_t* pos = bytes.data();
+            uint32_t id = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                id += getVarint(pos);
+                visit(id);
+            }
+        }
+    };
+
+    unordered_map<uint32_t, IdList> lists; // trigram in the low 24 bits, length bucket above
+    vector<uint64_t> live;                 // bitmap of indexed IDs
+    vector<uint64_t> sketches;             // by ID, see sketchOf
+    uint32_t nextId;
+    size_t liveCount;
+
+    static uint32_t keyOf(uint32_t trigram, size_t length) {
+        return trigram | (uint32_t)min<size_t>(length, LENGTH_BUCKETS - 1) << 24;
+    }
+
+    // Lower-cases and collapses whitespace, like normaliseKey, into out
+    static void fold(const string& text, string& out) {
+        out.clear();
+        bool pendingSpace = false;
+        for (unsigned char c : text) {
+            if (isspace(c)) {
+                pendingSpace = !out.empty();
+                continue;
+            }
+            if (pendingSpace) {
+                out += ' ';
+                pendingSpace = false;
+            }
+            out += (char)tolower(c);
+        }
+    }
+
+    // Distinct list keys for a folded text, ALL_TEXTS included
+    static vector<uint32_t> keysOf(const string& folded) {
+        string padded = "  " + folded + "  ";
+        vector<uint32_t> keys{keyOf(ALL_TEXTS, folded.size())};
+        for (size_t i = 0; i + 3 <= padded.size(); i++) {
+            keys.push_back(keyOf(trigramAt(padded, i), folded.size()));
+        }
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        return keys;
+    }
+
+    static uint32_t trigramAt(const string& padded, size_t i) {
+        return (uint32_t)(unsigned char)padded[i] << 16 | (uint32_t)(unsigned char)padded[i + 1] << 8
+             | (unsigned char)padded[i + 2];
+    }
+
+    // Sixteen 4-bit character counts (saturating at 15): the fifteen most
+    // common characters of English titles get their own counter, the rest
+    // share the last. An edit moves at most two counters by one each.
+    static uint64_t sketchOf(const string& folded) {
+        static const char common[] = " etaoinsrhldcum";
+        uint64_t sketch = 0;
+        for (char c : folded) {
+            const char* at = c ? strchr(common, c) : nullptr;
+            int shift = 4 * (at ? (int)(at - common) : 15);
+            if ((sketch >> shift & 15) != 15) sketch += 1ULL << shift;
+        }
+        return sketch;
+    }
+
+    // Lower bound on the edit distance between two sketched texts
+    static int sketchDistance(uint64_t a, uint64_t b) {
+        int total = 0;
+        for (int shift = 0; shift < 64; shift += 4) {
+            total += abs((int)(a >> shift & 15) - (int)(b >> shift & 15));
+        }
+        return (total + 1) / 2;
+    }
+
+    // LSD radix sort of IDs below bound, 11 bits per pass
+    static void radixSort(vector<uint32_t>& ids, vector<uint32_t>& scratch, uint32_t bound) {
+        scratch.resize(ids.size());
+        for (int shift = 0; shift < 32 && (bound - 1) >> shift; shift += 11) {
+            size_t offsets[2048] = {};
+            for (uint32_t id : ids) offsets[id >> shift & 2047]++;
+            size_t total = 0;
+            for (size_t& offset : offsets) {
+                size_t count = offset;
+                offset = total;
+                total += count;
+            }
+            for (uint32_t id : ids) scratch[offsets[id >> shift & 2047]++] = id;
+            ids.swap(scratch);
+        }
+    }
+
+    // Re-encodes a list without the IDs removed since it was built
+    void compact(IdList& list) {
+        IdList rebuilt;
+        list.forEach([&](uint32_t id) {
+            if (contains(id)) rebuilt.append(id);
+        });
+        rebuilt.bytes.shrink_to_fit();
+        list = move(rebuilt);
+    }
+
+    // Edit distance between the pattern behind peq (m <= 64 characters)
+    // and text, or limit + 1 once it must exceed limit. Column j of the DP
+    // matrix is held as vertical +1/-1 delta bit vectors; the top row adds
+    // one per text character, hence the 1 shifted into the horizontal deltas.
+    static int myersDistance(const uint64_t* peq, size_t m, const string& text, int limit) {
+        uint64_t pv = ~0ULL, mv = 0, last = 1ULL << (m - 1);
+        int score = (int)m;
+        size_t n = text.size();
+        for (size_t j = 0; j < n; j++) {
+            uint64_t eq = peq[(unsigned char)text[j]];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            if (ph & last) score++;
+            else if (mh & last) score--;
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            // Each remaining character can lower the distance by at most one
+            if (score - (int)(n - j - 1) > limit) return limit + 1;
+        }
+        return score;
+    }
+
+    // Plain dynamic programming for patterns longer than a machine word
+    static int rowDistance(const string& pattern, const string& text, int limit) {
+        vector<int> row(pattern.size() + 1);
+        for (size_t i = 0; i <= pattern.size(); i++) row[i] = (int)i;
+        for (size_t j = 0; j < text.size(); j++) {
+            int diagonal = row[0];
+            row[0] = (int)j + 1;
+            int best = row[0];
+            for (size_t i = 1; i <= pattern.size(); i++) {
+                int above = row[i];
+                row[i] = min({row[i] + 1, row[i - 1] + 1, diagonal + (pattern[i - 1] != text[j])});
+                diagonal = above;
+                best = min(best, row[i]);
+            }
+            if (best > limit) return limit + 1;
+        }
+        return row[pattern.size()];
+    }
+
+public:
+    FuzzyIndex() : nextId(0), liveCount(0) {}
+
+    void add(uint32_t id, const string& text) {
+        string folded;
+        fold(text, folded);
+        for (uint32_t key : keysOf(folded)) lists[key].append(id);
+        if (sketches.size() <= id) sketches.resize(id + 1, 0);
+        sketches[id] = sketchOf(folded);
+        if (live.size() <= id / 64) live.resize(id / 64 + 1, 0);
+        live[id / 64] |= 1ULL << (id % 64);
+        nextId = id + 1;
+        liveCount++;
+    }
+
+    void remove(uint32_t id, const string& text) {
+        if (!contains(id)) return;
+        live[id / 64] &= ~(1ULL << (id % 64));
+        liveCount--;
+        string folded;
+        fold(text, folded);
+        for (uint32_t key : keysOf(folded)) {
+            auto it = lists.find(key);
+            if (it == lists.end()) continue;
+            IdList& list = it->second;
+            if (++list.dead == list.count) {
+                lists.erase(it);
+            } else if (list.dead * 2 > list.count) {
+                compact(list);
+            }
+        }
+    }
+
+    bool contains(uint32_t id) const {
+        return id / 64 < live.size() && (live[id / 64] >> (id % 64) & 1);
+    }
+
+    // One past the highest ID added so far
+    uint32_t idCount() const { return nextId; }
+    size_t size() const { return liveCount; }
+
+    // A typo budget that grows with the query: none below 4 characters,
+    // one below 6, two below 12 and three beyond; a transposed pair of
+    // letters costs two
+    static int suggestedDistance(const string& query) {
+        string folded;
+        fold(query, folded);
+        return folded.size() < 4 ? 0 : folded.size() < 6 ? 1 : folded.size() < 12 ? 2 : 3;
+    }
+
+    // Up to limit IDs closest to query within maxDistance, nearest first
+    // (ties by ID). textOf(id) returns the current text, or nullptr if the
+    // caller no longer knows the ID. The distance bound is raised one step
+    // at a time, so close matches never pay for the wider candidate set.
+    template <typename TextOf>
+    vector<Match> search(const string& query, int maxDistance, size_t limit, TextOf textOf) const {
+        vector<Match> matches;
+        string pattern;
+        fold(query, pattern);
+        if (pattern.empty() || limit == 0) return matches;
+
+        size_t m = pattern.size();
+        uint64_t peq[256] = {};
+        for (size_t i = 0; i < min<size_t>(m, 64); i++) peq[(unsigned char)pattern[i]] |= 1ULL << i;
+
+        string padded = "  " + pattern + "  ";
+        uint64_t querySketch = sketchOf(pattern);
+        vector<uint32_t> postings, scratch, candidates;
+        string folded;
+        for (int distance = 0; distance <= maxDistance; distance++) {
+            size_t shortest = m > (size_t)distance ? m - distance : 0;
+            size_t longest = min<size_t>(m + distance, LENGTH_BUCKETS - 1);
+            auto listsFor = [&](uint32_t trigram, vector<const IdList*>& found) {
+                size_t total = 0;
+                for (size_t length = shortest; length <= longest; length++) {
+                    auto it = lists.find(keyOf(trigram, length));
+                    if (it != lists.end()) {
+                        found.push_back(&it->second);
+                        total += it->second.count;
+                    }
+                }
+                return total;
+            };
+
+            // Distinct query trigrams, rarest first
+            vector<pair<size_t, uint32_t>> trigrams; // (postings, trigram)
+            vector<const IdList*> ignored;
+            for (size_t i = 0; i + 3 <= padded.size(); i++) {
+                uint32_t trigram = trigramAt(padded, i);
+                trigrams.push_back({listsFor(trigram, ignored), trigram});
+            }
+            sort(trigrams.begin(), trigrams.end());
+            trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+            // A match is missing from at most 3 * distance of the lists read,
+            // so reading 3 * distance + 1 of them finds it at least once.
+            // Further lists are read while they at most double the postings
+            // scanned, as every extra list raises the count a candidate needs.
+            // Too few distinct trigrams leaves no guarantee: every text of a
+            // suitable length is then a candidate.
+            vector<const IdList*> sources;
+            size_t required = 1;
+            if (trigrams.size() <= 3 * (size_t)distance) {
+                listsFor(ALL_TEXTS, sources);
+            } else {
+                size_t base = 0, read = 0, used = 0;
+                for (int i = 0; i <= 3 * distance; i++) base += trigrams[i].first;
+                while (used < trigrams.size() && (used <= 3 * (size_t)distance || read + trigrams[used].first <= 2 * base)) {
+                    read += listsFor(trigrams[used++].second, sources);
+                }
+                required = used - 3 * distance;
+            }
+
+            postings.clear();
+            for (const IdList* list : sources) {
+                list->forEach([&](uint32_t id) { postings.push_back(id); });
+            }
+            radixSort(postings, scratch, nextId);
+            candidates.clear();
+            for (size_t i = 0; i < postings.size();) {
+                size_t run = i;
+                while (run < postings.size() && postings[run] == postings[i]) run++;
+                if (run - i >= required && sketchDistance(querySketch, sketches[postings[i]]) <= distance) {
+                    candidates.push_back(postings[i]);
+                }
+                i = run;
+            }
+
+            matches.clear();
+            for (uint32_t id : candidates) {
+                const string* text = contains(id) ? textOf(id) : nullptr;
+                if (!text) continue;
+                fold(*text, folded);
+                int found = m <= 64 ? myersDistance(peq, m, folded, distance)
+                                    : rowDistance(pattern, folded, distance);
+                if (found <= distance) matches.push_back({id, found});
+            }
+            if (matches.size() >= limit) break;
+        }
+
+        auto nearer = [](const Match& a, const Match& b) {
+            return a.distance != b.distance ? a.distance < b.distance : a.id < b.id;
+        };
+        size_t kept = min(limit, matches.size());
+        partial_sort(matches.begin(), matches.begin() + kept, matches.end(), nearer);
+        matches.resize(kept);
+        return matches;
+    }
+
+    size_t memoryBytes() const {
+        size_t bytes = (live.capacity() + sketches.capacity()) * sizeof(uint64_t);
+        for (const auto& entry : lists) bytes += sizeof(entry) + entry.second.bytes.capacity();
+        return bytes;
+    }
+};
+
+// User Management: records live in fixed-size chunks indexed directly by
+// user ID, so lookups are O(1) and addresses stay stable as the store grows.
+// Deregistered users are left in place as tombstones.
+class UserStore {
+private:
+    static const int CHUNK_SIZE = 4096;
+    vector<User*> chunks; // raw storage, constructed slot by slot
+    int nextUserId;
+    size_t activeCount;
+    unordered_map<string, int> emailIndex; // normalised email -> user ID
+
+    User* slot(int userId) const {
+        return &chunks[userId / CHUNK_SIZE][userId % CHUNK_SIZE];
+    }
+
+    User* allocate(const string& name, const string& email) {
+        int userId = nextUserId++;
+        if (userId / CHUNK_SIZE >= (int)chunks.size()) {
+            chunks.push_back(static_cast<User*>(operator new(sizeof(User) * CHUNK_SIZE)));
+        }
+        return new (slot(userId)) User(userId, name, email);
+    }
+
+public:
+    UserStore() : nextUserId(1), activeCount(0) {}
+
+    ~UserStore() {
+        for (int id = 1; id < nextUserId; id++) {
+            slot(id)->~User();
+        }
+        for (User* chunk : chunks) {
+            operator delete(chunk);
+        }
+    }
+
+    UserStore(const UserStore&) = delete;
+    UserStore& operator=(const UserStore&) = delete;
+
+    // Returns nullptr if the email is already registered
+    User* addUser(const string& name, const string& email) {
+        string key = normaliseKey(email);
+        if (emailIndex.count(key)) return nullptr;
+
+        User* user = allocate(name, email);
+        emailIndex[key] = user->userId;
+        activeCount++;
+        return user;
+    }
+
+    // Recreates a record with a known ID when loading a snapshot; records
+    // must arrive in ID order, tombstones included
+    User* restoreUser(int userId, const string& name, const string& email, bool active) {
+        if (userId != nextUserId) return nullptr;
+        User* user = allocate(name, email);
+        user->active = active;
+        if (active) {
+            emailIndex[normaliseKey(email)] = userId;
+            activeCount++;
+        }
+        return user;
+    }
+
+    User* findUser(int userId) const {
+        if (userId <= 0 || userId >= nextUserId) return nullptr;
+        User* user = slot(userId);
+        return user->active ? user : nullptr;
+    }
+
+    User* findUserByEmail(const string& email) const {
+        auto it = emailIndex.find(normaliseKey(email));
+        return it == emailIndex.end() ? nullptr : findUser(it->second);
+    }
+
+    // Tombstones the user; the ID is never reused
+    bool removeUser(int userId) {
+        User* user = findUser(userId);
+        if (!user) return false;
+        user->active = false;
+        emailIndex.erase(normaliseKey(user->email));
+        activeCount--;
+        return true;
+    }
+
+    template <typename Visitor>
+    void forEachUser(Visitor visit) const {
+        for (int id = 1; id < nextUserId; id++) {
+            User* user = slot(id);
+            if (user->active) visit(user);
+        }
+    }
+
+    // Visits active users with IDs above afterId in ID order; stops early
+    // if the visitor returns false
+    template <typename Visitor>
+    void forEachUserAfter(int afterId, Visitor visit) const {
+        for (int id = max(afterId, 0) + 1; id < nextUserId; id++) {
+            User* user = slot(id);
+            if (user->active && !visit(user)) return;
+        }
+    }
+
+    // Visits every record ever allocated, deregistered users included
+    template <typename Visitor>
+    void forEachRecord(Visitor visit) const {
+        for (int id = 1; id < nextUserId; id++) visit(slot(id));
+    }
+
+    vector<User*> getAllUsers() const {
+        vector<User*> users;
+        users.reserve(activeCount);
+        forEachUser([&](User* user) { users.push_back(user); });
+        return users;
+    }
+
+    size_t size() const { return activeCount; }
+};
+
+// Book IDs ranked by a count that only ever moves by one. IDs are kept
+// sorted by count and every run of equal counts is tracked as a bucket, so
+// a change is one swap to the edge of a bucket and the top k are simply the
+// first k entries.
+class BorrowRanking {
+private:
+    struct Entry {
+        uint32_t position; // index into ranked
+        uint32_t count;
+    };
+    struct Bucket {
+        uint32_t start;
+        uint32_t size;
+    };
+
+    vector<uint32_t> ranked; // book IDs, highest count first
+    unordered_map<uint32_t, Entry> entries;
+    unordered_map<uint32_t, Bucket> buckets; // count -> run of ranked
+
+    void swapPositions(uint32_t a, uint32_t b) {
+        if (a == b) return;
+        swap(ranked[a], ranked[b]);
+        entries[ranked[a]].position = a;
+        entries[ranked[b]].position = b;
+    }
+
+public:
+    void increment(uint32_t bookId) {
+        auto found = entries.find(bookId);
+        Entry* entry;
+        uint32_t first; // where the entry ends up, just below the next bucket up
+        if (found == entries.end()) {
+            first = (uint32_t)ranked.size();
+            entry = &entries[bookId];
+            *entry = Entry{first, 0};
+            ranked.push_back(bookId);
+        } else {
+            entry = &found->second;
+            Bucket& bucket = buckets[entry->count];
+            first = bucket.start;
+            swapPositions(entry->position, first);
+            if (--bucket.size == 0) {
+                buckets.erase(entry->count);
+            } else {
+                bucket.start++;
+            }
+        }
+        entry->count++;
+        auto above = buckets.find(entry->count);
+        if (above != buckets.end()) {
+            above->second.size++;
+        } else {
+            buckets[entry->count] = Bucket{first, 1};
+        }
+    }
+
+    // Returns false if the book has no count to take back
+    bool decrement(uint32_t bookId) {
+        auto found = entries.find(bookId);
+        if (found == entries.end()) return false;
+        Entry& entry = found->second;
+        Bucket& bucket = buckets[entry.count];
+        uint32_t last = bucket.start + bucket.size - 1;
+        swapPositions(entry.position, last);
+        if (--bucket.size == 0) buckets.erase(entry.count);
+        if (--entry.count == 0) {
+            // Count one is the lowest bucket, so the entry is at the very end
+            ranked.pop_back();
+            entries.erase(found);
+            return true;
+        }
+        auto below = buckets.find(entry.count);
+        if (below != buckets.end()) {
+            below->second.start--;
+            below->second.size++;
+        } else {
+            buckets[entry.count] = Bucket{last, 1};
+        }
+        return true;
+    }
+
+    // Replaces the ranking with (book ID, count) pairs in any order
+    void assign(vector<pair<uint32_t, uint32_t>> counts) {
+        ranked.clear();
+        entries.clear();
+        buckets.clear();
+        counts.erase(remove_if(counts.begin(), counts.end(),
+                               [](const pair<uint32_t, uint32_t>& entry) { return entry.second == 0; }),
+                     counts.end());
+        sort(counts.begin(), counts.end(), [](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        ranked.reserve(counts.size());
+        entries.reserve(counts.size());
+        for (const auto& entry : counts) {
+            uint32_t position = (uint32_t)ranked.size();
+            ranked.push_back(entry.first);
+            entries[entry.first] = Entry{position, entry.second};
+            Bucket& bucket = buckets.emplace(entry.second, Bucket{position, 0}).first->second;
+            bucket.size++;
+        }
+    }
+
+    // Visits (book ID, count) from the top until the visitor returns false
+    template <typename Visitor>
+    void forEachRanked(Visitor visit) const {
+        for (uint32_t bookId : ranked) {
+            if (!visit(bookId, entries.at(bookId).count)) return;
+        }
+    }
+
+    uint32_t countOf(uint32_t bookId) const {
+        auto found = entries.find(bookId);
+        return found == entries.end() ? 0 : found->second.count;
+    }
+
+    size_t size() const { return ranked.size(); }
+};
+
+// All-time and rolling-window borrow rankings. Each issue is also counted
+// against its day; once a day slides out of a window its counts are taken
+// back off that window's ranking, so no ranking is ever recomputed.
+class BorrowStatistics {
+public:
+    enum Window { ALL_TIME, LAST_7_DAYS, LAST_30_DAYS };
+
+private:
+    static const int WINDOW_COUNT = 2;
+    static constexpr int64_t WINDOW_DAYS[WINDOW_COUNT] = {7, 30};
+
+    BorrowRanking allTime;
+    BorrowRanking windows[WINDOW_COUNT];
+    map<int64_t, unordered_map<uint32_t, uint32_t>> days; // day -> issues per book
+    int64_t today;
+
+    // Oldest day still inside a window ending today
+    int64_t windowStart(int window) const { return today - WINDOW_DAYS[window] + 1; }
+
+public:
+    BorrowStatistics() : today(0) {}
+
+    // Moves today forward, retiring days that leave each window
+    void advance(int64_t time) {
+        int64_t day = LibraryClock::dayOf(time);
+        if (day <= today) return;
+        for (int window = 0; window < WINDOW_COUNT; window++) {
+            int64_t oldStart = windowStart(window);
+            int64_t newStart = day - WINDOW_DAYS[window] + 1;
+            for (auto it = days.lower_bound(oldStart); it != days.end() && it->first < newStart; ++it) {
+                for (const auto& entry : it->second) {
+                    for (uint32_t i = 0; i < entry.second; i++) windows[window].decrement(entry.first);
+                }
+            }
+        }
+        today = day;
+        days.erase(days.begin(), days.lower_bound(windowStart(WINDOW_COUNT - 1)));
+    }
+
+    void record(uint32_t bookId, int64_t time) {
+        advance(time);
+        allTime.increment(bookId);
+        int64_t day = LibraryClock::dayOf(time);
+        if (day < windowStart(WINDOW_COUNT - 1)) return;
+        days[day][bookId]++;
+        for (int window = 0; window < WINDOW_COUNT; window++) {
+            if (day >= windowStart(window)) windows[window].increment(bookId);
+        }
+    }
+
+    const BorrowRanking& ranking(Window window) const {
+        return window == ALL_TIME ? allTime : windows[window - 1];
+    }
+
+    // Visits (day, book ID, issues) for every day still inside a window
+    template <typename Visitor>
+    void forEachDay(Visitor visit) const {
+        for (const auto& day : days) {
+            for (const auto& entry : day.second) visit(day.first, entry.first, entry.second);
+        }
+    }
+
+    // Rebuilds every ranking from all-time counts and per-day issue counts
+    void restore(const vector<pair<uint32_t, uint32_t>>& totals,
+                 const vector<tuple<int64_t, uint32_t, uint32_t>>& dailyIssues, int64_t time) {
+        today = LibraryClock::dayOf(time);
+        days.clear();
+        allTime.assign(totals);
+        for (const auto& issue : dailyIssues) {
+            if (get<0>(issue) >= windowStart(WINDOW_COUNT - 1) && get<0>(issue) <= today) {
+                days[get<0>(issue)][get<1>(issue)] += get<2>(issue);
+            }
+        }
+        for (int window = 0; window < WINDOW_COUNT; window++) {
+            unordered_map<uint32_t, uint32_t> sums;
+            for (auto it = days.lower_bound(windowStart(window)); it != days.end(); ++it) {
+                for (const auto& entry : it->second) sums[entry.first] += entry.second;
+            }
+            windows[window].assign(vector<pair<uint32_t, uint32_t>>(sums.begin(), sums.end()));
+        }
+    }
+};
+
+// Per-book hold queues. A patron asking for a book that is out joins the
+// book's FIFO queue instead of retrying, and the return hands the book
+// straight to the first live hold. A queue is a fixed ring of at most
+// MAX_HOLDS_PER_BOOK entries that exists only while the book has holds.
+// Queues are spread over lock stripes by book ID; availability changes
+// that must agree with a queue run under its stripe lock as callbacks.
+class HoldQueues {
+public:
+    static const uint32_t MAX_HOLDS_PER_BOOK = 16;
+
+    struct Hold {
+        int32_t userId;
+        int64_t expiresAt;
+    };
+
+    enum Status { CLAIMED, PLACED, ALREADY_PLACED, QUEUE_FULL };
+
+private:
+    static const int STRIPES = 64;
+
+    struct Queue {
+        Hold ring[MAX_HOLDS_PER_BOOK];
+        uint32_t head = 0;
+        uint32_t count = 0;
+
+        Hold& at(uint32_t i) { return ring[(head + i) % MAX_HOLDS_PER_BOOK]; }
+
+        void push(const Hold& hold) {
+            at(count) = hold;
+            count++;
+        }
+
+        Hold pop() {
+            Hold hold = ring[head];
+            head = (head + 1) % MAX_HOLDS_PER_BOOK;
+            count--;
+            return hold;
+        }
+
+        // Drops holds matching drop, keeping the rest in order; returns how many
+        template <typename Drop>
+        uint32_t removeIf(Drop drop) {
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                Hold hold = at(i);
+                if (!drop(hold)) at(kept++) = hold;
+            }
+            uint32_t removed = count - kept;
+            count = kept;
+            return removed;
+        }
+    };
+
+    struct Stripe {
+        mutex lock;
+        unordered_map<uint32_t, Queue> queues; // by book ID
+    };
+
+    Stripe stripes[STRIPES];
+    atomic<size_t> waiting; // holds across all books
+
+    Stripe& stripeFor(uint32_t bookId) { return stripes[bookId % STRIPES]; }
+
+public:
+    HoldQueues() : waiting(0) {}
+
+    // Calls claim() and, if the book could not be claimed, queues userId
+    // behind the holds already placed and passes the new hold to placed().
+    // Expired holds and holds of users for whom isLive(userId) is false are
+    // purged when the queue is full. position is the 1-based place in the
+    // queue for PLACED and ALREADY_PLACED.
+    template <typename Claim, typename IsLive, typename Placed>
+    Status place(uint32_t bookId, int32_t userId, int64_t now, int64_t expiresAt,
+                 Claim claim, IsLive isLive, Placed placed, size_t& position) {
+        Stripe& stripe = stripeFor(bookId);
+        lock_guard<mutex> guard(stripe.lock);
+        if (claim()) return CLAIMED;
+        Queue& queue = stripe.queues[bookId];
+        for (uint32_t i = 0; i < queue.count; i++) {
+            if (queue.at(i).userId == userId) {
+                position = i + 1;
+                return ALREADY_PLACED;
+            }
+        }
+        if (queue.count == MAX_HOLDS_PER_BOOK) {
+            waiting -= queue.removeIf([&](const Hold& hold) {
+                return hold.expiresAt <= now || !isLive(hold.userId);
+            });
+            if (queue.count == MAX_HOLDS_PER_BOOK) return QUEUE_FULL;
+        }
+        queue.push({userId, expiresAt});
+        waiting++;
+        position = queue.count;
+        placed(queue.at(queue.count - 1));
+        return PLACED;
+    }
+
+    // Pops holds until one is unexpired and live, and returns its user ID.
+    // With no such hold, release() is called and 0 returned; a concurrent
+    // place() on the same book then sees the released book in its claim().
+    template <typename IsLive, typename Release>
+    int32_t takeNext(uint32_t bookId, int64_t now, IsLive isLive, Release release) {
+        Stripe& stripe = stripeFor(bookId);
+        lock_guard<mutex> guard(stripe.lock);
+        auto it = stripe.queues.find(bookId);
+        int32_t userId = 0;
+        while (it != stripe.queues.end() && it->second.count > 0 && !userId) {
+            Hold hold = it->second.pop();
+            waiting--;
+            if (hold.expiresAt > now && isLive(hold.userId)) userId = hold.userId;
+        }
+        if (it != stripe.queues.end() && it->second.count == 0) stripe.queues.erase(it);
+        if (!userId) release();
+        return userId;
+    }
+
+    // Appends a hold without trying to claim the book, when restoring state
+    bool restore(uint32_t bookId, const Hold& hold) {
+        Stripe& stripe = stripeFor(bookId);
+        lock_guard<mutex> guard(stripe.lock);
+        Queue& queue = stripe.queues[bookId];
+        if (queue.count == MAX_HOLDS_PER_BOOK) return false;
+        queue.push(hold);
+        waiting++;
+        return true;
+    }
+
+    // Withdraws userId's hold on a book; false if there was none
+    bool cancel(uint32_t bookId, int32_t userId) {
+        if (waiting.load(memory_order_relaxed) == 0) return false;
+        Stripe& stripe = stripeFor(bookId);
+        lock_guard<mutex> guard(stripe.lock);
+        auto it = stripe.queues.find(bookId);
+        if (it == stripe.queues.end()) return false;
+        uint32_t removed = it->second.removeIf([&](const Hold& hold) { return hold.userId == userId; });
+        waiting -= removed;
+        if (it->second.count == 0) stripe.queues.erase(it);
+        return removed > 0;
+    }
+
+    // Discards every hold on a book that is leaving the catalog
+    void drop(uint32_t bookId) {
+        Stripe& stripe = stripeFor(bookId);
+        lock_guard<mutex> guard(stripe.lock);
+        auto it = stripe.queues.find(bookId);
+        if (it == stripe.queues.end()) return;
+        waiting -= it->second.count;
+        stripe.queues.erase(it);
+    }
+
+    // Visits every hold, each book's in queue order
+    template <typename Visitor>
+    void forEach(Visitor visit) {
+        for (Stripe& stripe : stripes) {
+            lock_guard<mutex> guard(stripe.lock);
+            for (auto& entry : stripe.queues) {
+                for (uint32_t i = 0; i < entry.second.count; i++) visit(entry.first, entry.second.at(i));
+            }
+        }
+    }
+
+    size_t size() const { return waiting.load(memory_order_relaxed); }
+};
+
+// Loan due dates on a hierarchical timing wheel. Time moves in one-hour
+// ticks; level L has 64 slots of 64^L ticks each, so four levels reach
+// about 1900 years ahead. A loan sits in the lowest level whose span
+// covers its due tick and moves down a level each time its slot comes
+// round, so it is touched at most once per level however many loans are
+// out, and advancing the clock costs time in the loans falling due. A loan
+// is due within the hour after its due time; it then moves to the overdue
+// list until it is returned. Loans are nodes of intrusive lists named by
+// handle, so a return unlinks its loan in O(1) wherever it is. Not
+// thread-safe; LibrarySystem guards it with a lock.
+class DueDateWheel {
+public:
+    static const int64_t TICK_SECONDS = 3600;
+
+    struct Loan {
+        int32_t userId;
+        uint32_t bookId;
+        int64_t dueAt;
+    };
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const uint32_t SLOTS = 1 << SLOT_BITS;
+    static const uint32_t OVERDUE = LEVELS * SLOTS; // list after the slots
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Node {
+        Loan loan;
+        uint32_t list; // slot list or OVERDUE
+        uint32_t prev;
+        uint32_t next; // also links the free list
+    };
+
+    vector<Node> nodes;
+    uint32_t heads[LEVELS * SLOTS + 1];
+    uint32_t freeList;
+    int64_t currentTick; // loans due up to this tick have been moved out
+    bool started;
+    atomic<size_t> pending; // counts are read without the lock for gauges
+    atomic<size_t> overdue;
+
+    static int64_t tickOf(int64_t time) {
+        return time >= 0 ? time / TICK_SECONDS : (time + 1) / TICK_SECONDS - 1;
+    }
+
+    static uint32_t slotOf(int64_t tick, int level) {
+        return (uint32_t)(tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+    }
+
+    void link(uint32_t handle, uint32_t list) {
+        Node& node = nodes[handle];
+        node.list = list;
+        node.prev = NONE;
+        node.next = heads[list];
+        if (node.next != NONE) nodes[node.next].prev = handle;
+        heads[list] = handle;
+    }
+
+    void unlink(uint32_t handle) {
+        Node& node = nodes[handle];
+        if (node.prev != NONE) {
+            nodes[node.prev].next = node.next;
+        } else {
+            heads[node.list] = node.next;
+        }
+        if (node.next != NONE) nodes[node.next].prev = node.prev;
+    }
+
+    // Links a loan into the slot for its due tick, or the overdue list once
+    // that tick is reached. Loans beyond the top level's reach wait in its
+    // furthest slot and are placed again when it comes round.
+    void schedule(uint32_t handle) {
+        int64_t due = tickOf(nodes[handle].loan.dueAt) + 1;
+        if (due <= currentTick) {
+            link(handle, OVERDUE);
+            overdue.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        int64_t delta = due - currentTick;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (int64_t)1 << (SLOT_BITS * (level + 1))) level++;
+        due = min(due, currentTick + ((int64_t)1 << (SLOT_BITS * LEVELS)) - 1);
+        link(handle, level * SLOTS + slotOf(due, level));
+        pending.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Places every loan in a slot again, relative to the current tick
+    void cascade(uint32_t list) {
+        uint32_t handle = heads[list];
+        heads[list] = NONE;
+        while (handle != NONE) {
+            uint32_t next = nodes[handle].next;
+            pending.fetch_sub(1, memory_order_relaxed);
+            schedule(handle);
+            handle = next;
+        }
+    }
+
+public:
+    DueDateWheel() : freeList(NONE), currentTick(0), started(false), pending(0), overdue(0) {
+        fill(begin(heads), end(heads), NONE);
+    }
+
+    // Moves the wheel up to time; the first call just sets its start.
+    // Returns how many loans fell due.
+    size_t advance(int64_t time) {
+        int64_t target = tickOf(time);
+        if (!started) {
+            currentTick = target;
+            started = true;
+            return 0;
+        }
+        size_t before = overdue.load(memory_order_relaxed);
+        while (currentTick < target) {
+            if (pending.load(memory_order_relaxed) == 0) {
+                currentTick = target;
+                break;
+            }
+            currentTick++;
+            for (int level = 1; level < LEVELS; level++) {
+                if (currentTick & (((int64_t)1 << (SLOT_BITS * level)) - 1)) break;
+                cascade(level * SLOTS + slotOf(currentTick, level));
+            }
+            cascade(slotOf(currentTick, 0)); // all due now
+        }
+        return overdue.load(memory_order_relaxed) - before;
+    }
+
+    // Tracks a loan and returns its handle. Call advance first, so the
+    // wheel has a start; a loan already past due goes straight to overdue.
+    uint32_t add(const Loan& loan) {
+        uint32_t handle;
+        if (freeList != NONE) {
+            handle = freeList;
+            freeList = nodes[handle].next;
+        } else {
+            handle = (uint32_t)nodes.size();
+            nodes.emplace_back();
+        }
+        nodes[handle].loan = loan;
+        schedule(handle);
+        return handle;
+    }
+
+    // Stops tracking a returned loan
+    Loan remove(uint32_t handle) {
+        unlink(handle);
+        Node& node = nodes[handle];
+        if (node.list == OVERDUE) {
+            overdue.fetch_sub(1, memory_order_relaxed);
+        } else {
+            pending.fetch_sub(1, memory_order_relaxed);
+        }
+        node.next = freeList;
+        freeList = handle;
+        return node.loan;
+    }
+
+    const Loan& loan(uint32_t handle) const { return nodes[handle].loan; }
+
+    // Visits every overdue loan, in no set order
+    template <typename Visitor>
+    void forEachOverdue(Visitor visit) const {
+        for (uint32_t handle = heads[OVERDUE]; handle != NONE; handle = nodes[handle].next) {
+            visit(nodes[handle].loan);
+        }
+    }
+
+    size_t overdueCount() const { return overdue.load(memory_order_relaxed); }
+    size_t size() const { return pending.load(memory_order_relaxed) + overdue.load(memory_order_relaxed); }
+};
+
+// Loan state for reports, readable at a point in time while circulation
+// goes on. Each loan is a row keyed by its DueDateWheel handle and each
+// user a row of loan count and fines, in tables of fixed-size chunks.
+// Opening a view copies the chunk directories and starts a new epoch. The
+// first write to a chunk from an earlier epoch copies it if a view may
+// hold it, so a view's rows never change under it. The chunk a write
+// replaced is freed once the last view that could hold it is closed.
+// Writes and opening views must be serialised by the caller; a view can
+// be read and closed on any thread.
+class CirculationLedger {
+public:
+    struct LoanRow {
+        int32_t userId; // 0 for a free row
+        uint32_t bookId;
+        int64_t dueAt;
+        uint32_t copy;
+        uint32_t sequence; // issue order, for loans due in the same second
+    };
+
+    struct UserRow {
+        uint32_t loans;
+        uint32_t fines;
+    };
+
+private:
+    static const uint32_t CHUNK_BITS = 10;
+    static const uint32_t CHUNK_ROWS = 1 << CHUNK_BITS;
+
+    template <typename Row>
+    struct Chunk {
+        uint64_t epoch; // the epoch it was last written in
+        Row rows[CHUNK_ROWS];
+    };
+
+    // A replaced chunk and the epochs of the views that may hold it
+    struct Retired {
+        void* chunk;
+        void (*free)(void*);
+        uint64_t firstEpoch;
+        uint64_t lastEpoch;
+    };
+
+    vector<Chunk<LoanRow>*> loanChunks;
+    vector<Chunk<UserRow>*> userChunks;
+    uint64_t epoch;
+    uint32_t nextSequence;
+    mutex reclaimLock; // guards openEpochs and retired
+    multiset<uint64_t> openEpochs;
+    vector<Retired> retired;
+
+    template <typename Row>
+    static void freeChunk(void* chunk) { delete static_cast<Chunk<Row>*>(chunk); }
+
+    template <typename Row>
+    Row& writable(vector<Chunk<Row>*>& chunks, size_t index) {
+        size_t slot = index >> CHUNK_BITS;
+        if (slot >= chunks.size()) chunks.resize(slot + 1, nullptr);
+        Chunk<Row>*& chunk = chunks[slot];
+        if (!chunk) {
+            chunk = new Chunk<Row>();
+            chunk->epoch = epoch;
+        } else if (chunk->epoch != epoch) {
+            // Views opened since the chunk was last written may hold it
+            lock_guard<mutex> guard(reclaimLock);
+            auto held = openEpochs.lower_bound(chunk->epoch);
+            if (held != openEpochs.end()) {
+                Chunk<Row>* copy = new Chunk<Row>(*chunk);
+                retired.push_back({chunk, freeChunk<Row>, chunk->epoch, epoch - 1});
+                chunk = copy;
+            }
+            chunk->epoch = epoch;
+        }
+        return chunk->rows[index & (CHUNK_ROWS - 1)];
+    }
+
+    void close(uint64_t viewEpoch) {
+        vector<Retired> freed;
+        {
+            lock_guard<mutex> guard(reclaimLock);
+            openEpochs.erase(openEpochs.find(viewEpoch));
+            for (size_t i = 0; i < retired.size(); ) {
+                auto held = openEpochs.lower_bound(retired[i].firstEpoch);
+                if (held == openEpochs.end() || *held > retired[i].lastEpoch) {
+                    freed.push_back(retired[i]);
+                    retired[i] = retired.back();
+                    retired.pop_back();
+                } else {
+                    i++;
+                }
+            }
+        }
+        for (const Retired& chunk : freed) chunk.free(chunk.chunk);
+    }
+
+public:
+    // Rows as they stood when the view was opened
+    class View {
+    private:
+        friend class CirculationLedger;
+        CirculationLedger* ledger;
+        uint64_t epoch;
+        vector<const Chunk<LoanRow>*> loanChunks;
+        vector<const Chunk<UserRow>*> userChunks;
+
+        View(CirculationLedger* ledger, uint64_t epoch) : ledger(ledger), epoch(epoch) {}
+
+    public:
+        View(View&& other) noexcept
+            : ledger(other.ledger), epoch(other.epoch),
+              loanChunks(move(other.loanChunks)), userChunks(move(other.userChunks)) {
+            other.ledger = nullptr;
+        }
+
+        View(const View&) = delete;
+        View& operator=(const View&) = delete;
+        View& operator=(View&&) = delete;
+
+        ~View() {
+            if (ledger) ledger->close(epoch);
+        }
+
+        UserRow user(int userId) const {
+            size_t slot = (size_t)userId >> CHUNK_BITS;
+            if (userId < 0 || slot >= userChunks.size() || !userChunks[slot]) return UserRow{0, 0};
+            return userChunks[slot]->rows[userId & (CHUNK_ROWS - 1)];
+        }
+
+        template <typename Visitor>
+        void forEachLoan(Visitor visit) const {
+            for (const Chunk<LoanRow>* chunk : loanChunks) {
+                if (!chunk) continue;
+                for (const LoanRow& row : chunk->rows) {
+                    if (row.userId != 0) visit(row);
+                }
+            }
+        }
+    };
+
+    CirculationLedger() : epoch(1), nextSequence(0) {}
+
+    // No view may still be open
+    ~CirculationLedger() {
+        for (Chunk<LoanRow>* chunk : loanChunks) delete chunk;
+        for (Chunk<UserRow>* chunk : userChunks) delete chunk;
+        for (const Retired& chunk : retired) chunk.free(chunk.chunk);
+    }
+
+    CirculationLedger(const CirculationLedger&) = delete;
+    CirculationLedger& operator=(const CirculationLedger&) = delete;
+
+    void addLoan(uint32_t handle, int32_t userId, uint32_t bookId, uint32_t copy, int64_t dueAt) {
+        writable(loanChunks, handle) = LoanRow{userId, bookId, dueAt, copy, nextSequence++};
+        writable(userChunks, (size_t)userId).loans++;
+    }
+
+    // Clears a returned loan and records the borrower's fines after it
+    void removeLoan(uint32_t handle, uint32_t fines) {
+        LoanRow& loan = writable(loanChunks, handle);
+        UserRow& user = writable(userChunks, (size_t)loan.userId);
+        user.loans--;
+        user.fines = fines;
+        loan.userId = 0;
+    }
+
+    void setFines(int32_t userId, uint32_t fines) { writable(userChunks, (size_t)userId).fines = fines; }
+
+    // Costs a copy of the chunk directories, one pointer per 1024 rows
+    View open() {
+        View view(this, epoch);
+        {
+            lock_guard<mutex> guard(reclaimLock);
+            openEpochs.insert(epoch);
+        }
+        view.loanChunks.assign(loanChunks.begin(), loanChunks.end());
+        view.userChunks.assign(userChunks.begin(), userChunks.end());
+        epoch++;
+        return view;
+    }
+};
+
+// Append-only history of every issue and return, for questions over time
+// such as borrows per genre per hour last week. Events gather in an open
+// tail and are sealed into compressed blocks of BLOCK_EVENTS, column by
+// column: times as zigzag deltas from the previous event, then user IDs,
+// then book IDs, each value a little-endian varint of 1 to 8 bytes whose
+// length is kept apart in a 2-bit control stream (as in Stream VByte),
+// and kinds as a bitmap; about 5 bytes an event. Decoding takes one load
+// and mask per value, and no load waits on the one before it. Each block
+// keeps the min/max of its time, user and book columns, so a query skips
+// the blocks outside its range and decodes the rest into flat arrays that
+// the counting loops run over without branches. Sealed blocks never
+// change; a View shares them, so reads run while events are appended.
+// Appends and opening views must be serialised by the caller.
+class CirculationEventLog {
+public:
+    enum Kind : uint8_t { ISSUE = 0, RETURN = 1 };
+    static const uint8_t ISSUES = 1 << ISSUE;  // Query::kinds bits
+    static const uint8_t RETURNS = 1 << RETURN;
+    static constexpr uint32_t ANY = UINT32_MAX;
+    static const uint32_t BLOCK_EVENTS = 4096;
+
+    enum GroupBy { BY_NOTHING, BY_BOOK_KEY, BY_USER };
+
+    // Counts events in [from, to) into counts[key * buckets + bucket],
+    // where bucket is (time - from) / bucketSeconds, or 0 when
+    // bucketSeconds is 0, and key comes from group
+    struct Query {
+        int64_t from;
+        int64_t to;
+        uint8_t kinds;         // ISSUES, RETURNS or both
+        uint32_t userId;       // ANY for every user
+        GroupBy group;
+        const vector<uint32_t>* bookKeys; // BY_BOOK_KEY: key per book ID, ANY to leave out
+        int64_t bucketSeconds;
+    };
+
+    struct ScanStats {
+        size_t blocks = 0;  // blocks in the view, the open tail included
+        size_t decoded = 0; // blocks that overlapped the query
+        size_t events = 0;  // events in the decoded blocks
+    };
+
+    // On-disk and in-memory block summary; the encoded columns follow it
+    struct BlockHeader {
+        uint32_t count;
+        uint32_t userOffset; // where each column starts in the block bytes
+        uint32_t bookOffset;
+        uint32_t kindOffset;
+        uint32_t size;
+        uint32_t minUser;
+        uint32_t maxUser;
+        uint32_t minBook;
+        uint32_t maxBook;
+        uint32_t padding;
+        int64_t minTime;
+        int64_t maxTime;
+    };
+
+private:
+    struct Block {
+        BlockHeader header;
+        vector<uint8_t> bytes; // header.size bytes of columns, then PADDING zeros
+    };
+
+    static const size_t PADDING = 8;
+
+    vector<shared_ptr<const Block>> blocks;
+    vector<int64_t> tailTimes; // the open tail, column by column
+    vector<uint32_t> tailUsers;
+    vector<uint32_t> tailBooks;
+    vector<uint8_t> tailKinds;
+    size_t encodedBytes;
+
+    // Value widths for control codes 0-3
+    static constexpr uint8_t TIME_WIDTHS[4] = {1, 2, 4, 8};
+    static constexpr uint8_t ID_WIDTHS[4] = {1, 2, 3, 4};
+
+    static constexpr uint64_t widthMask(uint8_t width) {
+        return width == 8 ? ~0ULL : (1ULL << (width * 8)) - 1;
+    }
+
+    static void putColumn(vector<uint8_t>& out, const uint64_t* values, uint32_t count, const uint8_t* widths) {
+        size_t control = out.size();
+        out.resize(control + (count + 3) / 4, 0);
+        for (uint32_t i = 0; i < count; i++) {
+            unsigned code = 0;
+            while (code < 3 && (values[i] & ~widthMask(widths[code]))) code++;
+            out[control + i / 4] |= (uint8_t)(code << (i % 4 * 2));
+            for (uint8_t byte = 0; byte < widths[code]; byte++) out.push_back((uint8_t)(values[i] >> (byte * 8)));
+        }
+    }
+
+    // Bytes taken by the column starting at in, control stream included
+    static size_t columnSize(const uint8_t* in, uint32_t count, const uint8_t* widths) {
+        size_t size = (count + 3) / 4;
+        for (uint32_t i = 0; i < count; i++) size += widths[(in[i / 4] >> (i % 4 * 2)) & 3];
+        return size;
+    }
+
+    // Reads a column written by putColumn; blocks keep PADDING spare
+    // bytes so the 8-byte load never runs off the end
+    template <typename T>
+    static const uint8_t* getColumn(const uint8_t* in, T* values, uint32_t count, const uint8_t* widths) {
+        const uint64_t masks[4] = {widthMask(widths[0]), widthMask(widths[1]), widthMask(widths[2]),
+                                   widthMask(widths[3])};
+        const uint8_t* control = in;
+        const uint8_t* data = in + (count + 3) / 4;
+        for (uint32_t i = 0; i < count; i++) {
+            unsigned code = (control[i / 4] >> (i % 4 * 2)) & 3;
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+            values[i] = (T)(word & masks[code]);
+            data += widths[code];
+        }
+        return data;
+    }
+
+    static shared_ptr<const Block> encode(const int64_t* times, const uint32_t* users, const uint32_t* books,
+                                          const uint8_t* kinds, uint32_t count) {
+        shared_ptr<Block> block = make_shared<Block>();
+        BlockHeader& header = block->header;
+        header = BlockHeader{};
+        header.count = count;
+        header.minUser = header.minBook = UINT32_MAX;
+        header.minTime = INT64_MAX;
+        header.maxTime = INT64_MIN;
+        vector<uint64_t> values(count);
+        int64_t previous = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            int64_t delta = (int64_t)((uint64_t)times[i] - (uint64_t)previous);
+            values[i] = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+            previous = times[i];
+            header.minTime = min(header.minTime, times[i]);
+            header.maxTime = max(header.maxTime, times[i]);
+        }
+        vector<uint8_t>& out = block->bytes;
+        putColumn(out, values.data(), count, TIME_WIDTHS);
+        header.userOffset = (uint32_t)out.size();
+        for (uint32_t i = 0; i < count; i++) {
+            values[i] = users[i];
+            header.minUser = min(header.minUser, users[i]);
+            header.maxUser = max(header.maxUser, users[i]);
+        }
+        putColumn(out, values.data(), count, ID_WIDTHS);
+        header.bookOffset = (uint32_t)out.size();
+        for (uint32_t i = 0; i < count; i++) {
+            values[i] = books[i];
+            header.minBook = min(header.minBook, books[i]);
+            header.maxBook = max(header.maxBook, books[i]);
+        }
+        putColumn(out, values.data(), count, ID_WIDTHS);
+        header.kindOffset = (uint32_t)out.size();
+        out.resize(out.size() + (count + 7) / 8, 0);
+        for (uint32_t i = 0; i < count; i++) out[header.kindOffset + i / 8] |= (uint8_t)(kinds[i] << (i % 8));
+        header.size = (uint32_t)out.size();
+        out.resize(out.size() + PADDING, 0);
+        out.shrink_to_fit();
+        return block;
+    }
+
+    // Scratch columns a block is decoded into
+    struct Columns {
+        int64_t times[BLOCK_EVENTS];
+        uint32_t users[BLOCK_EVENTS];
+        uint32_t books[BLOCK_EVENTS];
+        uint64_t keys[BLOCK_EVENTS]; // group key, then counts slot
+        uint8_t keep[BLOCK_EVENTS];  // 1 while the event passes every filter
+        uint16_t selected[BLOCK_EVENTS]; // indexes of the events kept
+    };
+    static_assert(BLOCK_EVENTS <= 1 << 16, "selected holds 16-bit indexes");
+
+    static bool overlaps(const BlockHeader& header, const Query& query) {
+        return header.count > 0 && header.maxTime >= query.from && header.minTime < query.to
+            && (query.userId == ANY || (query.userId >= header.minUser && query.userId <= header.maxUser));
+    }
+
+    // Counts one block into counts, which must already hold every slot the
+    // block can reach. Only the columns the query needs are decoded. Each
+    // filter is a pass of its own over the block, clearing keep for events
+    // that fail it; the events kept are then gathered into a selection
+    // vector, so the adding pass touches only them.
+    static void count(const Query& query, const Block& block, Columns& columns, uint64_t buckets,
+                      vector<uint64_t>& counts) {
+        const BlockHeader& header = block.header;
+        const uint32_t count = header.count;
+        const uint8_t* bytes = block.bytes.data();
+        const bool inside = header.minTime >= query.from && header.maxTime < query.to;
+        const bool oneKind = query.kinds != (ISSUES | RETURNS);
+
+        // A block wholly inside the range, counted as one number, needs
+        // nothing but its kind bitmap
+        if (inside && query.group == BY_NOTHING && query.bucketSeconds == 0 && query.userId == ANY) {
+            uint64_t matched = count;
+            if (oneKind) {
+                uint64_t returns = 0;
+                for (uint32_t byte = 0; byte < (count + 7) / 8; byte++) {
+                    returns += __builtin_popcount(bytes[header.kindOffset + byte]);
+                }
+                matched = query.kinds == RETURNS ? returns : count - returns;
+            }
+            counts[0] += matched;
+            return;
+        }
+
+        memset(columns.keep, 1, count);
+        if (!inside || query.bucketSeconds > 0) {
+            getColumn(bytes, reinterpret_cast<uint64_t*>(columns.times), count, TIME_WIDTHS);
+            int64_t time = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                uint64_t zigzag = (uint64_t)columns.times[i];
+                time += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+                columns.times[i] = time;
+            }
+        }
+        if (!inside) {
+            const int64_t from = query.from, to = query.to;
+            for (uint32_t i = 0; i < count; i++) {
+                columns.keep[i] = (uint8_t)((columns.times[i] >= from) & (columns.times[i] < to));
+            }
+        }
+        if (oneKind) {
+            const uint8_t* bits = bytes + header.kindOffset;
+            const uint8_t wanted = query.kinds == RETURNS;
+            for (uint32_t i = 0; i < count; i++) {
+                columns.keep[i] &= (uint8_t)(((bits[i / 8] >> (i % 8)) & 1) == wanted);
+            }
+        }
+        if (query.userId != ANY || query.group == BY_USER) {
+            getColumn(bytes + header.userOffset, columns.users, count, ID_WIDTHS);
+        }
+        if (query.userId != ANY) {
+            const uint32_t userId = query.userId;
+            for (uint32_t i = 0; i < count; i++) columns.keep[i] &= (uint8_t)(columns.users[i] == userId);
+        }
+
+        switch (query.group) {
+            case BY_NOTHING:
+                memset(columns.keys, 0, count * sizeof(columns.keys[0]));
+                break;
+            case BY_USER:
+                for (uint32_t i = 0; i < count; i++) columns.keys[i] = columns.users[i];
+                break;
+            case BY_BOOK_KEY: {
+                getColumn(bytes + header.bookOffset, columns.books, count, ID_WIDTHS);
+                const uint32_t* keys = query.bookKeys->data();
+                const uint32_t known = (uint32_t)query.bookKeys->size();
+                for (uint32_t i = 0; i < count; i++) {
+                    uint32_t key = columns.books[i] < known ? keys[columns.books[i]] : ANY;
+                    columns.keep[i] &= (uint8_t)(key != ANY);
+                    columns.keys[i] = key;
+                }
+                break;
+            }
+        }
+        if (query.bucketSeconds > 0) {
+            // Offsets into a range under 2^32 seconds are divided by
+            // multiplying with a precomputed reciprocal (Lemire's fastdiv)
+            const int64_t from = query.from;
+            const uint64_t width = (uint64_t)query.bucketSeconds;
+            if ((uint64_t)query.to - (uint64_t)query.from <= UINT32_MAX && width <= UINT32_MAX) {
+                const uint64_t reciprocal = UINT64_MAX / width + 1;
+                for (uint32_t i = 0; i < count; i++) {
+                    uint32_t offset = (uint32_t)(columns.times[i] - from); // garbage for events not kept
+                    columns.keys[i] = columns.keys[i] * buckets
+                                    + (uint64_t)(((unsigned __int128)reciprocal * offset) >> 64);
+                }
+            } else {
+                for (uint32_t i = 0; i < count; i++) {
+                    if (!columns.keep[i]) continue;
+                    columns.keys[i] = columns.keys[i] * buckets + ((uint64_t)columns.times[i] - (uint64_t)from) / width;
+                }
+            }
+        }
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            columns.selected[kept] = (uint16_t)i;
+            kept += columns.keep[i];
+        }
+        uint64_t* slots = counts.data();
+        for (uint32_t j = 0; j < kept; j++) slots[columns.keys[columns.selected[j]]]++;
+    }
+
+public:
+    CirculationEventLog() : encodedBytes(0) {}
+
+    // Blocks sealed when the view was opened, plus its copy of the open tail
+    class View {
+    private:
+        friend class CirculationEventLog;
+        vector<shared_ptr<const Block>> blocks;
+
+    public:
+        // Adds the query's counts into counts, growing it as needed
+        ScanStats aggregate(const Query& query, vector<uint64_t>& counts) const {
+            ScanStats stats;
+            stats.blocks = blocks.size();
+            if (query.to <= query.from || (query.group == BY_BOOK_KEY && !query.bookKeys)) return stats;
+            uint64_t buckets = query.bucketSeconds > 0
+                             ? ((uint64_t)query.to - (uint64_t)query.from - 1) / (uint64_t)query.bucketSeconds + 1
+                             : 1;
+            uint64_t keys = 1;
+            if (query.group == BY_BOOK_KEY) {
+                for (uint32_t key : *query.bookKeys) {
+                    if (key != ANY) keys = max<uint64_t>(keys, (uint64_t)key + 1);
+                }
+            }
+            unique_ptr<Columns> columns(new Columns);
+            for (const shared_ptr<const Block>& block : blocks) {
+                if (!overlaps(block->header, query)) continue;
+                if (query.group == BY_USER) keys = max<uint64_t>(keys, (uint64_t)block->header.maxUser + 1);
+                if (counts.size() < keys * buckets) counts.resize(keys * buckets, 0);
+                CirculationEventLog::count(query, *block, *columns, buckets, counts);
+                stats.decoded++;
+                stats.events += block->header.count;
+            }
+            return stats;
+        }
+    };
+
+    void append(Kind kind, int64_t time, int32_t userId, uint32_t bookId) {
+        tailTimes.push_back(time);
+        tailUsers.push_back((uint32_t)userId);
+        tailBooks.push_back(bookId);
+        tailKinds.push_back(kind);
+        if (tailTimes.size() == BLOCK_EVENTS) {
+            blocks.push_back(encode(tailTimes.data(), tailUsers.data(), tailBooks.data(), tailKinds.data(),
+                                    BLOCK_EVENTS));
+            encodedBytes += blocks.back()->bytes.size() + sizeof(BlockHeader);
+            tailTimes.clear();
+            tailUsers.clear();
+            tailBooks.clear();
+            tailKinds.clear();
+        }
+    }
+
+    // Encodes the open tail into the view, so it costs at most one block
+    View view() const {
+        View view;
+        view.blocks.reserve(blocks.size() + 1);
+        view.blocks = blocks;
+        if (!tailTimes.empty()) {
+            view.blocks.push_back(encode(tailTimes.data(), tailUsers.data(), tailBooks.data(), tailKinds.data(),
+                                         (uint32_t)tailTimes.size()));
+        }
+        return view;
+    }
+
+    size_t events() const { return blocks.size() * BLOCK_EVENTS + tailTimes.size(); }
+    size_t sealedBlocks() const { return blocks.size(); }
+    size_t bytes() const { return encodedBytes + tailTimes.size() * (sizeof(int64_t) + 2 * sizeof(uint32_t) + 1); }
+
+    // Sealed block as stored on disk: its header, then its columns
+    void serializeBlock(size_t index, BinaryWriter& out) const {
+        out.put(blocks[index]->header);
+        out.putBytes(blocks[index]->bytes.data(), blocks[index]->header.size);
+    }
+
+    // Adds a sealed block read back by serializeBlock; false if damaged
+    bool restoreBlock(BinaryReader& in) {
+        shared_ptr<Block> block = make_shared<Block>();
+        block->header = in.get<BlockHeader>();
+        const BlockHeader& header = block->header;
+        const char* bytes = in.ok() ? in.getBytes(header.size) : nullptr;
+        uint32_t controlBytes = (header.count + 3) / 4;
+        if (!bytes || header.count != BLOCK_EVENTS || header.userOffset < controlBytes
+            || header.bookOffset < header.userOffset + controlBytes || header.kindOffset < header.bookOffset + controlBytes
+            || header.kindOffset + (header.count + 7) / 8 != header.size) {
+            return false;
+        }
+        block->bytes.assign(bytes, bytes + header.size);
+        block->bytes.resize(header.size + PADDING, 0);
+        const uint8_t* columns = block->bytes.data();
+        if (columnSize(columns, header.count, TIME_WIDTHS) != header.userOffset
+            || columnSize(columns + header.userOffset, header.count, ID_WIDTHS) != header.bookOffset - header.userOffset
+            || columnSize(columns + header.bookOffset, header.count, ID_WIDTHS) != header.kindOffset - header.bookOffset) {
+            return false;
+        }
+        encodedBytes += block->bytes.size() + sizeof(BlockHeader);
+        blocks.push_back(move(block));
+        return true;
+    }
+
+    // Visits (kind, time, user ID, book ID) for each event in the open tail
+    template <typename Visitor>
+    void forEachTailEvent(Visitor visit) const {
+        for (size_t i = 0; i < tailTimes.size(); i++) {
+            visit((Kind)tailKinds[i], tailTimes[i], (int32_t)tailUsers[i], tailBooks[i]);
+        }
+    }
+};
+
+// Persistence: a binary catalog snapshot that is mmap'd at startup, plus an
+// append-only write-ahead log of every change made since that snapshot.
+// Book additions carry the ISBN as text; every later record names the book
+// by its packed key. A book handed to a hold on return is logged as the
+// return followed by an issue to the holder. Issues carry the copy number
+// after the time, and returns their time, which later fines are worked out
+// from. Titles with more than one copy follow their add with record 12.
+// Numbers 2, 5 and 6 are retired and must not be reused. Sealed blocks of
+// the circulation event log go to their own append-only file, and the
+// snapshot records how much of it, plus the unsealed tail, it covers.
+enum WalRecordType : uint8_t {
+    WAL_ADD_BOOK = 1,
+    WAL_ADD_USER = 3,
+    WAL_REMOVE_USER = 4,
+    WAL_REMOVE_BOOK = 7,
+    WAL_ISSUE = 8,
+    WAL_RETURN = 9,
+    WAL_PLACE_HOLD = 10,
+    WAL_CANCEL_HOLD = 11,
+    WAL_ADD_COPIES = 12,
+};
+
+// On-disk snapshot layout. Every section starts 8-byte aligned so records
+// can be read in place from the mapping.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t walSequence;   // first WAL segment not folded into this snapshot
+    uint64_t bookCount;
+    uint64_t bookSlots;     // highest book ID + 1
+    uint64_t userSlots;     // user IDs 1..userSlots, tombstones included
+    uint64_t loanCount;
+    uint64_t frequencyCount;
+    uint64_t booksOffset;
+    uint64_t usersOffset;
+    uint64_t loansOffset;
+    uint64_t frequencyOffset;
+    uint64_t keywordOffset;
+    uint64_t keywordSize;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t holdCount;
+    uint64_t holdsOffset;
+    uint64_t eventBytes;    // length of events.col folded in
+    uint64_t eventCount;    // events in the open tail
+    uint64_t eventsOffset;
+};
+
+struct SnapshotBook {      // stored in title order
+    uint32_t bookId;
+    int32_t borrowCount;
+    uint32_t titleLength;
+    uint32_t authorLength;
+    uint32_t genreLength;
+    uint32_t copies;
+    uint64_t isbn;          // IsbnKey
+    uint64_t strings;       // title, author, genre back to back
+};
+
+struct SnapshotUser {      // stored in ID order
+    int32_t userId;
+    uint32_t nameLength;
+    uint32_t emailLength;
+    uint32_t loanCount;
+    uint64_t strings;       // name, email back to back
+    uint64_t firstLoan;     // index into the loan section
+    uint8_t active;
+    uint8_t padding[3];
+    uint32_t fines;         // cents
+};
+
+struct SnapshotFrequency { // issues per book per day, recent days only
+    uint32_t bookId;
+    uint32_t count;
+    int64_t day;
+};
+
+struct SnapshotLoan {
+    uint32_t bookId;
+    uint32_t copy;
+    int64_t dueAt;
+};
+
+struct SnapshotHold {      // each book's holds in queue order
+    uint32_t bookId;
+    int32_t userId;
+    int64_t expiresAt;
+};
+
+struct SnapshotEvent {     // circulation events not yet sealed into a block
+    int64_t time;
+    int32_t userId;
+    uint32_t bookId;
+    uint8_t kind;
+    uint8_t padding[7];
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'L', 'I', 'B', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    void* address;
+    size_t length;
+
+public:
+    MappedFile() : address(nullptr), length(0) {}
+    ~MappedFile() {
+        if (address) munmap(address, length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        length = (size_t)info.st_size;
+        address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            address = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    const char* data() const { return static_cast<const char*>(address); }
+    size_t size() const { return length; }
+};
+
+inline bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// Owns the data directory: the snapshot file, numbered WAL segments and
+// the circulation event file. Records are appended to an in-memory group
+// and made durable together by commit(); compaction writes a new snapshot
+// on a background thread.
+class StorageEngine {
+private:
+    string directory;
+    int walFd;
+    int eventFd;           // events.col, opened on first use
+    uint64_t eventBytes;   // its size
+    uint64_t walSequence;  // segment currently being appended to
+    size_t walBytes;       // size of the current segment
+    vector<char> pending;  // records not yet committed
+    size_t pendingRecords;
+    thread compactor;
+    atomic<bool> compacting;
+
+    string snapshotPath() const { return directory + "/catalog.snap"; }
+    string eventsPath() const { return directory + "/events.col"; }
+
+    string walPath(uint64_t sequence) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/wal-%06llu.log", (unsigned long long)sequence);
+        return directory + name;
+    }
+
+    bool openSegment(uint64_t sequence) {
+        if (walFd >= 0) close(walFd);
+        walSequence = sequence;
+        walFd = ::open(walPath(sequence).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        struct stat info;
+        walBytes = (walFd >= 0 && fstat(walFd, &info) == 0) ? (size_t)info.st_size : 0;
+        return walFd >= 0;
+    }
+
+    void syncDirectory() const {
+        int fd = ::open(directory.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+public:
+    explicit StorageEngine(const string& directory)
+        : directory(directory), walFd(-1), eventFd(-1), eventBytes(0), walSequence(0), walBytes(0),
+          pendingRecords(0), compacting(false) {}
+
+    ~StorageEngine() {
+        commit();
+        if (compactor.joinable()) compactor.join();
+        if (walFd >= 0) close(walFd);
+        if (eventFd >= 0) close(eventFd);
+    }
+
+    StorageEngine(const StorageEngine&) = delete;
+    StorageEngine& operator=(const StorageEngine&) = delete;
+
+    bool prepareDirectory() {
+        return mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST;
+    }
+
+    bool mapSnapshot(MappedFile& file) const {
+        return file.open(snapshotPath());
+    }
+
+    // WAL segment numbers present on disk, ascending
+    vector<uint64_t> listSegments() const {
+        vector<uint64_t> segments;
+        DIR* dir = opendir(directory.c_str());
+        if (!dir) return segments;
+        while (dirent* entry = readdir(dir)) {
+            unsigned long long sequence;
+            char tail;
+            if (sscanf(entry->d_name, "wal-%llu.lo%c", &sequence, &tail) == 2 && tail == 'g') {
+                segments.push_back(sequence);
+            }
+        }
+        closedir(dir);
+        sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Calls apply(type, reader) for each intact record of a segment. A torn
+    // or corrupt tail, left by a crash mid-commit, is truncated away.
+    template <typename Apply>
+    size_t replaySegment(uint64_t sequence, Apply apply) {
+        MappedFile file;
+        if (!file.open(walPath(sequence))) return 0;
+        size_t offset = 0, records = 0;
+        while (file.size() - offset >= 9) {
+            uint32_t length, checksum;
+            memcpy(&length, file.data() + offset, 4);
+            memcpy(&checksum, file.data() + offset + 4, 4);
+            if (length == 0 || file.size() - offset - 8 < length
+                || crc32(file.data() + offset + 8, length) != checksum) {
+                break;
+            }
+            BinaryReader reader(file.data() + offset + 9, length - 1);
+            apply((WalRecordType)file.data()[offset + 8], reader);
+            offset += 8 + length;
+            records++;
+        }
+        if (offset < file.size()) {
+            cerr << "Warning: truncating damaged tail of " << walPath(sequence) << "\n";
+            if (truncate(walPath(sequence).c_str(), (off_t)offset) != 0) {
+                cerr << "Warning: could not truncate " << walPath(sequence) << "\n";
+            }
+        }
+        return records;
+    }
+
+    bool startSegment(uint64_t sequence) {
+        return openSegment(sequence);
+    }
+
+    // Calls apply(reader) for each intact event block among the first
+    // length bytes of the event file, then cuts the file at the end of the
+    // last one. Blocks past length were sealed after the snapshot and are
+    // rebuilt by WAL replay. Returns false if blocks the snapshot counts
+    // on are missing or damaged.
+    template <typename Apply>
+    bool loadEvents(uint64_t length, Apply apply) {
+        MappedFile file;
+        size_t size = file.open(eventsPath()) ? file.size() : 0;
+        uint64_t offset = 0;
+        bool intact = true;
+        while (offset < length) {
+            uint32_t blockLength, checksum;
+            if (size - offset < 8) {
+                intact = false;
+                break;
+            }
+            memcpy(&blockLength, file.data() + offset, 4);
+            memcpy(&checksum, file.data() + offset + 4, 4);
+            if (size - offset - 8 < blockLength || crc32(file.data() + offset + 8, blockLength) != checksum) {
+                intact = false;
+                break;
+            }
+            BinaryReader reader(file.data() + offset + 8, blockLength);
+            if (!apply(reader)) {
+                intact = false;
+                break;
+            }
+            offset += 8 + blockLength;
+        }
+        if (offset != size && truncate(eventsPath().c_str(), (off_t)offset) != 0 && size > 0) {
+            cerr << "Warning: could not truncate " << eventsPath() << "\n";
+        }
+        eventBytes = offset;
+        return intact && offset == length;
+    }
+
+    // Appends framed event blocks and syncs them, so a snapshot taken next
+    // can count them: [length][crc32][block]
+    bool appendEvents(const vector<char>& blocks) {
+        if (eventFd < 0) eventFd = ::open(eventsPath().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        bool ok = eventFd >= 0 && writeAll(eventFd, blocks.data(), blocks.size()) && fdatasync(eventFd) == 0;
+        if (ok) {
+            eventBytes += blocks.size();
+        } else {
+            cerr << "Warning: failed to write " << eventsPath() << "\n";
+            if (eventFd >= 0 && ftruncate(eventFd, (off_t)eventBytes) != 0) {
+                cerr << "Warning: could not truncate " << eventsPath() << "\n";
+            }
+        }
+        return ok;
+    }
+
+    uint64_t eventFileBytes() const { return eventBytes; }
+
+    // Record framing: [length][crc32 of type + payload][type][payload]
+    template <typename Fill>
+    void append(WalRecordType type, Fill fill) {
+        size_t start = pending.size();
+        pending.resize(start + 8);
+        BinaryWriter writer(pending);
+        writer.put<uint8_t>(type);
+        fill(writer);
+        uint32_t length = (uint32_t)(pending.size() - start - 8);
+        uint32_t checksum = crc32(pending.data() + start + 8, length);
+        memcpy(pending.data() + start, &length, 4);
+        memcpy(pending.data() + start + 4, &checksum, 4);
+        pendingRecords++;
+    }
+
+    // Group commit: one write and one fdatasync for all pending records.
+    // A failed write is cut back off the segment and the records are kept
+    // for the next commit to retry, so nothing is appended after torn bytes.
+    bool commit() {
+        if (pending.empty()) return true;
+        bool ok = walFd >= 0 && writeAll(walFd, pending.data(), pending.size()) && fdatasync(walFd) == 0;
+        if (!ok) {
+            cerr << "Warning: failed to write " << walPath(walSequence) << "\n";
+            if (walFd >= 0 && ftruncate(walFd, (off_t)walBytes) != 0) {
+                cerr << "Warning: could not truncate " << walPath(walSequence) << "\n";
+            }
+            return false;
+        }
+        walBytes += pending.size();
+        pending.clear();
+        pendingRecords = 0;
+        return true;
+    }
+
+    size_t segmentBytes() const { return walBytes; }
+    size_t pendingCount() const { return pendingRecords; }
+    uint64_t currentSegment() const { return walSequence; }
+    bool isCompacting() const { return compacting.load(); }
+
+    // Seals the current segment and starts the next one. image must be a
+    // snapshot of the state as of this call with walSequence set to the new
+    // segment. It is written, fsynced and renamed into place in the
+    // background, after which the sealed segments are deleted.
+    void compact(vector<char> image) {
+        if (compactor.joinable()) compactor.join();
+        if (!commit()) return; // the image counts on records not yet in the segment
+        uint64_t sealed = walSequence;
+        openSegment(walSequence + 1);
+        compacting = true;
+        compactor = thread([this, sealed, image = move(image)]() {
+            string temporary = snapshotPath() + ".tmp";
+            int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool ok = fd >= 0 && writeAll(fd, image.data(), image.size()) && fsync(fd) == 0;
+            if (fd >= 0) close(fd);
+            ok = ok && rename(temporary.c_str(), snapshotPath().c_str()) == 0;
+            if (ok) {
+                syncDirectory();
+                for (uint64_t segment : listSegments()) {
+                    if (segment <= sealed) unlink(walPath(segment).c_str());
+                }
+            } else {
+                cerr << "Warning: snapshot compaction failed; WAL segments kept\n";
+            }
+            compacting = false;
+        });
+    }
+};
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring
+// buffer). Each cell carries a sequence number saying whether it is ready
+// to be written or read, so push and pop each cost a single CAS.
+template <typename T>
+class MPMCQueue {
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePosition;
+    alignas(64) atomic<size_t> dequeuePosition;
+
+public:
+    // capacity must be a power of two
+    explicit MPMCQueue(size_t capacity)
+        : cells(new Cell[capacity]), mask(capacity - 1), enqueuePosition(0), dequeuePosition(0) {
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    // Returns false when full; value is only moved from on success
+    template <typename U = T>
+    bool push(U&& value) {
+        size_t position = enqueuePosition.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    cell.value = std::forward<U>(value);
+                    cell.sequence.store(position + 1, memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns false when empty
+    bool pop(T& value) {
+        size_t position = dequeuePosition.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (difference == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    value = move(cell.value);
+                    cell.sequence.store(position + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeuePosition.load(memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Publisher catalog dumps: CSV or TSV rows of isbn, title, author, genre,
+// then optionally the number of copies held; a fifth column that is not a
+// count from 1 to MAX_COPIES, and any further columns, are ignored. Fields
+// may be double-quoted, with "" for a literal quote, but a row may not
+// span lines. ISBNs are validated while parsing; the other fields are
+// views into the mapped file, and only fields containing "" are copied,
+// to unescape them.
+struct CatalogRow {
+    IsbnKey isbn; // NO_ISBN marks a possible header row
+    string_view title;
+    string_view author;
+    string_view genre;
+    uint32_t copies;
+};
+
+class CatalogParser {
+public:
+    struct Chunk {
+        vector<CatalogRow> rows;
+        deque<string> unescaped; // stable storage for unescaped fields
+        size_t malformed = 0;
+    };
+
+    // Tab-separated if the first line has a tab, comma-separated otherwise
+    static char detectDelimiter(const char* data, size_t size) {
+        const char* lineEnd = static_cast<const char*>(memchr(data, '\n', size));
+        size_t length = lineEnd ? (size_t)(lineEnd - data) : size;
+        return memchr(data, '\t', length) ? '\t' : ',';
+    }
+
+    // Start of the line after position, or end
+    static const char* nextLine(const char* position, const char* end) {
+        const char* newline = static_cast<const char*>(memchr(position, '\n', end - position));
+        return newline ? newline + 1 : end;
+    }
+
+    // Parses whole lines in [begin, end), adding each consumed byte to progress
+    static void parse(const char* begin, const char* end, char delimiter, Chunk& chunk, atomic<size_t>& progress) {
+        const size_t REPORT_BYTES = 1 << 20;
+        const char* reported = begin;
+        for (const char* line = begin; line < end; ) {
+            const char* next = nextLine(line, end);
+            const char* lineEnd = next;
+            while (lineEnd > line && (lineEnd[-1] == '\n' || lineEnd[-1] == '\r')) lineEnd--;
+            if (lineEnd > line) {
+                string_view fields[5];
+                IsbnKey isbn = NO_ISBN;
+                size_t count = splitFields(string_view(line, lineEnd - line), delimiter, fields, chunk.unescaped);
+                if (count >= 4
+                    && !fields[1].empty()
+                    && ((isbn = parseIsbn(fields[0])) != NO_ISBN || (line == begin && isHeader(fields[0])))) {
+                    chunk.rows.push_back(CatalogRow{isbn, fields[1], fields[2], fields[3],
+                                                    count >= 5 ? copiesOf(fields[4]) : 1});
+                } else {
+                    chunk.malformed++;
+                }
+            }
+            line = next;
+            if ((size_t)(line - reported) >= REPORT_BYTES) {
+                progress += line - reported;
+                reported = line;
+            }
+        }
+        progress += end - reported;
+    }
+
+private:
+    static bool isHeader(string_view field) {
+        return field.size() == 4 && tolower((unsigned char)field[0]) == 'i' && tolower((unsigned char)field[1]) == 's'
+            && tolower((unsigned char)field[2]) == 'b' && tolower((unsigned char)field[3]) == 'n';
+    }
+
+    static uint32_t copiesOf(string_view field) {
+        uint32_t copies = 0;
+        for (char c : field) {
+            if (c < '0' || c > '9' || copies > Book::MAX_COPIES) return 1;
+            copies = copies * 10 + (c - '0');
+        }
+        return copies >= 1 && copies <= Book::MAX_COPIES ? copies : 1;
+    }
+
+    static string_view trim(string_view value) {
+        while (!value.empty() && isspace((unsigned char)value.front())) value.remove_prefix(1);
+        while (!value.empty() && isspace((unsigned char)value.back())) value.remove_suffix(1);
+        return value;
+    }
+
+    // Fills the first five fields; returns the field count, or 0 if a
+    // quoted field is not closed properly
+    static size_t splitFields(string_view line, char delimiter, string_view fields[5], deque<string>& unescaped) {
+        size_t count = 0;
+        size_t pos = 0;
+        while (true) {
+            while (pos < line.size() && line[pos] == ' ') pos++;
+            string_view value;
+            if (pos < line.size() && line[pos] == '"') {
+                size_t start = ++pos;
+                bool escaped = false;
+                while (pos < line.size()) {
+                    if (line[pos] == '"') {
+                        if (pos + 1 < line.size() && line[pos + 1] == '"') {
+                            escaped = true;
+                            pos += 2;
+                            continue;
+                        }
+                        break;
+                    }
+                    pos++;
+                }
+                if (pos >= line.size()) return 0;
+                value = line.substr(start, pos - start);
+                pos++;
+                while (pos < line.size() && line[pos] == ' ') pos++;
+                if (pos < line.size() && line[pos] != delimiter) return 0;
+                if (escaped) {
+                    string& copy = unescaped.emplace_back();
+                    copy.reserve(value.size());
+                    for (size_t i = 0; i < value.size(); i++) {
+                        copy += value[i];
+                        if (value[i] == '"') i++;
+                    }
+                    value = copy;
+                }
+            } else {
+                size_t start = pos;
+                pos = line.find(delimiter, pos);
+                if (pos == string_view::npos) pos = line.size();
+                value = trim(line.substr(start, pos - start));
+            }
+            if (count < 5) fields[count] = value;
+            count++;
+            if (pos >= line.size()) return count;
+            pos++; // delimiter
+        }
+    }
+};
+
+// Operation metrics. Latencies go into log-linear histograms in the spirit
+// of HDR histograms: every power of two of nanoseconds is split into 16
+// linear sub-buckets, so a value is known to within 1/16 of itself. Each
+// thread records into its own block, so recording takes no lock and no
+// read-modify-write instruction; readers merge the blocks. Defining
+// LIBRARY_NO_METRICS compiles every timer and recording call away.
+enum MetricOperation {
+    METRIC_SEARCH,
+    METRIC_ISSUE,
+    METRIC_RETURN,
+    METRIC_ADD_BOOK,
+    METRIC_REPORT,
+    METRIC_OPERATION_COUNT
+};
+
+static const char* const METRIC_NAMES[METRIC_OPERATION_COUNT] = {
+    "search", "issue", "return", "add_book", "report"};
+
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKETS = 16;
+    static const int BUCKET_COUNT = (64 - 4 + 1) * SUB_BUCKETS;
+
+private:
+    // Written only by the owning thread; atomics keep concurrent merges defined
+    atomic<uint64_t> counts[BUCKET_COUNT];
+    atomic<uint64_t> total;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> maximum;
+
+    static void bump(atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+public:
+    LatencyHistogram() : total(0), sum(0), maximum(0) {
+        for (auto& count : counts) count.store(0, memory_order_relaxed);
+    }
+
+    static int bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return (int)value;
+        int shift = 63 - __builtin_clzll(value) - 4;
+        return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Largest value that lands in bucket
+    static uint64_t upperBound(int bucket) {
+        if (bucket < SUB_BUCKETS) return (uint64_t)bucket;
+        int shift = bucket / SUB_BUCKETS - 1;
+        return ((uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1;
+    }
+
+    void record(uint64_t nanoseconds) {
+        bump(counts[bucketOf(nanoseconds)], 1);
+        bump(total, 1);
+        bump(sum, nanoseconds);
+        if (nanoseconds > maximum.load(memory_order_relaxed)) maximum.store(nanoseconds, memory_order_relaxed);
+    }
+
+    // Folds another thread's histogram into this unshared one
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKET_COUNT; i++) bump(counts[i], other.counts[i].load(memory_order_relaxed));
+        bump(total, other.total.load(memory_order_relaxed));
+        bump(sum, other.sum.load(memory_order_relaxed));
+        maximum.store(max(maximum.load(memory_order_relaxed), other.maximum.load(memory_order_relaxed)),
+                      memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    uint64_t totalNanoseconds() const { return sum.load(memory_order_relaxed); }
+    uint64_t maxNanoseconds() const { return maximum.load(memory_order_relaxed); }
+    uint64_t bucketCount(int bucket) const { return counts[bucket].load(memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the given quantile
+    uint64_t percentile(double quantile) const {
+        uint64_t rank = (uint64_t)ceil(quantile * count()), seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            seen += bucketCount(i);
+            if (seen >= rank && seen > 0) return min(upperBound(i), maxNanoseconds());
+        }
+        return 0;
+    }
+};
+
+class Metrics {
+private:
+    struct ThreadBlock {
+        LatencyHistogram histograms[METRIC_OPERATION_COUNT];
+        bool inUse = false; // guarded by blocksLock
+    };
+
+    // Returns a thread's block to the pool when the thread exits; its counts
+    // stay in the totals and the next new thread carries on from them
+    struct Lease {
+        ThreadBlock* block;
+
+        Lease() {
+            Metrics& metrics = instance();
+            lock_guard<mutex> guard(metrics.blocksLock);
+            block = nullptr;
+            for (auto& candidate : metrics.blocks) {
+                if (!candidate->inUse) {
+                    block = candidate.get();
+                    break;
+                }
+            }
+            if (!block) {
+                metrics.blocks.emplace_back(new ThreadBlock);
+                block = metrics.blocks.back().get();
+            }
+            block->inUse = true;
+        }
+
+        ~Lease() {
+            lock_guard<mutex> guard(instance().blocksLock);
+            block->inUse = false;
+        }
+    };
+
+    mutex blocksLock;
+    vector<unique_ptr<ThreadBlock>> blocks;
+
+    Metrics() {}
+
+public:
+    struct Gauges {
+        size_t books = 0;
+        size_t users = 0;
+        double hashLoadFactor = 0;
+        size_t hashMaxProbeLength = 0;
+        int titleTreeHeight = 0;
+        size_t holds = 0;
+        size_t loans = 0;
+        size_t overdue = 0;
+    };
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void record(MetricOperation operation, uint64_t nanoseconds) {
+        thread_local Lease lease;
+        lease.block->histograms[operation].record(nanoseconds);
+    }
+
+    // Merges every thread's histogram for one operation
+    void collect(MetricOperation operation, LatencyHistogram& merged) {
+        lock_guard<mutex> guard(blocksLock);
+        for (const auto& block : blocks) merged.merge(block->histograms[operation]);
+    }
+
+    void printSummary(ostream& out, const Gauges& gauges) {
+        out << left << setw(12) << "Operation" << setw(12) << "Count" << setw(12) << "Mean us"
+            << setw(12) << "p50 us" << setw(12) << "p99 us" << "Max us\n";
+        out << string(70, '-') << "\n" << fixed << setprecision(1);
+        for (int op = 0; op < METRIC_OPERATION_COUNT; op++) {
+            LatencyHistogram histogram;
+            collect((MetricOperation)op, histogram);
+            uint64_t count = histogram.count();
+            out << left << setw(12) << METRIC_NAMES[op] << setw(12) << count
+                << setw(12) << (count ? histogram.totalNanoseconds() / 1000.0 / count : 0.0)
+                << setw(12) << histogram.percentile(0.5) / 1000.0
+                << setw(12) << histogram.percentile(0.99) / 1000.0
+                << histogram.maxNanoseconds() / 1000.0 << "\n";
+        }
+        out << defaultfloat << setprecision(6);
+        out << "\nBooks: " << gauges.books << ", users: " << gauges.users << "\n";
+        out << "Hash table load factor: " << fixed << setprecision(3) << gauges.hashLoadFactor
+            << defaultfloat << setprecision(6) << ", longest probe: " << gauges.hashMaxProbeLength << "\n";
+        out << "Title tree height: " << gauges.titleTreeHeight << "\n";
+        out << "Holds waiting: " << gauges.holds << "\n";
+        out << "Loans out: " << gauges.loans << ", overdue: " << gauges.overdue << "\n";
+    }
+
+    // Prometheus text exposition format
+    void printPrometheus(ostream& out, const Gauges& gauges) {
+        static const double bounds[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4,
+                                        5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 1.0};
+        out << "# HELP library_operation_duration_seconds Latency of library operations.\n";
+        out << "# TYPE library_operation_duration_seconds histogram\n";
+        for (int op = 0; op < METRIC_OPERATION_COUNT; op++) {
+            LatencyHistogram histogram;
+            collect((MetricOperation)op, histogram);
+            // A bucket counts towards a bound once its whole range fits under it
+            int bucket = 0;
+            uint64_t cumulative = 0;
+            for (double bound : bounds) {
+                uint64_t limit = (uint64_t)(bound * 1e9);
+                for (; bucket < LatencyHistogram::BUCKET_COUNT
+                       && LatencyHistogram::upperBound(bucket) <= limit; bucket++) {
+                    cumulative += histogram.bucketCount(bucket);
+                }
+                out << "library_operation_duration_seconds_bucket{operation=\"" << METRIC_NAMES[op]
+                    << "\",le=\"" << bound << "\"} " << cumulative << "\n";
+            }
+            out << "library_operation_duration_seconds_bucket{operation=\"" << METRIC_NAMES[op]
+                << "\",le=\"+Inf\"} " << histogram.count() << "\n";
+            out << "library_operation_duration_seconds_sum{operation=\"" << METRIC_NAMES[op] << "\"} "
+                << histogram.totalNanoseconds() / 1e9 << "\n";
+            out << "library_operation_duration_seconds_count{operation=\"" << METRIC_NAMES[op] << "\"} "
+                << histogram.count() << "\n";
+        }
+        out << "# TYPE library_books gauge\nlibrary_books " << gauges.books << "\n";
+        out << "# TYPE library_users gauge\nlibrary_users " << gauges.users << "\n";
+        out << "# TYPE library_hash_table_load_factor gauge\nlibrary_hash_table_load_factor "
+            << gauges.hashLoadFactor << "\n";
+        out << "# TYPE library_hash_table_max_probe_length gauge\nlibrary_hash_table_max_probe_length "
+            << gauges.hashMaxProbeLength << "\n";
+        out << "# TYPE library_title_tree_height gauge\nlibrary_title_tree_height "
+            << gauges.titleTreeHeight << "\n";
+        out << "# TYPE library_holds_waiting gauge\nlibrary_holds_waiting " << gauges.holds << "\n";
+        out << "# TYPE library_loans gauge\nlibrary_loans " << gauges.loans << "\n";
+        out << "# TYPE library_loans_overdue gauge\nlibrary_loans_overdue " << gauges.overdue << "\n";
+    }
+};
+
+// Records the lifetime of a scope as one operation
+class OperationTimer {
+#ifndef LIBRARY_NO_METRICS
+private:
+    MetricOperation operation;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit OperationTimer(MetricOperation operation)
+        : operation(operation), start(chrono::steady_clock::now()) {}
+
+    ~OperationTimer() {
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+        Metrics::instance().record(operation, (uint64_t)elapsed.count());
+    }
+#else
+public:
+    explicit OperationTimer(MetricOperation) {}
+#endif
+};
+
+// Runs work as one timed operation and returns its result
+template <typename Work>
+inline auto timed(MetricOperation operation, Work work) -> decltype(work()) {
+    OperationTimer timer(operation);
+    return work();
+}
+
+// Main Library System
+class LibrarySystem {
+private:
+    ObjectPool<Book> bookPool; // owns every Book; declared first so it outlives the indexes
+    BookHashTable bookInventory;
+    BookBPlusTree bookSearchTree;
+    BookAttributeIndex authorIndex;
+    BookAttributeIndex genreIndex;
+    KeywordIndex keywordIndex;
+    CatalogColumns catalogColumns; // columnar copy of the catalog for report scans
+    FuzzyIndex titleFuzzyIndex;  // by book ID
+    FuzzyIndex authorFuzzyIndex; // by catalogColumns author code
+    vector<Book*> booksById; // nullptr once a book is removed
+    ostream* messages; // per-request circulation messages; null suppresses them
+    UserStore userManager;
+    MPMCQueue<pair<int, IsbnKey>> issueQueue; // Queue for book issue requests
+    MPMCQueue<pair<int, IsbnKey>> returnQueue; // Queue for book return requests
+    BorrowStatistics borrowStatistics; // For most borrowed books report
+    HoldQueues holdQueues; // patrons waiting for books that are out
+    DueDateWheel dueDates; // every loan by due date
+    CirculationLedger ledger; // loans and fines as reports read them
+    CirculationEventLog circulationEvents; // every issue and return, for activity reports
+    size_t persistedEventBlocks; // sealed blocks already in the event file
+    LibraryClock clock;
+    int64_t replayTime; // issue or return time carried by the WAL record being replayed
+    uint32_t replayCopy; // copy an issue record names
+    
+    // Circulation worker pool (see startWorkers)
+    static const int LOCK_STRIPES = 64;
+    static const size_t QUEUE_CAPACITY = 1 << 16;
+    mutex userLocks[LOCK_STRIPES]; // guard User::borrowedBooks, striped by user ID
+    mutex frequencyLock; // guards borrowStatistics
+    mutex dueLock; // guards dueDates and ledger writes; taken inside userLocks
+    mutex eventLock; // guards circulationEvents appends and views
+    mutex logLock;
+    vector<thread> workers;
+    vector<unique_ptr<ostringstream>> workerOutput;
+    atomic<bool> workersRunning;
+    atomic<size_t> requestsInFlight;
+    atomic<size_t> batchSucceeded;
+    atomic<size_t> holdsPlaced; // since startup, for the batch summary
+    atomic<size_t> holdsFilled;
+    mutex wakeLock;
+    condition_variable wakeWorkers;
+    unique_ptr<StorageEngine> storage; // null unless a data directory is open
+    bool replaying; // set while restoring state, so nothing is logged twice
+    bool holdsEnabled;
+    
+    // Periodic Prometheus dump (see startMetricsDump)
+    thread metricsThread;
+    mutex metricsLock;
+    condition_variable metricsWake;
+    bool metricsStopping;
+    Metrics::Gauges publishedGauges; // guarded by metricsLock
+    
+    // Server replies (see handleRequest); one request at a time
+    ostringstream requestMessages;
+    ostream discardedRows;
+    ListingWriter bookReplies;
+    ListingWriter userReplies;
+    
+    static const size_t COMPACTION_THRESHOLD = 64 << 20; // WAL bytes
+    static const size_t MOST_BORROWED_ROWS = 20;
+    static const size_t REPORT_PAGE_SIZE = 20;
+    static constexpr string_view RECORD_RULE = "------------------------------\n";
+    static const size_t FUZZY_RESULTS = 10;
+    static const size_t TITLE_SUGGESTIONS = 5;
+    static const int64_t HOLD_DAYS = 14; // an unfilled hold lapses after this
+    static const int64_t LOAN_DAYS = 14;
+    static const uint32_t FINE_PER_DAY = 25; // cents per day, or part day, late
+    
+    template <typename Fill>
+    void logEvent(WalRecordType type, Fill fill) {
+        if (storage && !replaying) {
+            lock_guard<mutex> guard(logLock);
+            storage->append(type, fill);
+        }
+    }
+    
+    mutex& userLock(int userId) {
+        return userLocks[(unsigned)userId % LOCK_STRIPES];
+    }
+    
+    // Adds a book to every index
+    void registerBook(Book* book) {
+        OperationTimer timer(METRIC_ADD_BOOK);
+        book->bookId = (uint32_t)booksById.size();
+        booksById.push_back(book);
+        bookInventory.insert(book);
+        bookSearchTree.insert(book);
+        authorIndex.insert(book->author, book);
+        genreIndex.insert(book->genre, book);
+        keywordIndex.addDocument(book->bookId, *book);
+        catalogColumns.addBook(*book);
+        titleFuzzyIndex.add(book->bookId, book->title);
+        indexNewAuthors();
+        logEvent(WAL_ADD_BOOK, [&](BinaryWriter& out) {
+            out.putString(formatIsbn(book->isbn));
+            out.putString(book->title);
+            out.putString(book->author);
+            out.putString(book->genre);
+        });
+    }
+
+    // Adds authors first seen since the last call to the fuzzy author index.
+    // Author codes are never reused, so authors whose books are all gone
+    // stay indexed and are filtered out when matches are shown.
+    void indexNewAuthors() {
+        for (uint32_t code = authorFuzzyIndex.idCount(); code < catalogColumns.authorCount(); code++) {
+            authorFuzzyIndex.add(code, catalogColumns.authorLabel(code));
+        }
+    }
+
+    // Drops a book from every index and frees it
+    void unregisterBook(Book* book) {
+        logEvent(WAL_REMOVE_BOOK, [&](BinaryWriter& out) { out.put<uint64_t>(book->isbn); });
+        bookSearchTree.remove(book);
+        authorIndex.remove(book->author, book);
+        genreIndex.remove(book->genre, book);
+        keywordIndex.removeDocument(book->bookId, *book);
+        catalogColumns.removeBook(*book);
+        titleFuzzyIndex.remove(book->bookId, book->title);
+        holdQueues.drop(book->bookId);
+        booksById[book->bookId] = nullptr;
+        bookInventory.remove(book->isbn);
+        bookPool.destroy(book);
+    }
+
+    // Re-applies one logged change during recovery
+    void applyWalRecord(WalRecordType type, BinaryReader& in) {
+        switch (type) {
+            case WAL_ADD_BOOK: {
+                IsbnKey isbn = parseIsbn(in.getString());
+                string title = in.getString();
+                string author = in.getString();
+                string genre = in.getString();
+                if (in.ok() && isbn != NO_ISBN && !bookInventory.search(isbn)) {
+                    registerBook(bookPool.create(isbn, title, author, genre));
+                }
+                break;
+            }
+            case WAL_REMOVE_BOOK: {
+                IsbnKey isbn = in.get<uint64_t>();
+                Book* book = in.ok() ? bookInventory.search(isbn) : nullptr;
+                if (book) unregisterBook(book);
+                break;
+            }
+            case WAL_ADD_USER: {
+                string name = in.getString();
+                string email = in.getString();
+                if (in.ok()) registerUser(name, email);
+                break;
+            }
+            case WAL_REMOVE_USER:
+                userManager.removeUser(in.get<int32_t>());
+                break;
+            case WAL_ISSUE:
+            case WAL_RETURN: {
+                int userId = in.get<int32_t>();
+                IsbnKey isbn = in.get<uint64_t>();
+                replayTime = in.get<int64_t>();
+                if (type == WAL_ISSUE) replayCopy = in.get<uint32_t>();
+                if (!in.ok()) break;
+                if (type == WAL_ISSUE) {
+                    issueQueue.push({userId, isbn});
+                    processIssueQueue();
+                } else {
+                    returnQueue.push({userId, isbn});
+                    processReturnQueue();
+                }
+                break;
+            }
+            case WAL_PLACE_HOLD: {
+                int32_t userId = in.get<int32_t>();
+                IsbnKey isbn = in.get<uint64_t>();
+                int64_t expiresAt = in.get<int64_t>();
+                Book* book = in.ok() ? bookInventory.search(isbn) : nullptr;
+                if (book) holdQueues.restore(book->bookId, {userId, expiresAt});
+                break;
+            }
+            case WAL_CANCEL_HOLD: {
+                int32_t userId = in.get<int32_t>();
+                IsbnKey isbn = in.get<uint64_t>();
+                Book* book = in.ok() ? bookInventory.search(isbn) : nullptr;
+                if (book) holdQueues.cancel(book->bookId, userId);
+                break;
+            }
+            case WAL_ADD_COPIES: {
+                IsbnKey isbn = in.get<uint64_t>();
+                uint32_t count = in.get<uint32_t>();
+                Book* book = in.ok() ? bookInventory.search(isbn) : nullptr;
+                if (book && count <= Book::MAX_COPIES - book->totalCopies) {
+                    book->addCopies(count);
+                    syncShelved(book);
+                }
+                break;
+            }
+        }
+    }
+    
+    // Serialises the whole library; walSequence names the first WAL segment
+    // whose records are not reflected in this image
+    vector<char> buildSnapshot(uint64_t walSequence) {
+        vector<SnapshotBook> books;
+        vector<SnapshotUser> users;
+        vector<SnapshotLoan> loans;
+        vector<SnapshotFrequency> frequencies;
+        vector<SnapshotHold> holds;
+        vector<SnapshotEvent> events;
+        vector<char> strings, keywords;
+        BinaryWriter stringWriter(strings);
+        
+        books.reserve(bookInventory.size());
+        for (auto it = bookSearchTree.begin(); it != bookSearchTree.end(); ++it) {
+            const Book* book = *it;
+            SnapshotBook record{};
+            record.bookId = book->bookId;
+            record.borrowCount = book->borrowCount;
+            record.copies = book->totalCopies;
+            record.isbn = book->isbn;
+            record.titleLength = (uint32_t)book->title.size();
+            record.authorLength = (uint32_t)book->author.size();
+            record.genreLength = (uint32_t)book->genre.size();
+            record.strings = strings.size();
+            for (const string* field : {&book->title, &book->author, &book->genre}) {
+                stringWriter.putBytes(field->data(), field->size());
+            }
+            books.push_back(record);
+        }
+        
+        userManager.forEachRecord([&](const User* user) {
+            SnapshotUser record{};
+            record.userId = user->userId;
+            record.active = user->active;
+            record.nameLength = (uint32_t)user->name.size();
+            record.emailLength = (uint32_t)user->email.size();
+            record.strings = strings.size();
+            stringWriter.putBytes(user->name.data(), user->name.size());
+            stringWriter.putBytes(user->email.data(), user->email.size());
+            record.fines = user->fines;
+            record.firstLoan = loans.size();
+            const uint16_t* copies = user->borrowedBooks.copies();
+            const uint32_t* dueHandles = user->borrowedBooks.dueHandles();
+            for (const uint32_t* id = user->borrowedBooks.begin(); id != user->borrowedBooks.end(); id++) {
+                size_t index = id - user->borrowedBooks.begin();
+                loans.push_back({*id, copies[index], dueDates.loan(dueHandles[index]).dueAt});
+            }
+            record.loanCount = (uint32_t)(loans.size() - record.firstLoan);
+            users.push_back(record);
+        });
+        
+        borrowStatistics.forEachDay([&](int64_t day, uint32_t bookId, uint32_t count) {
+            if (booksById[bookId]) frequencies.push_back({bookId, count, day});
+        });
+        
+        // Holds of deregistered users would only be skipped on return
+        holdQueues.forEach([&](uint32_t bookId, const HoldQueues::Hold& hold) {
+            if (userManager.findUser(hold.userId)) holds.push_back({bookId, hold.userId, hold.expiresAt});
+        });
+        
+        // Sealed event blocks are already in the event file (see persistEvents)
+        circulationEvents.forEachTailEvent([&](CirculationEventLog::Kind kind, int64_t time, int32_t userId,
+                                               uint32_t bookId) {
+            events.push_back({time, userId, bookId, kind, {}});
+        });
+        
+        BinaryWriter keywordWriter(keywords);
+        keywordIndex.serialize(keywordWriter);
+        
+        SnapshotHeader header{};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.headerSize = sizeof(SnapshotHeader);
+        header.walSequence = walSequence;
+        header.bookCount = books.size();
+        header.bookSlots = booksById.size();
+        header.userSlots = users.size();
+        header.loanCount = loans.size();
+        header.frequencyCount = frequencies.size();
+        header.holdCount = holds.size();
+        header.eventBytes = storage ? storage->eventFileBytes() : 0;
+        header.eventCount = events.size();
+        
+        vector<char> image(sizeof(SnapshotHeader));
+        BinaryWriter out(image);
+        auto section = [&](const void* data, size_t size) {
+            image.resize((image.size() + 7) & ~(size_t)7);
+            uint64_t offset = image.size();
+            out.putBytes(data, size);
+            return offset;
+        };
+        header.booksOffset = section(books.data(), books.size() * sizeof(SnapshotBook));
+        header.usersOffset = section(users.data(), users.size() * sizeof(SnapshotUser));
+        header.loansOffset = section(loans.data(), loans.size() * sizeof(SnapshotLoan));
+        header.frequencyOffset = section(frequencies.data(), frequencies.size() * sizeof(SnapshotFrequency));
+        header.keywordOffset = section(keywords.data(), keywords.size());
+        header.keywordSize = keywords.size();
+        header.stringsOffset = section(strings.data(), strings.size());
+        header.stringsSize = strings.size();
+        header.holdsOffset = section(holds.data(), holds.size() * sizeof(SnapshotHold));
+        header.eventsOffset = section(events.data(), events.size() * sizeof(SnapshotEvent));
+        memcpy(image.data(), &header, sizeof(header));
+        return image;
+    }
+    
+    // Restores an empty library from a mapped snapshot image; eventBytes
+    // is set to the length of the event file it covers
+    bool loadSnapshot(const char* data, size_t size, uint64_t& walSequence, uint64_t& eventBytes) {
+        SnapshotHeader header;
+        if (size < sizeof(header)) return false;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+            || header.version != SNAPSHOT_VERSION || header.headerSize != sizeof(header)) {
+            return false;
+        }
+        auto fits = [size](uint64_t offset, uint64_t count, uint64_t width) {
+            return offset <= size && count <= (size - offset) / width;
+        };
+        if (!fits(header.booksOffset, header.bookCount, sizeof(SnapshotBook))
+            || !fits(header.usersOffset, header.userSlots, sizeof(SnapshotUser))
+            || !fits(header.loansOffset, header.loanCount, sizeof(SnapshotLoan))
+            || !fits(header.frequencyOffset, header.frequencyCount, sizeof(SnapshotFrequency))
+            || !fits(header.keywordOffset, header.keywordSize, 1)
+            || !fits(header.stringsOffset, header.stringsSize, 1)
+            || !fits(header.holdsOffset, header.holdCount, sizeof(SnapshotHold))
+            || !fits(header.eventsOffset, header.eventCount, sizeof(SnapshotEvent))) {
+            return false;
+        }
+        
+        const char* strings = data + header.stringsOffset;
+        auto text = [&](uint64_t offset, uint32_t length) {
+            return offset + length <= header.stringsSize ? string(strings + offset, length) : string();
+        };
+        
+        const SnapshotBook* books = reinterpret_cast<const SnapshotBook*>(data + header.booksOffset);
+        booksById.assign(header.bookSlots, nullptr);
+        vector<Book*> ordered;
+        ordered.reserve(header.bookCount);
+        for (uint64_t i = 0; i < header.bookCount; i++) {
+            const SnapshotBook& record = books[i];
+            uint64_t offset = record.strings;
+            if (record.bookId >= header.bookSlots || booksById[record.bookId]
+                || record.copies == 0 || record.copies > Book::MAX_COPIES) {
+                return false;
+            }
+            string title = text(offset, record.titleLength);
+            offset += record.titleLength;
+            string author = text(offset, record.authorLength);
+            offset += record.authorLength;
+            Book* book = bookPool.create(record.isbn, title, author, text(offset, record.genreLength));
+            book->bookId = record.bookId;
+            book->borrowCount = record.borrowCount;
+            book->addCopies(record.copies - 1);
+            booksById[record.bookId] = book;
+            ordered.push_back(book);
+        }
+        
+        // Loans take their copies off the shelf, so availability is known
+        // before the catalog columns are filled
+        const SnapshotUser* users = reinterpret_cast<const SnapshotUser*>(data + header.usersOffset);
+        const SnapshotLoan* loans = reinterpret_cast<const SnapshotLoan*>(data + header.loansOffset);
+        dueDates.advance(clock.now());
+        for (uint64_t i = 0; i < header.userSlots; i++) {
+            const SnapshotUser& record = users[i];
+            User* user = userManager.restoreUser(record.userId,
+                                                 text(record.strings, record.nameLength),
+                                                 text(record.strings + record.nameLength, record.emailLength),
+                                                 record.active != 0);
+            if (!user || record.firstLoan + record.loanCount > header.loanCount) return false;
+            user->fines = record.fines;
+            ledger.setFines(user->userId, record.fines);
+            for (uint32_t j = 0; j < record.loanCount; j++) {
+                const SnapshotLoan& loan = loans[record.firstLoan + j];
+                if (loan.bookId >= booksById.size() || !booksById[loan.bookId]) return false;
+                if (!booksById[loan.bookId]->claimCopy(loan.copy)) return false;
+                user->borrowedBooks.push(loan.bookId, loan.copy, trackLoan(user, loan.bookId, loan.copy, loan.dueAt));
+            }
+        }
+        
+        // Books are stored in title order, so the title tree is bulk-built;
+        // the independent indexes are filled in parallel
+        thread treeBuilder([&]() { bookSearchTree.bulkLoad(ordered); });
+        thread attributeBuilder([&]() {
+            for (Book* book : ordered) {
+                authorIndex.insert(book->author, book);
+                genreIndex.insert(book->genre, book);
+            }
+        });
+        thread columnBuilder([&]() {
+            for (Book* book : ordered) catalogColumns.addBook(*book);
+        });
+        thread fuzzyBuilder([&]() {
+            for (Book* book : booksById) {
+                if (book) titleFuzzyIndex.add(book->bookId, book->title);
+            }
+        });
+        bookInventory.reserve(ordered.size());
+        for (Book* book : ordered) {
+            bookInventory.insert(book);
+        }
+        treeBuilder.join();
+        attributeBuilder.join();
+        columnBuilder.join();
+        fuzzyBuilder.join();
+        indexNewAuthors();
+        
+        // All-time counts come from the books, windowed ones from the
+        // stored per-day counts
+        vector<pair<uint32_t, uint32_t>> totals;
+        for (Book* book : ordered) {
+            if (book->borrowCount > 0) totals.push_back({book->bookId, (uint32_t)book->borrowCount});
+        }
+        vector<tuple<int64_t, uint32_t, uint32_t>> dailyIssues;
+        const SnapshotFrequency* frequencies =
+            reinterpret_cast<const SnapshotFrequency*>(data + header.frequencyOffset);
+        for (uint64_t i = 0; i < header.frequencyCount; i++) {
+            const SnapshotFrequency& record = frequencies[i];
+            if (record.bookId < booksById.size() && booksById[record.bookId]) {
+                dailyIssues.emplace_back(record.day, record.bookId, record.count);
+            }
+        }
+        borrowStatistics.restore(totals, dailyIssues, clock.now());
+        
+        const SnapshotHold* holds = reinterpret_cast<const SnapshotHold*>(data + header.holdsOffset);
+        for (uint64_t i = 0; i < header.holdCount; i++) {
+            const SnapshotHold& record = holds[i];
+            if (record.bookId < booksById.size() && booksById[record.bookId]) {
+                holdQueues.restore(record.bookId, {record.userId, record.expiresAt});
+            }
+        }
+        
+        BinaryReader keywords(data + header.keywordOffset, header.keywordSize);
+        if (!keywordIndex.deserialize(keywords)) return false;
+        
+        const SnapshotEvent* events = reinterpret_cast<const SnapshotEvent*>(data + header.eventsOffset);
+        for (uint64_t i = 0; i < header.eventCount; i++) {
+            const SnapshotEvent& record = events[i];
+            circulationEvents.append((CirculationEventLog::Kind)(record.kind != 0), record.time, record.userId,
+                                     record.bookId);
+        }
+        
+        walSequence = header.walSequence;
+        eventBytes = header.eventBytes;
+        return true;
+    }
+
+public:
+    LibrarySystem()
+        : messages(&cout), issueQueue(QUEUE_CAPACITY), returnQueue(QUEUE_CAPACITY),
+          persistedEventBlocks(0), replayTime(0), replayCopy(0), workersRunning(false), requestsInFlight(0),
+          batchSucceeded(0), holdsPlaced(0), holdsFilled(0), replaying(false), holdsEnabled(true),
+          metricsStopping(false), discardedRows(nullptr),
+          bookReplies(discardedRows, ListingWriter::JSONL, Book::columns()),
+          userReplies(discardedRows, ListingWriter::JSONL, User::columns()) {}
+    
+    ~LibrarySystem() {
+        stopWorkers();
+        publishGauges();
+        stopMetricsDump();
+    }
+    
+    // Returns nullptr if the email is already registered
+    User* registerUser(const string& name, const string& email) {
+        User* user = userManager.addUser(name, email);
+        if (user) {
+            logEvent(WAL_ADD_USER, [&](BinaryWriter& out) {
+                out.putString(name);
+                out.putString(email);
+            });
+        }
+        return user;
+    }
+    
+    const User* findUser(int userId) const {
+        return userManager.findUser(userId);
+    }
+    
+    const User* findUserByEmail(const string& email) const {
+        return userManager.findUserByEmail(email);
+    }
+    
+    template <typename Visitor>
+    void forEachUser(Visitor visit) const {
+        userManager.forEachUser(visit);
+    }
+    
+    // Shifts the library clock, e.g. to preview windowed reports; loans
+    // that fall due meanwhile become overdue
+    void advanceClock(int64_t seconds) {
+        clock.advance(seconds);
+        lock_guard<mutex> dueGuard(dueLock);
+        dueDates.advance(clock.now());
+    }
+    
+    // Index shape, computed by walking the indexes; main thread only
+    Metrics::Gauges gauges() const {
+        Metrics::Gauges gauges;
+        gauges.books = bookInventory.size();
+        gauges.users = userManager.size();
+        gauges.hashLoadFactor = bookInventory.loadFactor();
+        gauges.hashMaxProbeLength = bookInventory.maxProbeLength();
+        gauges.titleTreeHeight = bookSearchTree.height();
+        gauges.holds = holdQueues.size();
+        gauges.loans = dueDates.size();
+        gauges.overdue = dueDates.overdueCount();
+        return gauges;
+    }
+    
+    void printStatistics(ostream& out) const {
+#ifdef LIBRARY_NO_METRICS
+        out << "Operation metrics were compiled out (LIBRARY_NO_METRICS).\n";
+#endif
+        Metrics::instance().printSummary(out, gauges());
+    }
+    
+    // Hands fresh gauges to the dump thread, which must not walk the indexes
+    // itself while the main thread changes them; called between actions
+    void publishGauges() {
+        if (!metricsThread.joinable()) return;
+        Metrics::Gauges current = gauges();
+        lock_guard<mutex> guard(metricsLock);
+        publishedGauges = current;
+    }
+    
+    // Rewrites path in Prometheus text format every intervalSeconds until
+    // stopped. Each dump replaces the file by rename, so a scraper never
+    // reads a partial one.
+    void startMetricsDump(const string& path, int intervalSeconds) {
+        stopMetricsDump();
+        metricsStopping = false;
+        metricsThread = thread([this, path, intervalSeconds]() {
+            unique_lock<mutex> lock(metricsLock);
+            bool stopping;
+            do {
+                stopping = metricsWake.wait_for(lock, chrono::seconds(intervalSeconds),
+                                                [this]() { return metricsStopping; });
+                Metrics::Gauges gauges = publishedGauges;
+                lock.unlock();
+                ofstream file(path + ".tmp", ios::trunc);
+                Metrics::instance().printPrometheus(file, gauges);
+                file.close();
+                if (!file || rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+                    cerr << "Cannot write metrics to " << path << "\n";
+                }
+                lock.lock();
+            } while (!stopping);
+        });
+        publishGauges();
+    }
+    
+    // Writes a final dump and stops the dump thread
+    void stopMetricsDump() {
+        if (!metricsThread.joinable()) return;
+        {
+            lock_guard<mutex> guard(metricsLock);
+            metricsStopping = true;
+        }
+        metricsWake.notify_all();
+        metricsThread.join();
+    }
+    
+    // Redirects per-request circulation messages; nullptr suppresses them
+    void setMessageStream(ostream* stream) {
+        messages = stream;
+    }
+    
+    // With holds off, an issue of a book that is out simply fails, as it
+    // did before hold queues; holds already placed are still filled
+    void setHoldsEnabled(bool enabled) {
+        holdsEnabled = enabled;
+    }
+    
+    size_t holdsWaiting() const {
+        return holdQueues.size();
+    }
+    
+    // Returns nullptr if the ISBN is already registered
+    Book* addBookRecord(IsbnKey isbn, const string& title, const string& author, const string& genre,
+                        uint32_t copies = 1) {
+        if (bookInventory.search(isbn)) return nullptr;
+        Book* book = bookPool.create(isbn, title, author, genre);
+        registerBook(book);
+        if (copies > 1) addCopies(book, copies - 1);
+        return book;
+    }
+    
+    // Adds copies of a title, all in; false if that would pass MAX_COPIES.
+    // Like registering a book, not safe alongside circulation workers.
+    bool addCopies(Book* book, uint32_t count) {
+        if (count == 0 || count > Book::MAX_COPIES - book->totalCopies) return false;
+        book->addCopies(count);
+        syncShelved(book);
+        logEvent(WAL_ADD_COPIES, [&](BinaryWriter& out) {
+            out.put<uint64_t>(book->isbn);
+            out.put<uint32_t>(count);
+        });
+        return true;
+    }
+    
+    // Bulk-loads a CSV or TSV catalog dump (see CatalogParser). The file is
+    // parsed on several threads; rows whose ISBN is already in the library,
+    // or earlier in the file, are skipped. The new books are then indexed
+    // in parallel, one index per thread, with the title tree bulk-built
+    // from sorted order rather than insert by insert.
+    bool importCatalog(const string& path, unsigned threads) {
+        auto start = chrono::steady_clock::now();
+        auto seconds = [&start]() {
+            return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        };
+        MappedFile file;
+        if (!file.open(path)) {
+            cerr << "Cannot read catalog " << path << " (missing or empty)\n";
+            return false;
+        }
+        const char* data = file.data();
+        const char* end = data + file.size();
+        char delimiter = CatalogParser::detectDelimiter(data, file.size());
+        
+        // One chunk per thread, each ending on a line boundary
+        threads = (unsigned)max<size_t>(1, min<size_t>(threads, file.size() / (1 << 16) + 1));
+        vector<CatalogParser::Chunk> chunks(threads);
+        vector<thread> parsers;
+        atomic<size_t> parsedBytes(0);
+        const char* chunkStart = data;
+        for (unsigned i = 0; i < threads; i++) {
+            const char* chunkEnd = i + 1 == threads ? end
+                : CatalogParser::nextLine(max(chunkStart, data + file.size() * (i + 1) / threads), end);
+            parsers.emplace_back(CatalogParser::parse, chunkStart, chunkEnd, delimiter,
+                                 ref(chunks[i]), ref(parsedBytes));
+            chunkStart = chunkEnd;
+        }
+        for (double reported = 0; parsedBytes < file.size(); ) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+            if (seconds() - reported >= 0.5) {
+                reported = seconds();
+                cout << "Parsing " << path << ": " << parsedBytes * 100 / file.size() << "%\n";
+            }
+        }
+        for (thread& parser : parsers) parser.join();
+        
+        size_t rows = 0, malformed = 0, duplicates = 0;
+        for (const auto& chunk : chunks) {
+            rows += chunk.rows.size();
+            malformed += chunk.malformed;
+        }
+        cout << "Parsed " << rows << " rows in " << fixed << setprecision(2) << seconds()
+             << " s; deduplicating\n" << defaultfloat << setprecision(6);
+        
+        // ISBNs are checked in file order, so the first row for a book wins
+        bookInventory.reserve(bookInventory.size() + rows);
+        vector<Book*> fresh;
+        fresh.reserve(rows);
+        bool firstRow = true;
+        for (const auto& chunk : chunks) {
+            for (const CatalogRow& row : chunk.rows) {
+                bool header = firstRow;
+                firstRow = false;
+                if (row.isbn == NO_ISBN) { // "isbn" heading a chunk; only the first line of the file is a header
+                    rows--;
+                    if (!header) malformed++;
+                    continue;
+                }
+                if (bookInventory.search(row.isbn)) {
+                    duplicates++;
+                    continue;
+                }
+                Book* book = bookPool.create(row.isbn, string(row.title), string(row.author), string(row.genre));
+                book->bookId = (uint32_t)booksById.size();
+                booksById.push_back(book);
+                bookInventory.insert(book);
+                fresh.push_back(book);
+                logEvent(WAL_ADD_BOOK, [&](BinaryWriter& out) {
+                    out.putString(formatIsbn(book->isbn));
+                    out.putString(book->title);
+                    out.putString(book->author);
+                    out.putString(book->genre);
+                });
+                if (row.copies > 1) {
+                    book->addCopies(row.copies - 1);
+                    logEvent(WAL_ADD_COPIES, [&](BinaryWriter& out) {
+                        out.put<uint64_t>(book->isbn);
+                        out.put<uint32_t>(row.copies - 1);
+                    });
+                }
+            }
+        }
+        chunks.clear();
+        cout << "Indexing " << fresh.size() << " new books\n";
+        
+        thread treeBuilder([&]() {
+            auto titleOrder = [](const Book* a, const Book* b) {
+                int c = a->title.compare(b->title);
+                return c != 0 ? c < 0 : a->isbn < b->isbn;
+            };
+            // A small import into a large catalog is cheaper to insert
+            if (fresh.size() < bookSearchTree.size() / 8) {
+                for (Book* book : fresh) bookSearchTree.insert(book);
+                return;
+            }
+            vector<Book*> sorted(fresh);
+            sort(sorted.begin(), sorted.end(), titleOrder);
+            if (bookSearchTree.size() > 0) {
+                vector<Book*> existing;
+                existing.reserve(bookSearchTree.size());
+                for (auto it = bookSearchTree.begin(); it != bookSearchTree.end(); ++it) existing.push_back(*it);
+                vector<Book*> merged;
+                merged.reserve(existing.size() + sorted.size());
+                merge(existing.begin(), existing.end(), sorted.begin(), sorted.end(),
+                      back_inserter(merged), titleOrder);
+                sorted.swap(merged);
+                bookSearchTree.clear();
+            }
+            bookSearchTree.bulkLoad(sorted);
+        });
+        thread attributeBuilder([&]() {
+            for (Book* book : fresh) {
+                authorIndex.insert(book->author, book);
+                genreIndex.insert(book->genre, book);
+                catalogColumns.addBook(*book);
+            }
+        });
+        thread fuzzyBuilder([&]() {
+            for (Book* book : fresh) titleFuzzyIndex.add(book->bookId, book->title);
+        });
+        for (Book* book : fresh) {
+            keywordIndex.addDocument(book->bookId, *book);
+        }
+        treeBuilder.join();
+        attributeBuilder.join();
+        fuzzyBuilder.join();
+        indexNewAuthors();
+        // Fold the import into a snapshot instead of leaving it to WAL replay
+        commitChanges(!fresh.empty());
+        
+        double elapsed = seconds();
+        cout << "Imported " << fresh.size() << " books from " << path << " in " << fixed << setprecision(2)
+             << elapsed << " s (" << setprecision(0) << rows / max(elapsed, 1e-9) << " rows/s); "
+             << duplicates << " duplicate ISBNs and " << malformed << " malformed rows skipped\n"
+             << defaultfloat << setprecision(6);
+        return true;
+    }
+    
+    // Opens (creating if needed) a data directory: maps the snapshot,
+    // replays the WAL on top of it and logs every later change there
+    bool openStorage(const string& directory) {
+        auto start = chrono::steady_clock::now();
+        storage.reset(new StorageEngine(directory));
+        if (!storage->prepareDirectory()) {
+            cerr << "Cannot create data directory " << directory << "\n";
+            storage.reset();
+            return false;
+        }
+        
+        ostream* previousMessages = messages;
+        messages = nullptr;
+        replaying = true;
+        
+        uint64_t firstSegment = 1, eventBytes = 0;
+        MappedFile snapshot;
+        bool loaded = !storage->mapSnapshot(snapshot)
+                   || loadSnapshot(snapshot.data(), snapshot.size(), firstSegment, eventBytes);
+        size_t replayed = 0;
+        uint64_t lastSegment = firstSegment;
+        if (loaded) {
+            // Event blocks sealed after the snapshot are cut off; the WAL
+            // records replayed below seal them again
+            auto restoreBlock = [this](BinaryReader& in) { return circulationEvents.restoreBlock(in); };
+            if (!storage->loadEvents(eventBytes, restoreBlock)) {
+                cerr << "Warning: circulation history in " << directory << " is incomplete\n";
+            }
+            persistedEventBlocks = circulationEvents.sealedBlocks();
+            for (uint64_t segment : storage->listSegments()) {
+                if (segment < firstSegment) continue;
+                replayed += storage->replaySegment(segment, [this](WalRecordType type, BinaryReader& in) {
+                    applyWalRecord(type, in);
+                });
+                lastSegment = segment;
+            }
+        }
+        
+        replaying = false;
+        messages = previousMessages;
+        if (!loaded) {
+            cerr << "Snapshot in " << directory << " is damaged or from another version\n";
+            storage.reset();
+            return false;
+        }
+        if (!storage->startSegment(lastSegment)) {
+            cerr << "Cannot open write-ahead log in " << directory << "\n";
+            storage.reset();
+            return false;
+        }
+        
+        // One write, as branches open in parallel (see ShardedLibrary)
+        double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        ostringstream loadedLine;
+        loadedLine << "Loaded " << bookInventory.size() << " books and " << userManager.size()
+                   << " users from " << directory << " in " << fixed << setprecision(1) << millis
+                   << " ms (" << replayed << " log records replayed)\n";
+        cerr << loadedLine.str();
+        return true;
+    }
+    
+    // Makes logged changes durable (one group commit) and starts a
+    // background compaction once the current WAL segment is large. False
+    // if the log write failed; the changes stay pending for the next call.
+    bool commitChanges(bool forceCompaction = false) {
+        if (!storage) return true;
+        bool eventsSaved = persistEvents(); // a snapshot must not count on unsaved blocks
+        bool committed = storage->commit();
+        if (eventsSaved && committed && (forceCompaction || storage->segmentBytes() >= COMPACTION_THRESHOLD)
+            && !storage->isCompacting()) {
+            storage->compact(buildSnapshot(storage->currentSegment() + 1));
+        }
+        return committed;
+    }
+    
+    // Logged changes not yet committed
+    size_t unsavedChanges() const {
+        return storage ? storage->pendingCount() : 0;
+    }
+    
+    // Appends event blocks sealed since the last call to the event file
+    bool persistEvents() {
+        lock_guard<mutex> eventGuard(eventLock);
+        if (persistedEventBlocks == circulationEvents.sealedBlocks()) return true;
+        vector<char> frames;
+        BinaryWriter out(frames);
+        for (size_t block = persistedEventBlocks; block < circulationEvents.sealedBlocks(); block++) {
+            size_t start = frames.size();
+            out.put<uint64_t>(0); // length and checksum, filled in below
+            circulationEvents.serializeBlock(block, out);
+            uint32_t length = (uint32_t)(frames.size() - start - 8);
+            uint32_t checksum = crc32(frames.data() + start + 8, length);
+            memcpy(frames.data() + start, &length, 4);
+            memcpy(frames.data() + start + 4, &checksum, 4);
+        }
+        if (!storage->appendEvents(frames)) return false;
+        persistedEventBlocks = circulationEvents.sealedBlocks();
+        return true;
+    }
+    
+    void addBook() {
+        string isbn, title, author, genre;
+        uint32_t copies = 0;
+        cout << "\n--- Add New Book ---\n";
+        cout << "Enter ISBN: ";
+        cin.ignore();
+        getline(cin, isbn);
+        
+        IsbnKey key = parseIsbn(isbn);
+        if (key == NO_ISBN) {
+            cout << "'" << isbn << "' is not a valid ISBN-10 or ISBN-13!\n";
+            return;
+        }
+        
+        // An existing book can take more copies
+        Book* existing = bookInventory.search(key);
+        if (existing) {
+            cout << "Book '" << existing->title << "' already has " << existing->totalCopies << " cop"
+                 << (existing->totalCopies == 1 ? "y" : "ies") << ".\n";
+            cout << "Enter Copies to Add (0 for none): ";
+            cin >> copies;
+            if (copies == 0) return;
+            if (!addCopies(existing, copies)) {
+                cout << "A title can have at most " << Book::MAX_COPIES << " copies!\n";
+                return;
+            }
+            cout << "Book '" << existing->title << "' now has " << existing->totalCopies << " copies.\n";
+            return;
+        }
+        
+        cout << "Enter Title: ";
+        getline(cin, title);
+        cout << "Enter Author: ";
+        getline(cin, author);
+        cout << "Enter Genre: ";
+        getline(cin, genre);
+        cout << "Enter Number of Copies: ";
+        cin >> copies;
+        if (copies == 0 || copies > Book::MAX_COPIES) {
+            cout << "Number of copies must be between 1 and " << Book::MAX_COPIES << "!\n";
+            return;
+        }
+        
+        addBookRecord(key, title, author, genre, copies);
+        
+        cout << "Book added successfully!\n";
+    }
+    
+    void removeBook() {
+        string isbn;
+        cout << "\n--- Remove Book ---\n";
+        cout << "Enter ISBN: ";
+        cin.ignore();
+        getline(cin, isbn);
+        
+        Book* book = bookInventory.search(parseIsbn(isbn));
+        if (!book) {
+            cout << "Book with ISBN " << isbn << " not found!\n";
+            return;
+        }
+        
+        // A borrower still holds a copy of this book
+        if (!book->allCopiesIn()) {
+            cout << "Book '" << book->title << "' has copies issued and cannot be removed!\n";
+            return;
+        }
+        
+        string title = book->title;
+        unregisterBook(book);
+        cout << "Book '" << title << "' removed successfully!\n";
+    }
+    
+    void addUser() {
         string name, email;
         cout << "\n--- Register New User ---\n";
         cout << "Enter Name: ";
         cin.ignore();
-        getline(cin, name);
-        cout << "Enter Email: ";
-        getline(cin, email);
+        getline(cin, name);
+        cout << "Enter Email: ";
+        getline(cin, email);
+        
+        User* existing = userManager.findUserByEmail(email);
+        if (existing) {
+            cout << "Email " << email << " is already registered (User ID: " << existing->userId << ")!\n";
+            return;
+        }
+        
+        User* newUser = registerUser(name, email);
+        cout << "User registered successfully! User ID: " << newUser->userId << "\n";
+    }
+    
+    void removeUser() {
+        int userId;
+        cout << "\n--- Deregister User ---\n";
+        cout << "Enter User ID: ";
+        cin >> userId;
+        
+        User* user = userManager.findUser(userId);
+        if (!user) {
+            cout << "User with ID " << userId << " not found!\n";
+            return;
+        }
+        
+        if (!user->borrowedBooks.empty()) {
+            cout << "User " << user->name << " still has " << user->borrowedBooks.size()
+                 << " borrowed book(s) and cannot be deregistered!\n";
+            return;
+        }
+        
+        string name = user->name;
+        userManager.removeUser(userId);
+        logEvent(WAL_REMOVE_USER, [&](BinaryWriter& out) { out.put<int32_t>(userId); });
+        cout << "User " << name << " deregistered successfully!\n";
+    }
+    
+    void searchBooks() {
+        int choice;
+        cout << "\n--- Search Books ---\n";
+        cout << "1. Search by ISBN\n";
+        cout << "2. Search by Title\n";
+        cout << "3. Search by Author\n";
+        cout << "4. Display all books\n";
+        cout << "5. Search by Title Prefix\n";
+        cout << "6. Search by Genre\n";
+        cout << "7. Keyword Search\n";
+        cout << "8. Fuzzy Search (tolerates typos)\n";
+        cout << "Enter choice: ";
+        cin >> choice;
+        
+        switch(choice) {
+            case 1: {
+                string isbn;
+                cout << "Enter ISBN: ";
+                cin.ignore();
+                getline(cin, isbn);
+                Book* book = timed(METRIC_SEARCH, [&]() { return bookInventory.search(parseIsbn(isbn)); });
+                if (book) {
+                    cout << "\nBook Found:\n";
+                    book->display();
+                } else {
+                    cout << "Book not found!\n";
+                }
+                break;
+            }
+            case 2: {
+                string title;
+                cout << "Enter Title: ";
+                cin.ignore();
+                getline(cin, title);
+                Book* book = timed(METRIC_SEARCH, [&]() { return bookSearchTree.searchByTitle(title); });
+                if (book) {
+                    cout << "\nBook Found:\n";
+                    book->display();
+                } else {
+                    cout << "Book not found!\n";
+                    suggestTitles(title);
+                }
+                break;
+            }
+            case 3: {
+                string author;
+                cout << "Enter Author: ";
+                cin.ignore();
+                getline(cin, author);
+                const vector<Book*>* books = timed(METRIC_SEARCH, [&]() { return authorIndex.find(author); });
+                ListingWriter out(cout, ListingWriter::RECORDS, Book::columns());
+                out.text("\nBooks by " + author + ":\n" + string(50, '-') + "\n");
+                if (books) {
+                    listRecords(out, *books);
+                } else {
+                    out.text("No books found by this author!\n");
+                }
+                break;
+            }
+            case 4: {
+                if (bookSearchTree.size() == 0) {
+                    cout << "No books in the library!\n";
+                    break;
+                }
+                int layout;
+                cout << "Layout (1 = records, 2 = table): ";
+                cin >> layout;
+                cin.ignore();
+                listAllBooks(layout == 2 ? ListingWriter::TABLE : ListingWriter::RECORDS);
+                break;
+            }
+            case 5: {
+                string prefix;
+                cout << "Enter Title Prefix: ";
+                cin.ignore();
+                getline(cin, prefix);
+                OperationTimer timer(METRIC_SEARCH); // includes printing the matches
+                ListingWriter out(cout, ListingWriter::RECORDS, Book::columns());
+                out.text("\nBooks with titles starting with \"" + prefix + "\":\n" + string(50, '-') + "\n");
+                bookSearchTree.forEachWithPrefix(prefix, [&](Book* book) {
+                    book->render(out);
+                    out.text(RECORD_RULE);
+                    return true;
+                });
+                if (out.rows() == 0) {
+                    out.text("No books found with this title prefix!\n");
+                }
+                break;
+            }
+            case 6: {
+                string genre;
+                cout << "Enter Genre: ";
+                cin.ignore();
+                getline(cin, genre);
+                const vector<Book*>* books = timed(METRIC_SEARCH, [&]() { return genreIndex.find(genre); });
+                ListingWriter out(cout, ListingWriter::RECORDS, Book::columns());
+                out.text("\nBooks in " + genre + ":\n" + string(50, '-') + "\n");
+                if (books) {
+                    listRecords(out, *books);
+                } else {
+                    out.text("No books found in this genre!\n");
+                }
+                break;
+            }
+            case 7: {
+                string query;
+                char mode;
+                cout << "Enter Keywords: ";
+                cin.ignore();
+                getline(cin, query);
+                cout << "Match all keywords? (y/n): ";
+                cin >> mode;
+                vector<KeywordIndex::Match> matches = timed(METRIC_SEARCH, [&]() {
+                    return keywordIndex.search(query, mode == 'y' || mode == 'Y', 10);
+                });
+                if (matches.empty()) {
+                    cout << "No books match these keywords!\n";
+                } else {
+                    ListingWriter out(cout, ListingWriter::RECORDS, Book::columns());
+                    out.text("\nTop " + to_string(matches.size()) + " matches:\n" + string(50, '-') + "\n");
+                    for (const auto& match : matches) {
+                        char score[32];
+                        snprintf(score, sizeof(score), "Score: %.2f\n", match.score);
+                        out.text(score);
+                        booksById[match.doc]->render(out);
+                        out.text(RECORD_RULE);
+                    }
+                }
+                break;
+            }
+            case 8: {
+                string query;
+                cout << "Enter Title or Author: ";
+                cin.ignore();
+                getline(cin, query);
+                int distance = FuzzyIndex::suggestedDistance(query);
+                vector<FuzzyIndex::Match> titles, authors;
+                {
+                    OperationTimer timer(METRIC_SEARCH);
+                    titles = titleFuzzyIndex.search(query, distance, FUZZY_RESULTS, [this](uint32_t bookId) { return titleOf(bookId); });
+                    authors = authorFuzzyIndex.search(query, distance, FUZZY_RESULTS, [this](uint32_t code) {
+                        const string& label = catalogColumns.authorLabel(code);
+                        return authorIndex.find(label) ? &label : nullptr;
+                    });
+                }
+                if (titles.empty() && authors.empty()) {
+                    cout << "No titles or authors within " << distance << " typo(s) of \"" << query << "\"!\n";
+                    break;
+                }
+                if (!titles.empty()) {
+                    ListingWriter out(cout, ListingWriter::RECORDS, Book::columns());
+                    out.text("\nClosest titles:\n" + string(50, '-') + "\n");
+                    for (const auto& match : titles) {
+                        out.text("Typos: " + to_string(match.distance) + "\n");
+                        booksById[match.id]->render(out);
+                        out.text(RECORD_RULE);
+                    }
+                }
+                if (!authors.empty()) {
+                    cout << "\nClosest authors:\n";
+                    for (const auto& match : authors) {
+                        const string& author = catalogColumns.authorLabel(match.id);
+                        cout << "- " << author << " (" << authorIndex.find(author)->size() << " book(s), "
+                             << match.distance << " typo(s))\n";
+                    }
+                }
+                break;
+            }
+            default:
+                cout << "Invalid choice!\n";
+        }
+    }
+    
+    // Title text for the fuzzy title index; nullptr once the book is removed
+    const string* titleOf(uint32_t bookId) const {
+        const Book* book = booksById[bookId];
+        return book ? &book->title : nullptr;
+    }
+    
+    // Lists the closest titles after an exact title lookup fails
+    void suggestTitles(const string& title) {
+        vector<FuzzyIndex::Match> matches = timed(METRIC_SEARCH, [&]() {
+            return titleFuzzyIndex.search(title, FuzzyIndex::suggestedDistance(title), TITLE_SUGGESTIONS, [this](uint32_t bookId) { return titleOf(bookId); });
+        });
+        if (matches.empty()) return;
+        cout << "Did you mean:\n";
+        for (const auto& match : matches) {
+            const Book* book = booksById[match.id];
+            cout << "  " << book->title << " by " << book->author << " (ISBN " << formatIsbn(book->isbn) << ")\n";
+        }
+    }
+    
+    void issueBook() {
+        int userId;
+        string isbn;
+        cout << "\n--- Issue Book ---\n";
+        cout << "Enter User ID: ";
+        cin >> userId;
+        cout << "Enter Book ISBN: ";
+        cin.ignore();
+        getline(cin, isbn);
+        
+        IsbnKey key = parseIsbn(isbn);
+        if (key == NO_ISBN) {
+            cout << "'" << isbn << "' is not a valid ISBN-10 or ISBN-13!\n";
+            return;
+        }
+        
+        // Add to issue queue
+        issueQueue.push({userId, key});
+        cout << "Issue request added to queue.\n";
+        
+        // Process the queue
+        processIssueQueue();
+    }
+    
+    void returnBook() {
+        int userId;
+        string isbn;
+        cout << "\n--- Return Book ---\n";
+        cout << "Enter User ID: ";
+        cin >> userId;
+        cout << "Enter Book ISBN: ";
+        cin.ignore();
+        getline(cin, isbn);
+        
+        IsbnKey key = parseIsbn(isbn);
+        if (key == NO_ISBN) {
+            cout << "'" << isbn << "' is not a valid ISBN-10 or ISBN-13!\n";
+            return;
+        }
+        
+        // Add to return queue
+        returnQueue.push({userId, key});
+        cout << "Return request added to queue.\n";
+        
+        // Process the queue
+        processReturnQueue();
+    }
+    
+    void cancelHold() {
+        int userId;
+        string isbn;
+        cout << "\n--- Cancel Hold ---\n";
+        cout << "Enter User ID: ";
+        cin >> userId;
+        cout << "Enter Book ISBN: ";
+        cin.ignore();
+        getline(cin, isbn);
+        
+        IsbnKey key = parseIsbn(isbn);
+        if (key == NO_ISBN) {
+            cout << "'" << isbn << "' is not a valid ISBN-10 or ISBN-13!\n";
+            return;
+        }
+        applyCancelHold(userId, key, &cout);
+    }
+    
+    // Mirrors a book's every-copy-in state into the catalog column. Issues
+    // and returns of different copies can race, so the bit is rewritten
+    // until it matches the counter it was read from.
+    void syncShelved(Book* book) {
+        bool allIn;
+        do {
+            allIn = book->allCopiesIn();
+            catalogColumns.setAvailable(book->bookId, allIn);
+        } while (book->allCopiesIn() != allIn);
+    }
+    
+    // Whole or part days between a due time and a later time; 0 if not late
+    static int64_t daysLate(int64_t dueAt, int64_t time) {
+        if (time <= dueAt) return 0;
+        return (time - dueAt + LibraryClock::SECONDS_PER_DAY - 1) / LibraryClock::SECONDS_PER_DAY;
+    }
+    
+    static uint32_t lateFine(int64_t dueAt, int64_t returnedAt) {
+        return (uint32_t)min<int64_t>(daysLate(dueAt, returnedAt) * FINE_PER_DAY, UINT32_MAX);
+    }
+    
+    // Puts a loan on the due date wheel and in the ledger, under dueLock
+    // once workers may be running; returns its due date handle
+    uint32_t trackLoan(const User* user, uint32_t bookId, uint32_t copy, int64_t dueAt) {
+        uint32_t handle = dueDates.add({user->userId, bookId, dueAt});
+        ledger.addLoan(handle, user->userId, bookId, copy, dueAt);
+        return handle;
+    }
+    
+    // Records a loan of a copy already claimed for the user; false if the
+    // user already holds another copy of the title. The issue is logged
+    // before the loan becomes visible, so a return of it that runs on
+    // another worker is always logged after it.
+    bool recordLoan(User* user, Book* book, uint32_t copy, ostream* out) {
+        lock_guard<mutex> guard(userLock(user->userId));
+        if (user->borrowedBooks.contains(book->bookId)) {
+            if (out) *out << user->name << " already has '" << book->title << "'!\n";
+            return false;
+        }
+        book->borrowCount++;
+        catalogColumns.recordBorrow(book->bookId);
+        int64_t issuedAt = replaying ? replayTime : clock.now();
+        {
+            lock_guard<mutex> frequencyGuard(frequencyLock);
+            borrowStatistics.record(book->bookId, issuedAt);
+        }
+        logEvent(WAL_ISSUE, [&](BinaryWriter& log) {
+            log.put<int32_t>(user->userId);
+            log.put<uint64_t>(book->isbn);
+            log.put<int64_t>(issuedAt);
+            log.put<uint32_t>(copy);
+        });
+        {
+            lock_guard<mutex> eventGuard(eventLock);
+            circulationEvents.append(CirculationEventLog::ISSUE, issuedAt, user->userId, book->bookId);
+        }
+        uint32_t dueHandle;
+        {
+            lock_guard<mutex> dueGuard(dueLock);
+            dueDates.advance(clock.now());
+            dueHandle = trackLoan(user, book->bookId, copy, issuedAt + LOAN_DAYS * LibraryClock::SECONDS_PER_DAY);
+        }
+        user->borrowedBooks.push(book->bookId, copy, dueHandle);
+        return true;
+    }
+    
+    // Queues the user for a title with every copy out. A copy is claimed
+    // instead if a return shelved one meanwhile; returns its number in
+    // that case, otherwise -1.
+    int32_t placeHold(User* user, Book* book, ostream* out) {
+        {
+            lock_guard<mutex> guard(userLock(user->userId));
+            if (user->borrowedBooks.contains(book->bookId)) {
+                if (out) *out << user->name << " already has '" << book->title << "'!\n";
+                return -1;
+            }
+        }
+        int64_t now = clock.now();
+        size_t position = 0;
+        int32_t copy = -1;
+        HoldQueues::Status status = holdQueues.place(
+            book->bookId, user->userId, now, now + HOLD_DAYS * LibraryClock::SECONDS_PER_DAY,
+            [&]() { return (copy = book->claimCopy()) >= 0; },
+            [&](int32_t userId) { return userManager.findUser(userId) != nullptr; },
+            [&](const HoldQueues::Hold& hold) {
+                logEvent(WAL_PLACE_HOLD, [&](BinaryWriter& log) {
+                    log.put<int32_t>(hold.userId);
+                    log.put<uint64_t>(book->isbn);
+                    log.put<int64_t>(hold.expiresAt);
+                });
+            },
+            position);
+        switch (status) {
+            case HoldQueues::CLAIMED:
+                return copy;
+            case HoldQueues::PLACED:
+                holdsPlaced.fetch_add(1, memory_order_relaxed);
+                if (out) *out << "Book '" << book->title << "' is not available; " << user->name
+                              << " is number " << position << " in its hold queue.\n";
+                break;
+            case HoldQueues::ALREADY_PLACED:
+                if (out) *out << "Book '" << book->title << "' is not available; " << user->name
+                              << " is already number " << position << " in its hold queue.\n";
+                break;
+            case HoldQueues::QUEUE_FULL:
+                if (out) *out << "Book '" << book->title << "' is not available and its hold queue is full!\n";
+                break;
+        }
+        return -1;
+    }
+    
+    // Issues one copy of a book. Safe to run on several workers at once: a
+    // copy is reserved by a CAS on the title's available count, so no copy
+    // can be issued twice, and the user's loans are guarded by a striped
+    // lock. A title with every copy out gets the user a place in its hold
+    // queue instead.
+    bool applyIssue(int userId, IsbnKey isbn, ostream* out) {
+        OperationTimer timer(METRIC_ISSUE);
+        User* user = userManager.findUser(userId);
+        Book* book = bookInventory.search(isbn);
+        
+        if (!user) {
+            if (out) *out << "User with ID " << userId << " not found!\n";
+            return false;
+        }
+        
+        if (!book) {
+            if (out) *out << "Book with ISBN " << formatIsbn(isbn) << " not found!\n";
+            return false;
+        }
+        
+        // Replay reissues the logged copy
+        int32_t copy;
+        if (replaying) {
+            copy = book->claimCopy(replayCopy) ? (int32_t)replayCopy : -1;
+        } else {
+            copy = book->claimCopy();
+        }
+        if (copy < 0) {
+            if (replaying || !holdsEnabled) {
+                if (out) *out << "Book '" << book->title << "' is not available!\n";
+                return false;
+            }
+            copy = placeHold(user, book, out);
+            if (copy < 0) return false;
+        }
+        
+        // Issue the copy; a replayed hand-over also clears the hold it filled
+        syncShelved(book);
+        if (!recordLoan(user, book, copy, out)) {
+            book->returnCopy(copy);
+            syncShelved(book);
+            return false;
+        }
+        holdQueues.cancel(book->bookId, userId);
+        
+        if (out) *out << "Book '" << book->title << "' issued to " << user->name << " successfully!\n";
+        return true;
+    }
+    
+    // Returns one copy; safe to run concurrently like applyIssue
+    bool applyReturn(int userId, IsbnKey isbn, ostream* out) {
+        OperationTimer timer(METRIC_RETURN);
+        User* user = userManager.findUser(userId);
+        Book* book = bookInventory.search(isbn);
+        
+        if (!user) {
+            if (out) *out << "User with ID " << userId << " not found!\n";
+            return false;
+        }
+        
+        if (!book) {
+            if (out) *out << "Book with ISBN " << formatIsbn(isbn) << " not found!\n";
+            return false;
+        }
+        
+        // Check if user has this book; a late return is fined
+        bool bookFound;
+        uint32_t copy = 0, dueHandle = 0, fine = 0;
+        int64_t returnedAt = replaying ? replayTime : clock.now();
+        int64_t dueAt = 0;
+        {
+            lock_guard<mutex> guard(userLock(userId));
+            bookFound = user->borrowedBooks.remove(book->bookId, copy, dueHandle);
+            if (bookFound) {
+                lock_guard<mutex> dueGuard(dueLock);
+                dueAt = dueDates.remove(dueHandle).dueAt;
+                fine = lateFine(dueAt, returnedAt);
+                user->fines = (uint32_t)min<uint64_t>((uint64_t)user->fines + fine, UINT32_MAX);
+                ledger.removeLoan(dueHandle, user->fines);
+            }
+        }
+        
+        if (!bookFound) {
+            if (out) *out << "User " << user->name << " has not borrowed this book!\n";
+            return false;
+        }
+        
+        // The return is logged before the copy can be issued again, so
+        // replay finds that copy on the shelf when it reaches the issue
+        logEvent(WAL_RETURN, [&](BinaryWriter& log) {
+            log.put<int32_t>(userId);
+            log.put<uint64_t>(isbn);
+            log.put<int64_t>(returnedAt);
+        });
+        {
+            lock_guard<mutex> eventGuard(eventLock);
+            circulationEvents.append(CirculationEventLog::RETURN, returnedAt, userId, book->bookId);
+        }
+        
+        // Shelve the copy, or hand it straight to the first live hold. It
+        // is shelved under the hold queue's lock, so a hold placed
+        // meanwhile either claims it or is seen here. Replay leaves
+        // hand-overs to the logged issue.
+        auto release = [&]() {
+            book->returnCopy(copy);
+            syncShelved(book);
+        };
+        int32_t holderId = 0;
+        if (replaying) {
+            release();
+        } else {
+            holderId = holdQueues.takeNext(book->bookId, clock.now(),
+                                           [&](int32_t id) { return userManager.findUser(id) != nullptr; },
+                                           release);
+        }
+        if (out) *out << "Book '" << book->title << "' returned by " << user->name << " successfully!\n";
+        if (fine > 0 && out) {
+            *out << "It was " << daysLate(dueAt, returnedAt) << " day(s) overdue; a fine of "
+                 << formatCents(fine) << " was added.\n";
+        }
+        
+        // A holder who got another copy meanwhile is passed over
+        while (holderId) {
+            User* holder = userManager.findUser(holderId);
+            if (recordLoan(holder, book, copy, nullptr)) {
+                holdsFilled.fetch_add(1, memory_order_relaxed);
+                if (out) *out << "Book '" << book->title << "' issued to " << holder->name << " from the hold queue.\n";
+                break;
+            }
+            holderId = holdQueues.takeNext(book->bookId, clock.now(),
+                                           [&](int32_t id) { return userManager.findUser(id) != nullptr; },
+                                           release);
+        }
+        return true;
+    }
+    
+    // Withdraws a user's hold on a book
+    bool applyCancelHold(int userId, IsbnKey isbn, ostream* out) {
+        User* user = userManager.findUser(userId);
+        Book* book = bookInventory.search(isbn);
+        if (!user) {
+            if (out) *out << "User with ID " << userId << " not found!\n";
+            return false;
+        }
+        if (!book) {
+            if (out) *out << "Book with ISBN " << formatIsbn(isbn) << " not found!\n";
+            return false;
+        }
+        if (!holdQueues.cancel(book->bookId, userId)) {
+            if (out) *out << "User " << user->name << " has no hold on '" << book->title << "'!\n";
+            return false;
+        }
+        logEvent(WAL_CANCEL_HOLD, [&](BinaryWriter& log) {
+            log.put<int32_t>(userId);
+            log.put<uint64_t>(isbn);
+        });
+        if (out) *out << "Hold on '" << book->title << "' for " << user->name << " cancelled.\n";
+        return true;
+    }
+    
+    // Applies queued issue requests; returns how many succeeded
+    size_t processIssueQueue() {
+        size_t issued = 0;
+        pair<int, IsbnKey> request;
+        while (issueQueue.pop(request)) {
+            issued += applyIssue(request.first, request.second, messages);
+        }
+        return issued;
+    }
+    
+    // Applies queued return requests; returns how many succeeded
+    size_t processReturnQueue() {
+        size_t returned = 0;
+        pair<int, IsbnKey> request;
+        while (returnQueue.pop(request)) {
+            returned += applyReturn(request.first, request.second, messages);
+        }
+        return returned;
+    }
+    
+    // Starts count background workers that drain the issue and return
+    // queues in parallel. Catalog and user changes must not run meanwhile.
+    void startWorkers(unsigned count, bool quiet) {
+        stopWorkers();
+        workersRunning = true;
+        for (unsigned i = 0; i < count; i++) {
+            workerOutput.emplace_back(quiet ? nullptr : new ostringstream);
+            ostream* out = workerOutput.back().get();
+            workers.emplace_back([this, out]() {
+                pair<int, IsbnKey> request;
+                while (workersRunning.load(memory_order_acquire)) {
+                    bool succeeded;
+                    if (issueQueue.pop(request)) {
+                        succeeded = applyIssue(request.first, request.second, out);
+                    } else if (returnQueue.pop(request)) {
+                        succeeded = applyReturn(request.first, request.second, out);
+                    } else {
+                        unique_lock<mutex> lock(wakeLock);
+                        wakeWorkers.wait_for(lock, chrono::milliseconds(1));
+                        continue;
+                    }
+                    if (succeeded) batchSucceeded.fetch_add(1, memory_order_relaxed);
+                    requestsInFlight.fetch_sub(1, memory_order_release);
+                }
+            });
+        }
+    }
+    
+    void stopWorkers() {
+        workersRunning = false;
+        wakeWorkers.notify_all();
+        for (thread& worker : workers) worker.join();
+        workers.clear();
+        workerOutput.clear();
+    }
+    
+    // Applies a batch of requests of one kind ('I' or 'R') through the
+    // request queues and returns how many succeeded. With workers running,
+    // the calling thread helps drain the queue and waits for stragglers.
+    size_t submitBatch(char kind, vector<pair<int, IsbnKey>>& batch) {
+        MPMCQueue<pair<int, IsbnKey>>& target = kind == 'I' ? issueQueue : returnQueue;
+        auto drain = [&]() { return kind == 'I' ? processIssueQueue() : processReturnQueue(); };
+        
+        if (workers.empty()) {
+            size_t succeeded = 0;
+            for (auto& request : batch) {
+                while (!target.push(move(request))) succeeded += drain();
+            }
+            return succeeded + drain();
+        }
+        
+        batchSucceeded = 0;
+        requestsInFlight.fetch_add(batch.size());
+        for (auto& request : batch) {
+            while (!target.push(move(request))) this_thread::yield();
+            wakeWorkers.notify_one();
+        }
+        pair<int, IsbnKey> request;
+        while (target.pop(request)) {
+            bool succeeded = kind == 'I' ? applyIssue(request.first, request.second, messages)
+                                         : applyReturn(request.first, request.second, messages);
+            if (succeeded) batchSucceeded.fetch_add(1, memory_order_relaxed);
+            requestsInFlight.fetch_sub(1, memory_order_release);
+        }
+        while (requestsInFlight.load(memory_order_acquire) != 0) this_thread::yield();
+        
+        if (messages) {
+            for (auto& output : workerOutput) {
+                *messages << output->str();
+                output->str("");
+            }
+        }
+        return batchSucceeded;
+    }
+    
+    // Parses one "I|R|C,<userId>,<isbn>" transaction line
+    static bool parseTransaction(const string& line, char& kind, int& userId, IsbnKey& isbn) {
+        kind = (char)toupper((unsigned char)line[0]);
+        size_t first = line.find(',');
+        size_t second = first == string::npos ? string::npos : line.find(',', first + 1);
+        if ((kind != 'I' && kind != 'R' && kind != 'C') || first != 1 || second == string::npos) return false;
+        char* end = nullptr;
+        long id = strtol(line.c_str() + first + 1, &end, 10);
+        isbn = parseIsbn(string_view(line).substr(second + 1));
+        userId = (int)id;
+        return end == line.c_str() + second && isbn != NO_ISBN;
+    }
+    
+    // Replays a circulation transaction file without any prompts. Each line
+    // is "I,<userId>,<isbn>" (issue, or a hold if the book is out),
+    // "R,<userId>,<isbn>" (return) or "C,<userId>,<isbn>" (cancel a hold);
+    // blank lines and '#' comments are skipped. Consecutive requests of the same
+    // kind are queued in batches sorted by ISBN, which keeps repeated lookups
+    // of a book together while preserving the order of requests per book.
+    // Messages are buffered per batch, or dropped entirely when quiet.
+    bool runBatch(const string& path, bool quiet, unsigned threads = 1) {
+        const size_t BATCH_SIZE = 65536;
+        
+        vector<char> readBuffer(1 << 20);
+        ifstream file;
+        file.rdbuf()->pubsetbuf(readBuffer.data(), readBuffer.size());
+        file.open(path);
+        if (!file) {
+            cerr << "Cannot open transaction file " << path << "\n";
+            return false;
+        }
+        
+        ostringstream batchOutput;
+        messages = quiet ? nullptr : &batchOutput;
+        if (threads > 1) startWorkers(threads - 1, quiet);
+        
+        vector<pair<int, IsbnKey>> batch;
+        batch.reserve(BATCH_SIZE);
+        char batchKind = 0;
+        size_t issues = 0, issued = 0, returns = 0, returned = 0, cancels = 0, cancelled = 0, malformed = 0;
+        size_t placedBefore = holdsPlaced, filledBefore = holdsFilled;
+        size_t failedCommits = 0;
+        vector<double> batchMicros;
+        auto start = chrono::steady_clock::now();
+        
+        auto flushBatch = [&]() {
+            if (batch.empty()) return;
+            stable_sort(batch.begin(), batch.end(),
+                        [](const pair<int, IsbnKey>& a, const pair<int, IsbnKey>& b) {
+                            return a.second < b.second;
+                        });
+            auto batchStart = chrono::steady_clock::now();
+            if (batchKind == 'I') {
+                issues += batch.size();
+                issued += submitBatch('I', batch);
+            } else if (batchKind == 'C') {
+                cancels += batch.size();
+                for (const auto& request : batch) {
+                    cancelled += applyCancelHold(request.first, request.second, messages);
+                }
+            } else {
+                returns += batch.size();
+                returned += submitBatch('R', batch);
+            }
+            batchMicros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - batchStart).count());
+            batch.clear();
+            failedCommits += !commitChanges();
+            publishGauges();
+            
+            if (!quiet) {
+                const string& text = batchOutput.str();
+                cout.write(text.data(), text.size());
+                batchOutput.str("");
+            }
+        };
+        
+        string line;
+        size_t lineNumber = 0;
+        while (getline(file, line)) {
+            lineNumber++;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            
+            char kind;
+            int userId;
+            IsbnKey isbn;
+            if (!parseTransaction(line, kind, userId, isbn)) {
+                malformed++;
+                if (!quiet) cerr << "Line " << lineNumber << ": malformed transaction skipped\n";
+                continue;
+            }
+            
+            if (kind != batchKind || batch.size() == BATCH_SIZE) {
+                flushBatch();
+                batchKind = kind;
+            }
+            batch.push_back({userId, isbn});
+        }
+        flushBatch();
+        stopWorkers();
+        messages = &cout;
+        
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t total = issues + returns + cancels;
+        double p50 = 0, p99 = 0;
+        if (!batchMicros.empty()) {
+            sort(batchMicros.begin(), batchMicros.end());
+            p50 = batchMicros[batchMicros.size() / 2];
+            p99 = batchMicros[min(batchMicros.size() - 1, batchMicros.size() * 99 / 100)];
+        }
+        
+        cout << "\n--- Batch Summary ---\n";
+        cout << "Transactions: " << total << " (" << malformed << " malformed lines skipped)\n";
+        cout << "Threads: " << max(threads, 1u) << "\n";
+        cout << "Issues:  " << issued << " succeeded, " << issues - issued << " failed\n";
+        cout << "Returns: " << returned << " succeeded, " << returns - returned << " failed\n";
+        cout << "Holds:   " << holdsPlaced - placedBefore << " placed, " << holdsFilled - filledBefore
+             << " filled on return, " << cancelled << " of " << cancels << " cancellations applied, "
+             << holdQueues.size() << " waiting\n";
+        cout << fixed << setprecision(2);
+        cout << "Elapsed: " << seconds << " s\n";
+        cout << "Throughput: " << (seconds > 0 ? total / seconds : 0) << " transactions/s\n";
+        cout << "Batches: " << batchMicros.size() << ", latency p50 " << p50 << " us, p99 " << p99 << " us\n";
+        cout << "Mean latency per transaction: " << (total ? seconds * 1e6 / total : 0) << " us\n";
+        cout << defaultfloat << setprecision(6);
+        return reportCommitFailures(failedCommits, unsavedChanges());
+    }
+    
+    // Ends a batch run: false, with a warning, if any batch's group commit
+    // failed and its changes may not be on disk
+    static bool reportCommitFailures(size_t failedCommits, size_t unsaved) {
+        if (failedCommits == 0) return true;
+        cerr << "Warning: " << failedCommits << " batch commit(s) failed; "
+             << (unsaved ? to_string(unsaved) + " logged change(s) are still not on disk\n"
+                         : "they were saved by a later retry\n");
+        return false;
+    }
+    
+    // One request of the server protocol (see LibraryServer), answered
+    // with a single line starting "OK" or "ERR". Circulation requests use
+    // the batch format; the rest look things up:
+    //   I,<userId>,<isbn>   issue (or hold)     S,<isbn>     book by ISBN
+    //   R,<userId>,<isbn>   return              T,<title>    book by title
+    //   C,<userId>,<isbn>   cancel a hold       U,<userId>   user
+    //   P                   library statistics
+    //   M[,<n>]  Most Borrowed (all time)   A[,<n>]  Active Users
+    //   O[,<n>]  Overdue Loans
+    // Books and users come back as JSON objects, and reports as a JSON
+    // array of their first n rows (REPORT_PAGE_SIZE if n is not given).
+    void handleRequest(string_view request, string& reply) {
+        if (!request.empty() && request.back() == '\r') request.remove_suffix(1);
+        char kind = request.empty() ? 0 : (char)toupper((unsigned char)request[0]);
+        string_view argument = request.size() > 1 && request[1] == ',' ? request.substr(2) : string_view();
+        bool bare = request.size() == 1;
+        switch (kind) {
+            case 'I':
+            case 'R':
+            case 'C': {
+                size_t comma = argument.find(',');
+                char* end = nullptr;
+                string userText(argument.substr(0, comma));
+                long userId = strtol(userText.c_str(), &end, 10);
+                IsbnKey isbn = comma == string_view::npos ? NO_ISBN : parseIsbn(argument.substr(comma + 1));
+                if (userText.empty() || *end != '\0' || isbn == NO_ISBN) break;
+                requestMessages.str("");
+                bool ok = kind == 'I' ? applyIssue((int)userId, isbn, &requestMessages)
+                        : kind == 'R' ? applyReturn((int)userId, isbn, &requestMessages)
+                                      : applyCancelHold((int)userId, isbn, &requestMessages);
+                string text = requestMessages.str();
+                while (!text.empty() && text.back() == '\n') text.pop_back();
+                replace(text.begin(), text.end(), '\n', ' ');
+                reply.append(ok ? "OK " : "ERR ");
+                reply.append(text);
+                reply += '\n';
+                return;
+            }
+            case 'S':
+            case 'T': {
+                if (argument.empty()) break;
+                Book* book = timed(METRIC_SEARCH, [&]() {
+                    return kind == 'S' ? bookInventory.search(parseIsbn(argument))
+                                       : bookSearchTree.searchByTitle(string(argument));
+                });
+                if (!book) {
+                    reply.append("ERR Book not found!\n");
+                    return;
+                }
+                reply.append("OK ");
+                book->render(bookReplies);
+                bookReplies.drainTo(reply);
+                return;
+            }
+            case 'U': {
+                char* end = nullptr;
+                string userText(argument);
+                long userId = strtol(userText.c_str(), &end, 10);
+                if (userText.empty() || *end != '\0') break;
+                User* user = userManager.findUser((int)userId);
+                if (!user) {
+                    reply.append("ERR User with ID " + userText + " not found!\n");
+                    return;
+                }
+                size_t loans;
+                uint32_t fines;
+                {
+                    lock_guard<mutex> guard(userLock(user->userId));
+                    loans = user->borrowedBooks.size();
+                    fines = user->fines;
+                }
+                reply.append("OK ");
+                user->render(userReplies, loans, fines);
+                userReplies.drainTo(reply);
+                return;
+            }
+            case 'P': {
+                if (!bare) break;
+                Metrics::Gauges current = gauges();
+                reply.append("OK {\"books\":" + to_string(current.books) + ",\"users\":" + to_string(current.users)
+                             + ",\"loans\":" + to_string(current.loans) + ",\"overdue\":" + to_string(current.overdue)
+                             + ",\"holds\":" + to_string(current.holds) + "}\n");
+                return;
+            }
+            case 'M':
+            case 'A':
+            case 'O': {
+                size_t limit = REPORT_PAGE_SIZE;
+                if (!bare) {
+                    char* end = nullptr;
+                    string limitText(argument);
+                    unsigned long long n = strtoull(limitText.c_str(), &end, 10);
+                    if (limitText.empty() || limitText[0] == '-' || *end != '\0' || n == 0) break;
+                    limit = (size_t)min<unsigned long long>(n, SIZE_MAX);
+                }
+                // The report's JSON lines become the elements of one array;
+                // JSON strings escape newlines, so only row ends are left
+                ostringstream rows;
+                if (kind == 'M') {
+                    writeMostBorrowed(rows, ListingWriter::JSONL, mostBorrowed(BorrowStatistics::ALL_TIME, limit));
+                } else if (kind == 'A') {
+                    writeActiveUsers(rows, ListingWriter::JSONL, activeUsers(), limit);
+                } else {
+                    int64_t now = clock.now();
+                    writeOverdueLoans(rows, ListingWriter::JSONL, overdueLoans(now), now, limit);
+                }
+                string text = rows.str();
+                if (!text.empty()) text.pop_back();
+                replace(text.begin(), text.end(), '\n', ',');
+                reply.append("OK [");
+                reply.append(text);
+                reply.append("]\n");
+                return;
+            }
+        }
+        reply.append("ERR Malformed request\n");
+    }
+    
+    // Loans and fines as they stand now, to read while circulation goes
+    // on; dueLock is held only while the ledger's directories are copied
+    CirculationLedger::View loanView() {
+        lock_guard<mutex> dueGuard(dueLock);
+        return ledger.open();
+    }
+    
+    // Circulation history up to now, to query while circulation goes on
+    CirculationEventLog::View eventView() {
+        lock_guard<mutex> eventGuard(eventLock);
+        return circulationEvents.view();
+    }
+    
+    // Report rows as plain values, for reports merged across branches
+    // (see ShardedLibrary)
+    struct RankedTitle {
+        IsbnKey isbn;
+        string title;
+        uint32_t count;
+    };
+    
+    struct ActiveUserRow {
+        int userId;
+        string name;
+        string email;
+        size_t loans;
+        uint32_t fines;
+        string borrowed; // "Title (due date); " for each loan
+    };
+    
+    // The first limit rows of a Most Borrowed ranking, most borrowed first
+    vector<RankedTitle> mostBorrowed(BorrowStatistics::Window window, size_t limit) {
+        OperationTimer timer(METRIC_REPORT);
+        vector<RankedTitle> rows;
+        lock_guard<mutex> guard(frequencyLock);
+        borrowStatistics.advance(clock.now());
+        if (limit == 0) return rows;
+        // Rankings are kept sorted, so only the rows returned are visited;
+        // removed books keep their slot but are skipped here
+        borrowStatistics.ranking(window).forEachRanked([&](uint32_t bookId, uint32_t count) {
+            const Book* book = booksById[bookId];
+            if (book) rows.push_back({book->isbn, book->title, count});
+            return rows.size() < limit;
+        });
+        return rows;
+    }
+    
+    // Every user with books out, in ID order, from one ledger view
+    vector<ActiveUserRow> activeUsers() {
+        CirculationLedger::View view = loanView();
+        OperationTimer timer(METRIC_REPORT);
+        vector<CirculationLedger::LoanRow> loans = loansByUser(view);
+        vector<ActiveUserRow> rows;
+        for (size_t next = 0, end; next < loans.size(); next = end) {
+            end = next;
+            while (end < loans.size() && loans[end].userId == loans[next].userId) end++;
+            const User* user = userManager.findUser(loans[next].userId);
+            if (user) {
+                rows.push_back({user->userId, user->name, user->email, end - next, view.user(user->userId).fines,
+                                listLoans(&loans[next], &loans[0] + end)});
+            }
+        }
+        return rows;
+    }
+    
+    // Loans due before now, oldest due date first, from one ledger view
+    vector<CirculationLedger::LoanRow> overdueLoans(int64_t now) {
+        CirculationLedger::View view = loanView();
+        OperationTimer timer(METRIC_REPORT);
+        vector<CirculationLedger::LoanRow> overdue;
+        view.forEachLoan([&](const CirculationLedger::LoanRow& loan) {
+            if (loan.dueAt < now) overdue.push_back(loan);
+        });
+        sort(overdue.begin(), overdue.end(), [](const CirculationLedger::LoanRow& a, const CirculationLedger::LoanRow& b) {
+            return a.dueAt != b.dueAt ? a.dueAt < b.dueAt : a.userId < b.userId;
+        });
+        return overdue;
+    }
+    
+    // Headless export for --list: up to limit rows (0 for all) of "books"
+    // in title order or "users" in ID order, starting after the cursor, an
+    // ISBN or user ID. next is set to the cursor to resume from, or left
+    // empty once the listing is complete.
+    bool exportListing(ostream& out, const string& what, ListingWriter::Format format, size_t limit,
+                       const string& after, string& next) {
+        OperationTimer timer(METRIC_REPORT);
+        next.clear();
+        size_t rows = 0;
+        if (what == "books") {
+            auto it = bookSearchTree.begin();
+            if (!after.empty()) {
+                const Book* last = bookInventory.search(parseIsbn(after));
+                if (!last) {
+                    cerr << "Unknown cursor: no book with ISBN " << after << "\n";
+                    return false;
+                }
+                it = bookSearchTree.after(last->title, last->isbn);
+            }
+            ListingWriter writer(out, format, Book::columns());
+            for (const Book* last = nullptr; it != bookSearchTree.end(); ++it) {
+                if (limit > 0 && rows == limit) {
+                    next = formatIsbn(last->isbn);
+                    break;
+                }
+                (*it)->render(writer);
+                last = *it;
+                rows++;
+            }
+            return true;
+        }
+        if (what == "users") {
+            char* end = nullptr;
+            long lastId = strtol(after.c_str(), &end, 10);
+            if (!after.empty() && (*end != '\0' || lastId < 0 || lastId > INT_MAX)) {
+                cerr << "Unknown cursor: " << after << " is not a user ID\n";
+                return false;
+            }
+            CirculationLedger::View view = loanView();
+            ListingWriter writer(out, format, User::columns());
+            userManager.forEachUserAfter((int)lastId, [&](User* user) {
+                if (limit > 0 && rows == limit) {
+                    next = to_string(lastId);
+                    return false;
+                }
+                CirculationLedger::UserRow row = view.user(user->userId);
+                user->render(writer, row.loans, row.fines);
+                lastId = user->userId;
+                rows++;
+                return true;
+            });
+            return true;
+        }
+        if (what == "most-borrowed" || what == "active-users") {
+            if (!after.empty()) {
+                cerr << "The " << what << " listing has no cursor\n";
+                return false;
+            }
+            if (what == "most-borrowed") {
+                writeMostBorrowed(out, format, mostBorrowed(BorrowStatistics::ALL_TIME, limit ? limit : SIZE_MAX));
+            } else {
+                writeActiveUsers(out, format, activeUsers(), limit);
+            }
+            return true;
+        }
+        cerr << "Unknown listing: " << what << " (expected books, users, most-borrowed or active-users)\n";
+        return false;
+    }
+    
+    // All-time Most Borrowed rows, and Active Users rows up to limit (0
+    // for all), as listings
+    static void writeMostBorrowed(ostream& out, ListingWriter::Format format, const vector<RankedTitle>& rows) {
+        static const vector<ListingWriter::Column> columns = {
+            {"ISBN", "isbn", 16, ListingWriter::ALL},
+            {"Count", "borrow_count", 8, ListingWriter::ALL},
+            {"Title", "title", 36, ListingWriter::ALL},
+        };
+        ListingWriter writer(out, format, columns);
+        for (const RankedTitle& row : rows) {
+            writer.beginRow();
+            writer.field(formatIsbn(row.isbn));
+            writer.field((int64_t)row.count);
+            writer.field(row.title);
+            writer.endRow();
+        }
+    }
+    
+    static void writeActiveUsers(ostream& out, ListingWriter::Format format, const vector<ActiveUserRow>& rows,
+                                 size_t limit) {
+        ListingWriter writer(out, format, User::columns());
+        for (size_t i = 0; i < rows.size() && (limit == 0 || i < limit); i++) {
+            const ActiveUserRow& row = rows[i];
+            User(row.userId, row.name, row.email).render(writer, row.loans, row.fines);
+            if (format == ListingWriter::RECORDS) {
+                writer.text("Borrowed Books: " + row.borrowed + "\n");
+                writer.text(RECORD_RULE);
+            }
+        }
+    }
+    
+    // Overdue Loans rows up to limit (0 for all); fines are in cents in
+    // exports
+    void writeOverdueLoans(ostream& out, ListingWriter::Format format, const vector<CirculationLedger::LoanRow>& rows,
+                           int64_t now, size_t limit) {
+        static const vector<ListingWriter::Column> columns = {
+            {"User ID", "user_id", 10, ListingWriter::ALL},
+            {"Name", "name", 20, ListingWriter::ALL},
+            {"Due", "due", 12, ListingWriter::ALL},
+            {"Days", "days_late", 10, ListingWriter::ALL},
+            {"Fine", "fine_cents", 10, ListingWriter::ALL},
+            {"ISBN", "isbn", 16, ListingWriter::DATA},
+            {"Title", "title", 36, ListingWriter::ALL},
+        };
+        ListingWriter writer(out, format, columns);
+        for (size_t i = 0; i < rows.size() && (limit == 0 || i < limit); i++) {
+            const CirculationLedger::LoanRow& loan = rows[i];
+            const User* user = userManager.findUser(loan.userId);
+            const Book* book = booksById[loan.bookId];
+            uint32_t fine = lateFine(loan.dueAt, now);
+            writer.beginRow();
+            writer.field((int64_t)loan.userId);
+            writer.field(user ? user->name : "");
+            writer.field(LibraryClock::formatDate(loan.dueAt));
+            writer.field((int64_t)daysLate(loan.dueAt, now));
+            writer.field(formatCents(fine), fine);
+            writer.field(book ? formatIsbn(book->isbn) : "");
+            writer.field(book ? book->title : "");
+            writer.endRow();
+        }
+    }
+
+    static void printMostBorrowed(ostream& out, const vector<RankedTitle>& rows, bool allTime) {
+        if (rows.empty()) {
+            out << (allTime ? "No books have been borrowed yet.\n" : "No books were borrowed in this period.\n");
+            return;
+        }
+        out << left << setw(20) << "ISBN" << setw(10) << "Count" << "Title\n";
+        out << string(50, '-') << "\n";
+        for (const RankedTitle& row : rows) {
+            out << left << setw(20) << formatIsbn(row.isbn) << setw(10) << row.count << row.title << "\n";
+        }
+    }
+    
+    // Asks whether to show another page, after writing out the page so far
+    static bool nextPage(ListingWriter& out, const string& progress) {
+        out.text(progress + ". Press Enter for more, or q to stop: ");
+        out.flush();
+        string reply;
+        return getline(cin, reply) && reply != "q" && reply != "Q";
+    }
+
+    static void listRecords(ListingWriter& out, const vector<Book*>& books) {
+        for (const Book* book : books) {
+            book->render(out);
+            out.text(RECORD_RULE);
+        }
+    }
+
+    // Pages through the catalog in title order. Each page resumes after
+    // the last title shown rather than at an offset, so it costs one tree
+    // descent however deep into the catalog it is.
+    void listAllBooks(ListingWriter::Format format) {
+        ListingWriter out(cout, format, Book::columns());
+        out.text("\nAll Books in Library:\n" + string(50, '=') + "\n");
+        string lastTitle;
+        IsbnKey lastIsbn = NO_ISBN;
+        for (size_t shown = 0; ; ) {
+            bool more = false;
+            {
+                OperationTimer timer(METRIC_REPORT);
+                auto it = shown == 0 ? bookSearchTree.begin() : bookSearchTree.after(lastTitle, lastIsbn);
+                for (size_t row = 0; it != bookSearchTree.end(); ++it, row++) {
+                    if (row == REPORT_PAGE_SIZE) {
+                        more = true;
+                        break;
+                    }
+                    (*it)->render(out);
+                    if (format == ListingWriter::RECORDS) out.text(RECORD_RULE);
+                    lastTitle = (*it)->title;
+                    lastIsbn = (*it)->isbn;
+                    shown++;
+                }
+            }
+            if (!more || !nextPage(out, "Showing " + to_string(shown) + " of " + to_string(bookSearchTree.size()))) break;
+        }
+    }
+
+    // Pages through users in ID order, resuming after the last ID shown.
+    // Loan counts and fines come from one ledger view, so every page shows
+    // the same moment however long the reader takes over it.
+    void listAllUsers(ListingWriter& out) {
+        CirculationLedger::View view = loanView();
+        int lastId = 0;
+        for (size_t shown = 0; ; ) {
+            bool more = false;
+            {
+                OperationTimer timer(METRIC_REPORT);
+                size_t rows = 0;
+                userManager.forEachUserAfter(lastId, [&](User* user) {
+                    if (rows == REPORT_PAGE_SIZE) {
+                        more = true;
+                        return false;
+                    }
+                    CirculationLedger::UserRow row = view.user(user->userId);
+                    user->render(out, row.loans, row.fines);
+                    out.text(RECORD_RULE);
+                    lastId = user->userId;
+                    rows++;
+                    return true;
+                });
+                shown += rows;
+            }
+            if (!more || !nextPage(out, "Showing " + to_string(shown) + " of " + to_string(userManager.size()))) break;
+        }
+    }
+
+    // Users with books out, with their loans oldest first, paged from one
+    // ledger view
+    void listActiveUsers(ListingWriter& out) {
+        CirculationLedger::View view = loanView();
+        vector<CirculationLedger::LoanRow> loans = timed(METRIC_REPORT, [&]() { return loansByUser(view); });
+        size_t next = 0;
+        for (size_t shown = 0; ; ) {
+            {
+                OperationTimer timer(METRIC_REPORT);
+                for (size_t rows = 0; next < loans.size() && rows < REPORT_PAGE_SIZE; ) {
+                    size_t end = next;
+                    while (end < loans.size() && loans[end].userId == loans[next].userId) end++;
+                    const User* user = userManager.findUser(loans[next].userId);
+                    if (user) {
+                        user->render(out, end - next, view.user(user->userId).fines);
+                        out.text(describeLoans(&loans[next], &loans[0] + end));
+                        out.text(RECORD_RULE);
+                        rows++;
+                        shown++;
+                    }
+                    next = end;
+                }
+            }
+            if (next == loans.size() || !nextPage(out, "Showing first " + to_string(shown))) break;
+        }
+    }
+
+    // Open loans by user, each user's oldest first
+    static vector<CirculationLedger::LoanRow> loansByUser(const CirculationLedger::View& view) {
+        vector<CirculationLedger::LoanRow> loans;
+        view.forEachLoan([&](const CirculationLedger::LoanRow& loan) { loans.push_back(loan); });
+        sort(loans.begin(), loans.end(), [](const CirculationLedger::LoanRow& a, const CirculationLedger::LoanRow& b) {
+            return tie(a.userId, a.dueAt, a.sequence) < tie(b.userId, b.dueAt, b.sequence);
+        });
+        return loans;
+    }
+    
+    // "Borrowed Books: ..." line of the active users report
+    string describeLoans(const CirculationLedger::LoanRow* first, const CirculationLedger::LoanRow* last) const {
+        return "Borrowed Books: " + listLoans(first, last) + "\n";
+    }
+    
+    // "Title (due date); " for each loan
+    string listLoans(const CirculationLedger::LoanRow* first, const CirculationLedger::LoanRow* last) const {
+        string list;
+        for (const CirculationLedger::LoanRow* loan = first; loan != last; loan++) {
+            const Book* book = booksById[loan->bookId];
+            if (!book) continue;
+            list += book->title + " (";
+            if (book->totalCopies > 1) list += "copy " + to_string(loan->copy + 1) + ", ";
+            list += "due " + LibraryClock::formatDate(loan->dueAt) + "); ";
+        }
+        return list;
+    }
+
+    // Issues and returns over the last days, grouped by genre, author or
+    // user and split by hour or day, counted from the circulation event log
+    void showActivity() {
+        cout << "\n--- Circulation Activity ---\n";
+        string daysText;
+        int group, period, kinds;
+        cout << "Days to look back (blank for 7): ";
+        cin.ignore();
+        getline(cin, daysText);
+        int days = daysText.empty() ? 7 : atoi(daysText.c_str());
+        cout << "Group by (1 = genre, 2 = author, 3 = user, 4 = nothing): ";
+        cin >> group;
+        cout << "Split by (1 = hour, 2 = day, 3 = whole period): ";
+        cin >> period;
+        cout << "Count (1 = issues, 2 = returns, 3 = both): ";
+        cin >> kinds;
+        cin.ignore();
+        if (days < 1 || days > 3660 || group < 1 || group > 4 || period < 1 || period > 3 || kinds < 1 || kinds > 3) {
+            cout << "Invalid choice!\n";
+            return;
+        }
+        if (group == 3 && period != 3) {
+            cout << "Per-user counts cover the whole period.\n";
+            period = 3;
+        }
         
-        User* newUser = userManager.addUser(name, email);
-        cout << "User registered successfully! User ID: " << newUser->userId << "\n";
+        // Today and the days before it, whole days in UTC
+        int64_t today = LibraryClock::dayOf(clock.now());
+        CirculationEventLog::Query query{};
+        query.from = (today - days + 1) * LibraryClock::SECONDS_PER_DAY;
+        query.to = (today + 1) * LibraryClock::SECONDS_PER_DAY;
+        query.kinds = (uint8_t)kinds;
+        query.userId = CirculationEventLog::ANY;
+        query.group = group == 3 ? CirculationEventLog::BY_USER
+                    : group == 4 ? CirculationEventLog::BY_NOTHING : CirculationEventLog::BY_BOOK_KEY;
+        query.bookKeys = group == 1 ? &catalogColumns.genreColumn() : &catalogColumns.authorColumn();
+        query.bucketSeconds = period == 1 ? 3600 : period == 2 ? LibraryClock::SECONDS_PER_DAY : 0;
+        size_t buckets = query.bucketSeconds > 0 ? (size_t)((query.to - query.from) / query.bucketSeconds) : 1;
+        
+        vector<uint64_t> counts;
+        CirculationEventLog::View view = eventView();
+        CirculationEventLog::ScanStats scan = timed(METRIC_REPORT, [&]() { return view.aggregate(query, counts); });
+        
+        // Whole-period rows busiest first, split rows by group then time
+        vector<size_t> slots;
+        uint64_t total = 0;
+        for (size_t slot = 0; slot < counts.size(); slot++) {
+            if (counts[slot] > 0) slots.push_back(slot);
+            total += counts[slot];
+        }
+        if (period == 3) {
+            stable_sort(slots.begin(), slots.end(), [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+        }
+        auto groupLabel = [&](size_t key) -> string {
+            switch (group) {
+                case 1: return catalogColumns.genreLabel((uint32_t)key);
+                case 2: return catalogColumns.authorLabel((uint32_t)key);
+                case 3: {
+                    User* user = userManager.findUser((int)key);
+                    return to_string(key) + (user ? " " + user->name : "");
+                }
+                default: return "All books";
+            }
+        };
+        auto periodLabel = [&](size_t bucket) -> string {
+            if (period == 3) return "Last " + to_string(days) + " day(s)";
+            int64_t start = query.from + (int64_t)bucket * query.bucketSeconds;
+            string label = LibraryClock::formatDate(start);
+            if (period == 1) {
+                int64_t hour = (start - LibraryClock::dayOf(start) * LibraryClock::SECONDS_PER_DAY) / 3600;
+                label += (hour < 10 ? " 0" : " ") + to_string(hour) + ":00";
+            }
+            return label;
+        };
+        
+        if (slots.empty()) {
+            cout << "No " << (kinds == 1 ? "issues" : kinds == 2 ? "returns" : "issues or returns")
+                 << " in this period.\n";
+        }
+        for (size_t offset = 0; offset < slots.size(); offset += REPORT_PAGE_SIZE) {
+            if (offset > 0) {
+                cout << "Showing " << offset << " of " << slots.size() << ". Press Enter for more, or q to stop: ";
+                string reply;
+                if (!getline(cin, reply) || reply == "q" || reply == "Q") break;
+            }
+            cout << left << setw(30) << "Group" << setw(20) << "Period" << "Count\n";
+            cout << string(60, '-') << "\n";
+            for (size_t i = offset; i < min(slots.size(), offset + REPORT_PAGE_SIZE); i++) {
+                cout << left << setw(30) << groupLabel(slots[i] / buckets) << setw(20) << periodLabel(slots[i] % buckets)
+                     << counts[slots[i]] << "\n";
+            }
+        }
+        cout << total << " event(s); " << scan.decoded << " of " << scan.blocks << " log blocks read ("
+             << scan.events << " events)\n";
     }
     
-    void searchBooks() {
+    void generateReports() {
         int choice;
-        cout << "\n--- Search Books ---\n";
-        cout << "1. Search by ISBN\n";
-        cout << "2. Search by Title\n";
-        cout << "3. Search by Author\n";
-        cout << "4. Display all books\n";
+        cout << "\n--- Reports ---\n";
+        cout << "1. Currently Borrowed Books\n";
+        cout << "2. Most Borrowed Books\n";
+        cout << "3. Active Users\n";
+        cout << "4. All Users Summary\n";
+        cout << "5. Genre Summary\n";
+        cout << "6. Operation Statistics\n";
+        cout << "7. Overdue Loans\n";
+        cout << "8. Circulation Activity\n";
         cout << "Enter choice: ";
         cin >> choice;
         
         switch(choice) {
             case 1: {
-                string isbn;
-                cout << "Enter ISBN: ";
+                cout << "\n--- Currently Borrowed Books ---\n";
+                string genre, author;
+                cout << "Filter by genre (blank for all): ";
                 cin.ignore();
-                getline(cin, isbn);
-                Book* book = bookInventory.search(isbn);
-                if (book) {
-                    cout << "\nBook Found:\n";
-                    book->display();
-                } else {
-                    cout << "Book not found!\n";
+                getline(cin, genre);
+                cout << "Filter by author (blank for all): ";
+                getline(cin, author);
+                
+                // Scans the availability bitmap rather than every Book
+                CatalogColumns::Filter filter{true, CatalogColumns::ANY, CatalogColumns::ANY};
+                if ((!genre.empty() && !catalogColumns.findGenre(genre, filter.genre))
+                    || (!author.empty() && !catalogColumns.findAuthor(author, filter.author))) {
+                    cout << "No books are currently borrowed.\n";
+                    break;
+                }
+                ListingWriter out(cout, ListingWriter::RECORDS, Book::columns());
+                for (size_t offset = 0; ; offset += REPORT_PAGE_SIZE) {
+                    size_t total = timed(METRIC_REPORT, [&]() {
+                        return catalogColumns.scan(filter, offset, REPORT_PAGE_SIZE, [&](uint32_t bookId) {
+                            booksById[bookId]->render(out);
+                            out.text(RECORD_RULE);
+                        });
+                    });
+                    if (total == 0) {
+                        out.text("No books are currently borrowed.\n");
+                        break;
+                    }
+                    if (offset + REPORT_PAGE_SIZE >= total) {
+                        out.text(to_string(total) + " book(s) currently borrowed.\n");
+                        break;
+                    }
+                    if (!nextPage(out, "Showing " + to_string(offset + REPORT_PAGE_SIZE) + " of " + to_string(total))) break;
                 }
                 break;
             }
             case 2: {
-                string title;
-                cout << "Enter Title: ";
-                cin.ignore();
-                getline(cin, title);
-                Book* book = bookSearchTree.searchByTitle(title);
-                if (book) {
-                    cout << "\nBook Found:\n";
-                    book->display();
-                } else {
-                    cout << "Book not found!\n";
+                cout << "\n--- Most Borrowed Books ---\n";
+                cout << "1. All Time\n";
+                cout << "2. Last 7 Days\n";
+                cout << "3. Last 30 Days\n";
+                cout << "Enter choice: ";
+                int window;
+                cin >> window;
+                if (window < 1 || window > 3) {
+                    cout << "Invalid choice!\n";
+                    break;
                 }
+                
+                printMostBorrowed(cout, mostBorrowed((BorrowStatistics::Window)(window - 1), MOST_BORROWED_ROWS),
+                                  window == 1);
                 break;
             }
             case 3: {
-                string author;
-                cout << "Enter Author: ";
+                cout << "\n--- Active Users (Users with borrowed books) ---\n";
                 cin.ignore();
-                getline(cin, author);
-                vector<Book*> allBooks = bookInventory.getAllBooks();
-                bool found = false;
-                cout << "\nBooks by " << author << ":\n";
-                cout << string(50, '-') << "\n";
-                for (Book* book : allBooks) {
-                    if (book->author == author) {
-                        book->display();
-                        cout << string(30, '-') << "\n";
-                        found = true;
-                    }
-                }
-                if (!found) {
-                    cout << "No books found by this author!\n";
+                ListingWriter out(cout, ListingWriter::RECORDS, User::columns());
+                listActiveUsers(out);
+                if (out.rows() == 0) {
+                    out.text("No active users found.\n");
                 }
                 break;
             }
             case 4: {
-                vector<Book*> allBooks = bookInventory.getAllBooks();
-                if (allBooks.empty()) {
+                cout << "\n--- All Users Summary ---\n";
+                if (userManager.size() == 0) {
+                    cout << "No users registered.\n";
+                    break;
+                }
+                cin.ignore();
+                ListingWriter out(cout, ListingWriter::RECORDS, User::columns());
+                listAllUsers(out);
+                break;
+            }
+            case 5: {
+                cout << "\n--- Genre Summary ---\n";
+                OperationTimer timer(METRIC_REPORT);
+                if (genreIndex.size() == 0) {
                     cout << "No books in the library!\n";
                 } else {
-                    cout << "\nAll Books in Library:\n";
-                    cout << string(50, '=') << "\n";
-                    for (Book* book : allBooks) {
-                        book->display();
-                        cout << string(30, '-') << "\n";
+                    cout << left << setw(30) << "Genre" << setw(10) << "Books"
+                         << setw(10) << "Borrowed" << "Borrows\n";
+                    cout << string(60, '-') << "\n";
+                    catalogColumns.forEachGenre([](const string& genre, size_t books, size_t borrowed,
+                                                   uint64_t borrows) {
+                        cout << left << setw(30) << genre << setw(10) << books
+                             << setw(10) << borrowed << borrows << "\n";
+                    });
+                }
+                break;
+            }
+            case 6:
+                cout << "\n--- Operation Statistics ---\n";
+                printStatistics(cout);
+                break;
+            case 7: {
+                // Read from a ledger view, so issues and returns carry on
+                // while the loans are gathered and sorted
+                cout << "\n--- Overdue Loans ---\n";
+                int64_t now = clock.now();
+                vector<CirculationLedger::LoanRow> overdue = overdueLoans(now);
+                if (overdue.empty()) {
+                    cout << "No loans are overdue.\n";
+                    break;
+                }
+                cin.ignore();
+                for (size_t offset = 0; offset < overdue.size(); offset += REPORT_PAGE_SIZE) {
+                    if (offset > 0) {
+                        cout << "Showing " << offset << " of " << overdue.size()
+                             << ". Press Enter for more, or q to stop: ";
+                        string reply;
+                        if (!getline(cin, reply) || reply == "q" || reply == "Q") break;
+                    }
+                    cout << left << setw(10) << "User ID" << setw(20) << "Name" << setw(12) << "Due"
+                         << setw(10) << "Days" << setw(10) << "Fine" << "Title\n";
+                    cout << string(80, '-') << "\n";
+                    for (size_t i = offset; i < min(overdue.size(), offset + REPORT_PAGE_SIZE); i++) {
+                        const CirculationLedger::LoanRow& loan = overdue[i];
+                        User* user = userManager.findUser(loan.userId);
+                        Book* book = booksById[loan.bookId];
+                        cout << left << setw(10) << loan.userId << setw(20) << (user ? user->name : "")
+                             << setw(12) << LibraryClock::formatDate(loan.dueAt)
+                             << setw(10) << daysLate(loan.dueAt, now)
+                             << setw(10) << formatCents(lateFine(loan.dueAt, now))
+                             << (book ? book->title : "") << "\n";
                     }
                 }
+                cout << overdue.size() << " loan(s) overdue.\n";
                 break;
             }
+            case 8:
+                showActivity();
+                break;
             default:
                 cout << "Invalid choice!\n";
         }
     }
     
-    void issueBook() {
-        int userId;
-        string isbn;
-        cout << "\n--- Issue Book ---\n";
-        cout << "Enter User ID: ";
-        cin >> userId;
-        cout << "Enter Book ISBN: ";
-        cin.ignore();
-        getline(cin, isbn);
-        
-        // Add to issue queue
-        issueQueue.push({userId, isbn});
-        cout << "Issue request added to queue.\n";
+    void displayMenu() {
+        cout << "\n" << string(50, '=') << "\n";
+        cout << "      SMART LIBRARY MANAGEMENT SYSTEM\n";
+        cout << string(50, '=') << "\n";
+        cout << "1. Add Book\n";
+        cout << "2. Register User\n";
+        cout << "3. Search Books\n";
+        cout << "4. Issue Book\n";
+        cout << "5. Return Book\n";
+        cout << "6. Generate Reports\n";
+        cout << "7. Initialize Sample Data (Optional)\n";
+        cout << "8. Remove Book\n";
+        cout << "9. Deregister User\n";
+        cout << "10. Cancel Hold\n";
+        cout << "11. Exit\n";
+        cout << string(50, '-') << "\n";
+        cout << "Enter your choice: ";
+    }
+    
+    void run() {
+        cout << "\nWelcome to Smart Library Management System!\n";
+        cout << "Please start by adding books and registering users.\n";
         
-        // Process the queue
-        processIssueQueue();
+        int choice;
+        do {
+            displayMenu();
+            cin >> choice;
+            
+            switch(choice) {
+                case 1:
+                    addBook();
+                    break;
+                case 2:
+                    addUser();
+                    break;
+                case 3:
+                    searchBooks();
+                    break;
+                case 4:
+                    issueBook();
+                    break;
+                case 5:
+                    returnBook();
+                    break;
+                case 6:
+                    generateReports();
+                    break;
+                case 7:
+                    initializeSampleData();
+                    break;
+                case 8:
+                    removeBook();
+                    break;
+                case 9:
+                    removeUser();
+                    break;
+                case 10:
+                    cancelHold();
+                    break;
+                case 11:
+                    cout << "Thank you for using Smart Library Management System!\n";
+                    break;
+                default:
+                    cout << "Invalid choice! Please try again.\n";
+            }
+            commitChanges();
+            publishGauges();
+        } while(choice != 11);
     }
     
-    void returnBook() {
-        int userId;
-        string isbn;
-        cout << "\n--- Return Book ---\n";
-        cout << "Enter User ID: ";
-        cin >> userId;
-        cout << "Enter Book ISBN: ";
-        cin.ignore();
-        getline(cin, isbn);
+    
+    void initializeSampleData() {
+        cout << "\n--- Initialize Sample Data ---\n";
+        cout << "This will add sample books and users to the system.\n";
+        cout << "Do you want to continue? (y/n): ";
+        char confirm;
+        cin >> confirm;
         
-        // Add to return queue
-        returnQueue.push({userId, isbn});
-        cout << "Return request added to queue.\n";
+        if (confirm != 'y' && confirm != 'Y') {
+            cout << "Sample data initialization cancelled.\n";
+            return;
+        }
         
-        // Process the queue
-        processReturnQueue();
+        loadSampleData();
+        
+        cout << "\nSample data initialized successfully!\n";
+        cout << "Added 5 programming books and 3 sample users to the system.\n";
+        cout << "\nSample Books Added:\n";
+        cout << "- Effective Modern C++ by Scott Meyers\n";
+        cout << "- The C++ Programming Language by Bjarne Stroustrup\n";
+        cout << "- 97 Things Every Programmer Should Know by Kevlin Henney\n";
+        cout << "- Clean Code by Robert C. Martin\n";
+        cout << "- Design Patterns by Gang of Four\n";
+        cout << "\nSample Users Added:\n";
+        cout << "- Alice Johnson (ID: 1)\n";
+        cout << "- Bob Smith (ID: 2)\n";
+        cout << "- Charlie Brown (ID: 3)\n";
+    }
+    
+    // ISBN, title, author and genre; name and email
+    static constexpr const char* SAMPLE_BOOKS[][4] = {
+        {"978-0134685991", "Effective Modern C++", "Scott Meyers", "Programming"},
+        {"978-0321563842", "The C++ Programming Language", "Bjarne Stroustrup", "Programming"},
+        {"978-0596809485", "97 Things Every Programmer Should Know", "Kevlin Henney", "Programming"},
+        {"978-0132350884", "Clean Code", "Robert C. Martin", "Programming"},
+        {"978-0201633610", "Design Patterns", "Gang of Four", "Software Engineering"},
+    };
+    static constexpr const char* SAMPLE_USERS[][2] = {
+        {"Alice Johnson", "alice@email.com"},
+        {"Bob Smith", "bob@email.com"},
+        {"Charlie Brown", "charlie@email.com"},
+    };
+    
+    void loadSampleData() {
+        // Add sample books, skipping any that are already registered
+        for (const auto& sample : SAMPLE_BOOKS) {
+            IsbnKey isbn = parseIsbn(sample[0]);
+            if (!bookInventory.search(isbn)) {
+                registerBook(bookPool.create(isbn, sample[1], sample[2], sample[3]));
+            }
+        }
+        
+        // Add sample users (duplicate emails are rejected by the store)
+        for (const auto& sample : SAMPLE_USERS) {
+            registerUser(sample[0], sample[1]);
+        }
+    }
+};
+
+// Request server for kiosks (--serve). A single epoll loop listens on a
+// Unix domain socket, and optionally on a loopback TCP port, and speaks
+// the line protocol of LibrarySystem::handleRequest. Clients may pipeline
+// requests; replies come back in order. Each pass of the loop answers
+// every complete request that has arrived, commits the log once for all
+// of them, and only then sends the replies, one write per connection. An
+// OK is therefore only sent once the change it reports is on disk; if the
+// commit fails, connections with unsaved changes are closed instead.
+class LibraryServer {
+private:
+    static const size_t MAX_REQUEST = 4096;        // longest request line
+    static const size_t MAX_PENDING_OUTPUT = 4 << 20; // stop reading a client this far behind
+    static const int MAX_EVENTS = 256;
+
+    struct Connection {
+        int fd;
+        string input;
+        string output;
+        size_t sent = 0;        // bytes of output already written
+        bool reading = true;    // EPOLLIN wanted
+        bool writing = false;   // EPOLLOUT wanted
+        bool closing = false;   // close once output is sent
+        size_t unsavedFrom = string::npos; // first reply this pass that reports a logged change
+    };
+
+    LibrarySystem& library;
+    int epollFd;
+    int unixFd;
+    int tcpFd;
+    int signalFd;
+    string socketPath;
+    vector<unique_ptr<Connection>> connections; // by file descriptor
+    vector<int> touched; // connections with replies to send this pass
+    size_t accepted;
+    size_t requests;
+
+    static bool setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    bool watch(int fd, uint32_t events, int op) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        return epoll_ctl(epollFd, op, fd, &event) == 0;
+    }
+
+    void updateInterest(Connection& connection) {
+        uint32_t events = 0;
+        if (connection.reading) events |= EPOLLIN | EPOLLRDHUP;
+        if (connection.writing) events |= EPOLLOUT;
+        watch(connection.fd, events, EPOLL_CTL_MOD);
+    }
+
+    int listenOn(int fd, const sockaddr* address, socklen_t length, const string& name) {
+        if (fd < 0 || bind(fd, address, length) != 0 || listen(fd, SOMAXCONN) != 0 || !setNonBlocking(fd)
+            || !watch(fd, EPOLLIN, EPOLL_CTL_ADD)) {
+            cerr << "Cannot listen on " << name << ": " << strerror(errno) << "\n";
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    void acceptAll(int listener) {
+        while (true) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    cerr << "accept: " << strerror(errno) << "\n";
+                }
+                return;
+            }
+            if (listener == tcpFd) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            if ((size_t)fd >= connections.size()) connections.resize(fd + 1);
+            connections[fd].reset(new Connection());
+            connections[fd]->fd = fd;
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+            accepted++;
+        }
+    }
+
+    void closeConnection(Connection& connection) {
+        int fd = connection.fd;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections[fd].reset();
+    }
+
+    // Reads what has arrived and answers every complete request in it.
+    // Requests are answered chunk by chunk, so the input never holds more
+    // than one chunk past a partial line.
+    void readRequests(Connection& connection) {
+        char chunk[65536];
+        while (connection.reading) {
+            ssize_t got = recv(connection.fd, chunk, sizeof(chunk), 0);
+            if (got > 0) {
+                connection.input.append(chunk, (size_t)got);
+                answerRequests(connection);
+                if (connection.output.size() - connection.sent >= MAX_PENDING_OUTPUT) break;
+                continue;
+            }
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (got < 0 && errno == EINTR) continue;
+            connection.reading = false; // peer finished sending, or failed
+            connection.closing = true;
+        }
+        // A client that does not read its replies is not read from either
+        if (connection.reading && connection.output.size() - connection.sent >= MAX_PENDING_OUTPUT) {
+            connection.reading = false;
+        }
+        touched.push_back(connection.fd);
+    }
+
+    // Answers the complete requests in the input. A partial line already
+    // longer than MAX_REQUEST gets an error and ends the connection.
+    void answerRequests(Connection& connection) {
+        size_t start = 0;
+        for (size_t newline; (newline = connection.input.find('\n', start)) != string::npos; start = newline + 1) {
+            string_view request(connection.input.data() + start, newline - start);
+            if (!request.empty() && request != "\r") {
+                size_t unsaved = library.unsavedChanges(), replyStart = connection.output.size();
+                library.handleRequest(request, connection.output);
+                if (library.unsavedChanges() != unsaved) connection.unsavedFrom = min(connection.unsavedFrom, replyStart);
+                requests++;
+            }
+        }
+        connection.input.erase(0, start);
+        if (connection.input.size() > MAX_REQUEST) {
+            connection.output.append("ERR Request too long\n");
+            connection.input.clear();
+            connection.reading = false;
+            connection.closing = true;
+        }
+    }
+
+    // Sends as much of the pending output as the socket takes
+    void sendReplies(Connection& connection) {
+        while (connection.sent < connection.output.size()) {
+            ssize_t wrote = send(connection.fd, connection.output.data() + connection.sent,
+                                 connection.output.size() - connection.sent, MSG_NOSIGNAL);
+            if (wrote > 0) {
+                connection.sent += (size_t)wrote;
+                continue;
+            }
+            if (wrote < 0 && errno == EINTR) continue;
+            if (wrote < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            closeConnection(connection); // the peer has gone
+            return;
+        }
+        bool drained = connection.sent == connection.output.size();
+        if (drained) {
+            connection.output.clear();
+            connection.sent = 0;
+            if (connection.closing) {
+                closeConnection(connection);
+                return;
+            }
+        }
+        bool reading = connection.reading || (!connection.closing && drained);
+        if (connection.writing != !drained || connection.reading != reading) {
+            connection.writing = !drained;
+            connection.reading = reading;
+            updateInterest(connection);
+        }
+    }
+
+public:
+    explicit LibraryServer(LibrarySystem& library)
+        : library(library), epollFd(-1), unixFd(-1), tcpFd(-1), signalFd(-1), accepted(0), requests(0) {}
+
+    ~LibraryServer() {
+        for (unique_ptr<Connection>& connection : connections) {
+            if (connection) close(connection->fd);
+        }
+        for (int fd : {unixFd, tcpFd, signalFd, epollFd}) {
+            if (fd >= 0) close(fd);
+        }
+        if (unixFd >= 0) unlink(socketPath.c_str());
+    }
+
+    LibraryServer(const LibraryServer&) = delete;
+    LibraryServer& operator=(const LibraryServer&) = delete;
+
+    // SIGINT and SIGTERM stop the server through a signalfd, so they must
+    // be blocked before any other thread starts
+    static void blockStopSignals() {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    // Listens on path, replacing a stale socket file, and on 127.0.0.1
+    // at tcpPort unless it is 0
+    bool open(const string& path, int tcpPort) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            cerr << "epoll_create1: " << strerror(errno) << "\n";
+            return false;
+        }
+        sockaddr_un unixAddress{};
+        unixAddress.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(unixAddress.sun_path)) {
+            cerr << "Socket path too long: " << path << "\n";
+            return false;
+        }
+        memcpy(unixAddress.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());
+        unixFd = listenOn(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0),
+                          reinterpret_cast<sockaddr*>(&unixAddress), sizeof(unixAddress), path);
+        if (unixFd < 0) return false;
+        socketPath = path;
+
+        if (tcpPort > 0) {
+            sockaddr_in tcpAddress{};
+            tcpAddress.sin_family = AF_INET;
+            tcpAddress.sin_port = htons((uint16_t)tcpPort);
+            tcpAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int on = 1;
+            if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            tcpFd = listenOn(fd, reinterpret_cast<sockaddr*>(&tcpAddress), sizeof(tcpAddress),
+                             "127.0.0.1:" + to_string(tcpPort));
+            if (tcpFd < 0) return false;
+        }
+
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signalFd < 0 || !watch(signalFd, EPOLLIN, EPOLL_CTL_ADD)) {
+            cerr << "signalfd: " << strerror(errno) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Serves until SIGINT or SIGTERM
+    void run() {
+        cerr << "Serving on " << socketPath;
+        if (tcpFd >= 0) cerr << " and loopback TCP";
+        cerr << "; SIGINT or SIGTERM stops\n";
+        epoll_event events[MAX_EVENTS];
+        bool stopping = false;
+        while (!stopping) {
+            int ready = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                cerr << "epoll_wait: " << strerror(errno) << "\n";
+                break;
+            }
+            for (int i = 0; i < ready; i++) {
+                int fd = events[i].data.fd;
+                if (fd == unixFd || fd == tcpFd) {
+                    acceptAll(fd);
+                } else if (fd == signalFd) {
+                    stopping = true;
+                } else if ((size_t)fd < connections.size() && connections[fd]) {
+                    Connection& connection = *connections[fd];
+                    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                        readRequests(connection);
+                    } else {
+                        touched.push_back(fd);
+                    }
+                }
+            }
+
+            // Group commit for the whole pass, then the replies. If it
+            // fails, a connection gets the replies before its first
+            // unsaved change, an ERR in place of that one, and is closed.
+            bool committed = library.commitChanges();
+            library.publishGauges();
+            for (int fd : touched) {
+                if ((size_t)fd >= connections.size() || !connections[fd]) continue;
+                Connection& connection = *connections[fd];
+                if (!committed && connection.unsavedFrom != string::npos) {
+                    connection.output.resize(connection.unsavedFrom);
+                    connection.output.append("ERR Log write failed; the change may not be saved\n");
+                    connection.input.clear();
+                    connection.reading = false;
+                    connection.closing = true;
+                }
+                connection.unsavedFrom = string::npos;
+                sendReplies(connection);
+            }
+            touched.clear();
+        }
+        cerr << "Served " << requests << " requests on " << accepted << " connections\n";
+    }
+};
+
+// Several libraries ("branches") in one process (--shards). A book lives on
+// the branch its ISBN hashes to, and a user is registered at the branch
+// their email hashes to; their user ID names that home branch, as
+// (local ID - 1) * branches + home + 1. Each branch has a worker thread
+// pinned to a core of its own and its own request queue, and only that
+// thread touches the branch, so branches share no locks.
+//
+// Loans are kept by the branch that owns the book. An issue goes to the
+// borrower's home branch, which checks the user and, for a book held by
+// another branch, transfers their card there: the book's branch keeps a
+// visitor record with the same name and email, made on the first visit
+// and logged like any registration, and issues the book to it. Returns
+// and hold cancellations go straight to the book's branch. Reports are
+// gathered from every branch at once and merged.
+class ShardedLibrary {
+public:
+    static const unsigned MAX_BRANCHES = 256;
+
+private:
+    static const size_t INBOX_CAPACITY = 1 << 14;
+    struct Branch;
+
+    // Counts down the requests of a batch, or the branches of a scatter
+    class Completion {
+    private:
+        atomic<size_t> pending;
+        bool finished; // guarded by lock
+        mutex lock;
+        condition_variable wake;
+
+    public:
+        atomic<size_t> succeeded;
+
+        explicit Completion(size_t pending) : pending(pending), finished(pending == 0), succeeded(0) {}
+
+        void finish(bool ok) {
+            if (ok) succeeded.fetch_add(1, memory_order_relaxed);
+            if (pending.fetch_sub(1, memory_order_acq_rel) == 1) {
+                lock_guard<mutex> guard(lock);
+                finished = true;
+                wake.notify_all();
+            }
+        }
+
+        void wait() {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [this]() { return finished; });
+        }
+    };
+
+    struct Message {
+        char kind = 0; // 'I', 'R' or 'C' as in a batch; 'V' issues to a visitor; 'F' runs work
+        int userId = 0;
+        IsbnKey isbn = NO_ISBN;
+        string name; // the borrower's card, for 'V'
+        string email;
+        function<void(Branch&)> work;
+        Completion* done = nullptr;
+    };
+
+    struct Branch {
+        unsigned index;
+        int core; // -1 to leave the worker unpinned
+        LibrarySystem library;
+        MPMCQueue<Message> inbox;
+        deque<Message> outbox; // transfers waiting for room in another branch's inbox
+        vector<int> userIds;   // user ID of each local record, 0 if unmapped
+        unordered_map<int, int> visitors; // user ID to local visitor record
+        ostringstream messages;
+        ostream* out; // messages, or null when quiet
+        atomic<bool> sleeping;
+        mutex wakeLock;
+        condition_variable wake;
+        thread worker;
+
+        Branch(unsigned index, int core) : index(index), core(core), inbox(INBOX_CAPACITY), out(nullptr), sleeping(false) {
+            library.setMessageStream(nullptr);
+        }
+    };
+
+    vector<unique_ptr<Branch>> branches;
+    atomic<bool> running;
+    atomic<size_t> transfers; // issues passed to another branch
+
+    unsigned count() const { return (unsigned)branches.size(); }
+
+    Branch& bookBranch(IsbnKey isbn) {
+        return *branches[branchOf(isbn)];
+    }
+
+    unsigned homeOf(int userId) const {
+        return (unsigned)(userId - 1) % count();
+    }
+
+    unsigned homeOf(const string& email) const {
+        string key = normaliseKey(email);
+        return (unsigned)(hashKey(crc32(key.data(), key.size())) % count());
+    }
+
+    int userIdOf(unsigned home, int localId) const {
+        return (localId - 1) * (int)count() + (int)home + 1;
+    }
+
+    static void remember(Branch& branch, int localId, int userId) {
+        if ((size_t)localId >= branch.userIds.size()) branch.userIds.resize(localId + 1, 0);
+        branch.userIds[localId] = userId;
+    }
+
+    // The branch's record of a user: their own at their home branch, a
+    // visitor record elsewhere; 0 if it has none
+    int localIdAt(const Branch& branch, int userId) const {
+        if (userId <= 0) return 0;
+        if (homeOf(userId) == branch.index) {
+            size_t localId = (size_t)(userId - 1) / count() + 1;
+            return localId < branch.userIds.size() && branch.userIds[localId] == userId ? (int)localId : 0;
+        }
+        auto found = branch.visitors.find(userId);
+        return found == branch.visitors.end() ? 0 : found->second;
+    }
+
+    // Takes a transferred card: the visitor record from an earlier visit,
+    // a new one, or one left under the same email by an earlier card
+    int admitVisitor(Branch& branch, const Message& message) {
+        int localId = localIdAt(branch, message.userId);
+        if (localId) return localId;
+        const User* record = branch.library.registerUser(message.name, message.email);
+        if (!record) {
+            record = branch.library.findUserByEmail(message.email);
+            if (!record) return 0;
+            if ((size_t)record->userId < branch.userIds.size()) branch.visitors.erase(branch.userIds[record->userId]);
+        }
+        remember(branch, record->userId, message.userId);
+        branch.visitors[message.userId] = record->userId;
+        return record->userId;
+    }
+
+    // Maps every branch's records to user IDs, visitors through the home
+    // record with their email; only while the workers are idle
+    void mapUsers() {
+        for (auto& branch : branches) {
+            branch->userIds.clear();
+            branch->visitors.clear();
+            branch->library.forEachUser([&](const User* user) {
+                unsigned home = homeOf(user->email);
+                if (home == branch->index) {
+                    remember(*branch, user->userId, userIdOf(home, user->userId));
+                } else if (const User* card = branches[home]->library.findUserByEmail(user->email)) {
+                    remember(*branch, user->userId, userIdOf(home, card->userId));
+                    branch->visitors[userIdOf(home, card->userId)] = user->userId;
+                }
+            });
+        }
+    }
+
+    // Queues a message and wakes the branch if it sleeps; false, with the
+    // message left alone, if the inbox is full
+    bool post(Branch& branch, Message& message) {
+        if (!branch.inbox.push(move(message))) return false;
+        atomic_thread_fence(memory_order_seq_cst); // pairs with the one in serve
+        if (branch.sleeping.load(memory_order_relaxed)) {
+            lock_guard<mutex> guard(branch.wakeLock);
+            branch.wake.notify_one();
+        }
+        return true;
+    }
+
+    void handle(Branch& branch, Message& message) {
+        bool ok = false;
+        switch (message.kind) {
+            case 'F':
+                message.work(branch);
+                message.work = nullptr;
+                ok = true;
+                break;
+            case 'I': {
+                int localId = localIdAt(branch, message.userId);
+                const User* user = localId ? branch.library.findUser(localId) : nullptr;
+                if (!user) {
+                    if (branch.out) *branch.out << "User with ID " << message.userId << " not found!\n";
+                    break;
+                }
+                Branch& owner = bookBranch(message.isbn);
+                if (&owner == &branch) {
+                    ok = branch.library.applyIssue(localId, message.isbn, branch.out);
+                    break;
+                }
+                // The card goes with the request; a full inbox never
+                // blocks a worker, so two branches cannot wait on each other
+                message.kind = 'V';
+                message.name = user->name;
+                message.email = user->email;
+                transfers.fetch_add(1, memory_order_relaxed);
+                if (!branch.outbox.empty() || !post(owner, message)) branch.outbox.push_back(move(message));
+                return;
+            }
+            case 'V': {
+                int localId = admitVisitor(branch, message);
+                ok = localId && branch.library.applyIssue(localId, message.isbn, branch.out);
+                break;
+            }
+            case 'R':
+            case 'C': {
+                int localId = localIdAt(branch, message.userId);
+                if (!localId) {
+                    if (branch.out && homeOf(message.userId) == branch.index) {
+                        *branch.out << "User with ID " << message.userId << " not found!\n";
+                    } else if (branch.out) {
+                        *branch.out << "User with ID " << message.userId << " has no loans or holds at this branch!\n";
+                    }
+                    break;
+                }
+                ok = message.kind == 'R' ? branch.library.applyReturn(localId, message.isbn, branch.out)
+                                         : branch.library.applyCancelHold(localId, message.isbn, branch.out);
+                break;
+            }
+        }
+        message.done->finish(ok);
     }
-    
-    void processIssueQueue() {
-        while (!issueQueue.empty()) {
-            auto request = issueQueue.front();
-            issueQueue.pop();
-            
-            int userId = request.first;
-            string isbn = request.second;
-            
-            User* user = userManager.findUser(userId);
-            Book* book = bookInventory.search(isbn);
-            
-            if (!user) {
-                cout << "User with ID " << userId << " not found!\n";
-                continue;
+
+    void serve(Branch& branch) {
+        if (branch.core >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(branch.core, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+        Message message;
+        while (true) {
+            while (!branch.outbox.empty() && post(bookBranch(branch.outbox.front().isbn), branch.outbox.front())) {
+                branch.outbox.pop_front();
             }
-            
-            if (!book) {
-                cout << "Book with ISBN " << isbn << " not found!\n";
+            if (branch.inbox.pop(message)) {
+                handle(branch, message);
                 continue;
             }
-            
-            if (!book->isAvailable) {
-                cout << "Book '" << book->title << "' is not available!\n";
+            if (!branch.outbox.empty()) {
+                this_thread::yield();
                 continue;
             }
-            
-            // Issue the book
-            book->isAvailable = false;
-            book->borrowCount++;
-            user->borrowedBooks.push(isbn);
-            borrowFrequency[isbn]++;
-            
-            cout << "Book '" << book->title << "' issued to " << user->name << " successfully!\n";
+            // Sleep, unless a message arrived after the flag went up
+            bool idle;
+            {
+                unique_lock<mutex> lock(branch.wakeLock);
+                if (!running.load(memory_order_acquire)) return;
+                branch.sleeping.store(true, memory_order_relaxed);
+                atomic_thread_fence(memory_order_seq_cst);
+                idle = !branch.inbox.pop(message);
+                if (idle) branch.wake.wait(lock);
+                branch.sleeping.store(false, memory_order_relaxed);
+            }
+            if (!idle) handle(branch, message);
         }
     }
-    
-    void processReturnQueue() {
-        while (!returnQueue.empty()) {
-            auto request = returnQueue.front();
-            returnQueue.pop();
-            
-            int userId = request.first;
-            string isbn = request.second;
-            
-            User* user = userManager.findUser(userId);
-            Book* book = bookInventory.search(isbn);
-            
-            if (!user) {
-                cout << "User with ID " << userId << " not found!\n";
-                continue;
+
+    // Runs work on one branch's thread, or on every branch's at once when
+    // only is null, and waits for it
+    void runOn(Branch* only, const function<void(Branch&)>& work) {
+        Completion done(only ? 1 : count());
+        for (auto& branch : branches) {
+            if (only && branch.get() != only) continue;
+            Message message;
+            message.kind = 'F';
+            message.work = work;
+            message.done = &done;
+            while (!post(*branch, message)) this_thread::yield();
+        }
+        done.wait();
+    }
+
+    void scatter(const function<void(Branch&)>& work) {
+        runOn(nullptr, work);
+    }
+
+public:
+    // Workers are pinned to the cores this process may use, in turn
+    explicit ShardedLibrary(unsigned branchCount) : running(true), transfers(0) {
+        vector<int> cores;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) cores.push_back(cpu);
             }
-            
-            if (!book) {
-                cout << "Book with ISBN " << isbn << " not found!\n";
-                continue;
+        }
+        branchCount = min(max(branchCount, 1u), MAX_BRANCHES);
+        for (unsigned i = 0; i < branchCount; i++) {
+            branches.emplace_back(new Branch(i, cores.empty() ? -1 : cores[i % cores.size()]));
+        }
+        for (auto& branch : branches) {
+            Branch* target = branch.get();
+            branch->worker = thread([this, target]() { serve(*target); });
+        }
+    }
+
+    ~ShardedLibrary() {
+        running.store(false, memory_order_release);
+        for (auto& branch : branches) {
+            {
+                lock_guard<mutex> guard(branch->wakeLock);
+                branch->wake.notify_one();
             }
-            
-            // Check if user has this book
-            queue<string> tempQueue;
-            bool bookFound = false;
-            
-            while (!user->borrowedBooks.empty()) {
-                string borrowedIsbn = user->borrowedBooks.front();
-                user->borrowedBooks.pop();
-                
-                if (borrowedIsbn == isbn) {
-                    bookFound = true;
-                } else {
-                    tempQueue.push(borrowedIsbn);
-                }
+            branch->worker.join();
+        }
+    }
+
+    ShardedLibrary(const ShardedLibrary&) = delete;
+    ShardedLibrary& operator=(const ShardedLibrary&) = delete;
+
+    unsigned branchCount() const { return count(); }
+
+    unsigned branchOf(IsbnKey isbn) const {
+        return (unsigned)(hashKey(isbn) % count());
+    }
+
+    // Runs work on every branch's library at once, each on its own worker,
+    // e.g. to load books in bulk; users must go through registerUser
+    void forEachBranch(const function<void(LibrarySystem&, unsigned)>& work) {
+        scatter([&](Branch& branch) { work(branch.library, branch.index); });
+    }
+
+    void setHoldsEnabled(bool enabled) {
+        scatter([&](Branch& branch) { branch.library.setHoldsEnabled(enabled); });
+    }
+
+    void advanceClock(int64_t seconds) {
+        scatter([&](Branch& branch) { branch.library.advanceClock(seconds); });
+    }
+
+    // Opens a data directory with one subdirectory per branch, loading
+    // them in parallel. The branch count is recorded on first use, since
+    // it decides where every book and user lives.
+    bool openStorage(const string& directory) {
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Cannot create data directory " << directory << "\n";
+            return false;
+        }
+        string countPath = directory + "/branches";
+        unsigned recorded = 0;
+        ifstream existing(countPath);
+        if (existing >> recorded && recorded != count()) {
+            cerr << directory << " holds " << recorded << " branches, not " << count() << "\n";
+            return false;
+        }
+        if (recorded == 0 && !(ofstream(countPath) << count() << "\n")) {
+            cerr << "Cannot write " << countPath << "\n";
+            return false;
+        }
+        atomic<unsigned> opened(0);
+        scatter([&](Branch& branch) {
+            opened += branch.library.openStorage(directory + "/branch-" + to_string(branch.index));
+        });
+        if (opened != count()) return false;
+        mapUsers();
+        return true;
+    }
+
+    // False if any branch's log write failed
+    bool commitChanges(bool forceCompaction = false) {
+        atomic<unsigned> committed(0);
+        scatter([&](Branch& branch) { committed += branch.library.commitChanges(forceCompaction); });
+        return committed == count();
+    }
+
+    size_t unsavedChanges() {
+        atomic<size_t> unsaved(0);
+        scatter([&](Branch& branch) { unsaved += branch.library.unsavedChanges(); });
+        return unsaved;
+    }
+
+    // Adds a book at the branch that owns its ISBN; false if it is there already
+    bool addBook(IsbnKey isbn, const string& title, const string& author, const string& genre, uint32_t copies = 1) {
+        bool added = false;
+        runOn(&bookBranch(isbn), [&](Branch& branch) {
+            added = branch.library.addBookRecord(isbn, title, author, genre, copies) != nullptr;
+        });
+        return added;
+    }
+
+    // Registers a user at their home branch; returns their user ID, or 0
+    // if the email is already registered
+    int registerUser(const string& name, const string& email) {
+        int userId = 0;
+        runOn(branches[homeOf(email)].get(), [&](Branch& branch) {
+            const User* user = branch.library.registerUser(name, email);
+            if (user) {
+                userId = userIdOf(branch.index, user->userId);
+                remember(branch, user->userId, userId);
             }
-            
-            // Restore the queue without the returned book
-            user->borrowedBooks = tempQueue;
-            
-            if (!bookFound) {
-                cout << "User " << user->name << " has not borrowed this book!\n";
-                continue;
+        });
+        return userId;
+    }
+
+    void loadSampleData() {
+        for (const auto& sample : LibrarySystem::SAMPLE_BOOKS) {
+            addBook(parseIsbn(sample[0]), sample[1], sample[2], sample[3]);
+        }
+        // User IDs depend on the branch count, so they are printed
+        cerr << "Sample users:";
+        for (const auto& sample : LibrarySystem::SAMPLE_USERS) {
+            int userId = registerUser(sample[0], sample[1]);
+            if (userId) cerr << " " << sample[0] << " (ID " << userId << ")";
+        }
+        cerr << "\n";
+    }
+
+    size_t holdsWaiting() {
+        atomic<size_t> waiting(0);
+        scatter([&](Branch& branch) { waiting += branch.library.holdsWaiting(); });
+        return waiting;
+    }
+
+    // Applies requests of one kind ('I', 'R' or 'C') on every branch at
+    // once and returns how many succeeded; messages are written to out
+    // branch by branch, or dropped if it is null
+    size_t submitBatch(char kind, const vector<pair<int, IsbnKey>>& batch, ostream* out) {
+        for (auto& branch : branches) branch->out = out ? &branch->messages : nullptr;
+        Completion done(batch.size());
+        for (const auto& request : batch) {
+            Message message;
+            message.kind = kind;
+            message.userId = request.first;
+            message.isbn = request.second;
+            message.done = &done;
+            Branch& target = kind == 'I' ? *branches[homeOf(request.first)] : bookBranch(request.second);
+            while (!post(target, message)) this_thread::yield();
+        }
+        done.wait();
+        if (out) {
+            for (auto& branch : branches) {
+                *out << branch->messages.str();
+                branch->messages.str("");
             }
-            
-            // Return the book
-            book->isAvailable = true;
-            cout << "Book '" << book->title << "' returned by " << user->name << " successfully!\n";
         }
+        return done.succeeded;
     }
-    
-    void generateReports() {
-        int choice;
-        cout << "\n--- Reports ---\n";
-        cout << "1. Currently Borrowed Books\n";
-        cout << "2. Most Borrowed Books\n";
-        cout << "3. Active Users\n";
-        cout << "4. All Users Summary\n";
-        cout << "Enter choice: ";
-        cin >> choice;
-        
-        switch(choice) {
-            case 1: {
-                cout << "\n--- Currently Borrowed Books ---\n";
-                vector<Book*> allBooks = bookInventory.getAllBooks();
-                bool found = false;
-                for (Book* book : allBooks) {
-                    if (!book->isAvailable) {
-                        book->display();
-                        cout << string(30, '-') << "\n";
-                        found = true;
-                    }
-                }
-                if (!found) {
-                    cout << "No books are currently borrowed.\n";
-                }
-                break;
+
+    // Replays a transaction file like LibrarySystem::runBatch; each batch
+    // is spread over the branches, then committed on all of them at once
+    bool runBatch(const string& path, bool quiet) {
+        const size_t BATCH_SIZE = 65536;
+        ifstream file(path);
+        if (!file) {
+            cerr << "Cannot open transaction file " << path << "\n";
+            return false;
+        }
+
+        ostringstream batchOutput;
+        vector<pair<int, IsbnKey>> batch;
+        batch.reserve(BATCH_SIZE);
+        char batchKind = 0;
+        size_t issues = 0, issued = 0, returns = 0, returned = 0, cancels = 0, cancelled = 0, malformed = 0;
+        size_t transfersBefore = transfers;
+        size_t failedCommits = 0;
+        vector<double> batchMicros;
+        auto start = chrono::steady_clock::now();
+
+        auto flushBatch = [&]() {
+            if (batch.empty()) return;
+            auto batchStart = chrono::steady_clock::now();
+            size_t succeeded = submitBatch(batchKind, batch, quiet ? nullptr : &batchOutput);
+            if (batchKind == 'I') {
+                issues += batch.size();
+                issued += succeeded;
+            } else if (batchKind == 'R') {
+                returns += batch.size();
+                returned += succeeded;
+            } else {
+                cancels += batch.size();
+                cancelled += succeeded;
             }
-            case 2: {
-                cout << "\n--- Most Borrowed Books ---\n";
-                if (borrowFrequency.empty()) {
-                    cout << "No books have been borrowed yet.\n";
-                } else {
-                    // Convert to vector for sorting
-                    vector<pair<string, int>> sortedBooks(borrowFrequency.begin(), borrowFrequency.end());
-                    sort(sortedBooks.begin(), sortedBooks.end(), 
-                         [](const pair<string, int>& a, const pair<string, int>& b) {
-                             return a.second > b.second;
-                         });
-                    
-                    cout << left << setw(20) << "ISBN" << setw(10) << "Count" << "Title\n";
-                    cout << string(50, '-') << "\n";
-                    for (const auto& entry : sortedBooks) {
-                        Book* book = bookInventory.search(entry.first);
-                        if (book) {
-                            cout << left << setw(20) << entry.first 
-                                 << setw(10) << entry.second 
-                                 << book->title << "\n";
-                        }
-                    }
-                }
-                break;
+            batchMicros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - batchStart).count());
+            batch.clear();
+            failedCommits += !commitChanges();
+            if (!quiet) {
+                const string& text = batchOutput.str();
+                cout.write(text.data(), text.size());
+                batchOutput.str("");
             }
-            case 3: {
-                cout << "\n--- Active Users (Users with borrowed books) ---\n";
-                vector<User*> allUsers = userManager.getAllUsers();
-                bool found = false;
-                for (User* user : allUsers) {
-                    if (!user->borrowedBooks.empty()) {
-                        user->display();
-                        cout << "Borrowed Books: ";
-                        queue<string> tempQueue = user->borrowedBooks;
-                        while (!tempQueue.empty()) {
-                            Book* book = bookInventory.search(tempQueue.front());
-                            if (book) {
-                                cout << book->title << "; ";
-                            }
-                            tempQueue.pop();
-                        }
-                        cout << "\n" << string(30, '-') << "\n";
-                        found = true;
-                    }
-                }
-                if (!found) {
-                    cout << "No active users found.\n";
-                }
-                break;
+        };
+
+        string line;
+        size_t lineNumber = 0;
+        while (getline(file, line)) {
+            lineNumber++;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            char kind;
+            int userId;
+            IsbnKey isbn;
+            if (!LibrarySystem::parseTransaction(line, kind, userId, isbn)) {
+                malformed++;
+                if (!quiet) cerr << "Line " << lineNumber << ": malformed transaction skipped\n";
+                continue;
             }
-            case 4: {
-                cout << "\n--- All Users Summary ---\n";
-                vector<User*> allUsers = userManager.getAllUsers();
-                if (allUsers.empty()) {
-                    cout << "No users registered.\n";
-                } else {
-                    for (User* user : allUsers) {
-                        user->display();
-                        cout << string(30, '-') << "\n";
-                    }
-                }
-                break;
+            if (kind != batchKind || batch.size() == BATCH_SIZE) {
+                flushBatch();
+                batchKind = kind;
             }
-            default:
-                cout << "Invalid choice!\n";
+            batch.push_back({userId, isbn});
         }
+        flushBatch();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t total = issues + returns + cancels;
+        double p50 = 0, p99 = 0;
+        if (!batchMicros.empty()) {
+            sort(batchMicros.begin(), batchMicros.end());
+            p50 = batchMicros[batchMicros.size() / 2];
+            p99 = batchMicros[min(batchMicros.size() - 1, batchMicros.size() * 99 / 100)];
+        }
+
+        cout << "\n--- Batch Summary ---\n";
+        cout << "Transactions: " << total << " (" << malformed << " malformed lines skipped)\n";
+        cout << "Branches: " << count() << "\n";
+        cout << "Issues:  " << issued << " succeeded, " << issues - issued << " failed, "
+             << transfers - transfersBefore << " sent to another branch\n";
+        cout << "Returns: " << returned << " succeeded, " << returns - returned << " failed\n";
+        cout << "Holds:   " << cancelled << " of " << cancels << " cancellations applied, " << holdsWaiting()
+             << " waiting\n";
+        cout << fixed << setprecision(2);
+        cout << "Elapsed: " << seconds << " s\n";
+        cout << "Throughput: " << (seconds > 0 ? total / seconds : 0) << " transactions/s\n";
+        cout << "Batches: " << batchMicros.size() << ", latency p50 " << p50 << " us, p99 " << p99 << " us\n";
+        cout << defaultfloat << setprecision(6);
+        return LibrarySystem::reportCommitFailures(failedCommits, unsavedChanges());
     }
-    
-    void displayMenu() {
-        cout << "\n" << string(50, '=') << "\n";
-        cout << "      SMART LIBRARY MANAGEMENT SYSTEM\n";
-        cout << string(50, '=') << "\n";
-        cout << "1. Add Book\n";
-        cout << "2. Register User\n";
-        cout << "3. Search Books\n";
-        cout << "4. Issue Book\n";
-        cout << "5. Return Book\n";
-        cout << "6. Generate Reports\n";
-        cout << "7. Initialize Sample Data (Optional)\n";
-        cout << "8. Exit\n";
-        cout << string(50, '-') << "\n";
-        cout << "Enter your choice: ";
+
+    // Most Borrowed across branches: each branch ranks its own books at
+    // once, and the rankings are merged from the top, most borrowed first
+    vector<LibrarySystem::RankedTitle> mostBorrowed(BorrowStatistics::Window window, size_t limit) {
+        vector<vector<LibrarySystem::RankedTitle>> partial(count());
+        scatter([&](Branch& branch) { partial[branch.index] = branch.library.mostBorrowed(window, limit); });
+
+        using Head = pair<uint32_t, unsigned>; // count, branch
+        auto below = [](const Head& a, const Head& b) {
+            return a.first < b.first || (a.first == b.first && a.second > b.second);
+        };
+        priority_queue<Head, vector<Head>, decltype(below)> heads(below);
+        vector<size_t> next(count(), 0);
+        for (unsigned b = 0; b < count(); b++) {
+            if (!partial[b].empty()) heads.push({partial[b][0].count, b});
+        }
+        vector<LibrarySystem::RankedTitle> merged;
+        while (!heads.empty() && merged.size() < limit) {
+            unsigned b = heads.top().second;
+            heads.pop();
+            merged.push_back(move(partial[b][next[b]++]));
+            if (next[b] < partial[b].size()) heads.push({partial[b][next[b]].count, b});
+        }
+        return merged;
     }
-    
-    void run() {
-        cout << "\nWelcome to Smart Library Management System!\n";
-        cout << "Please start by adding books and registering users.\n";
-        
-        int choice;
-        do {
-            displayMenu();
-            cin >> choice;
-            
-            switch(choice) {
-                case 1:
-                    addBook();
-                    break;
-                case 2:
-                    addUser();
-                    break;
-                case 3:
-                    searchBooks();
-                    break;
-                case 4:
-                    issueBook();
-                    break;
-                case 5:
-                    returnBook();
-                    break;
-                case 6:
-                    generateReports();
-                    break;
-                case 7:
-                    initializeSampleData();
-                    break;
-                case 8:
-                    cout << "Thank you for using Smart Library Management System!\n";
-                    break;
-                default:
-                    cout << "Invalid choice! Please try again.\n";
+
+    // Active Users across branches in user ID order. Each branch lists its
+    // borrowers at once; a user borrowing at several branches has a row
+    // from each, which the merge adds together.
+    vector<LibrarySystem::ActiveUserRow> activeUsers() {
+        vector<vector<LibrarySystem::ActiveUserRow>> partial(count());
+        scatter([&](Branch& branch) {
+            vector<LibrarySystem::ActiveUserRow> rows = branch.library.activeUsers();
+            for (auto& row : rows) {
+                row.userId = (size_t)row.userId < branch.userIds.size() ? branch.userIds[row.userId] : 0;
+            }
+            rows.erase(remove_if(rows.begin(), rows.end(),
+                                 [](const LibrarySystem::ActiveUserRow& row) { return row.userId == 0; }),
+                       rows.end());
+            sort(rows.begin(), rows.end(), [](const LibrarySystem::ActiveUserRow& a, const LibrarySystem::ActiveUserRow& b) {
+                return a.userId < b.userId;
+            });
+            partial[branch.index] = move(rows);
+        });
+
+        using Head = pair<int, unsigned>; // user ID, branch
+        priority_queue<Head, vector<Head>, greater<Head>> heads;
+        vector<size_t> next(count(), 0);
+        for (unsigned b = 0; b < count(); b++) {
+            if (!partial[b].empty()) heads.push({partial[b][0].userId, b});
+        }
+        vector<LibrarySystem::ActiveUserRow> merged;
+        while (!heads.empty()) {
+            unsigned b = heads.top().second;
+            heads.pop();
+            LibrarySystem::ActiveUserRow& row = partial[b][next[b]++];
+            if (!merged.empty() && merged.back().userId == row.userId) {
+                LibrarySystem::ActiveUserRow& total = merged.back();
+                total.loans += row.loans;
+                total.fines = (uint32_t)min<uint64_t>((uint64_t)total.fines + row.fines, UINT32_MAX);
+                total.borrowed += row.borrowed;
+            } else {
+                merged.push_back(move(row));
             }
-        } while(choice != 8);
+            if (next[b] < partial[b].size()) heads.push({partial[b][next[b]].userId, b});
+        }
+        return merged;
     }
-    
-    
-    void initializeSampleData() {
-        cout << "\n--- Initialize Sample Data ---\n";
-        cout << "This will add sample books and users to the system.\n";
-        cout << "Do you want to continue? (y/n): ";
-        char confirm;
-        cin >> confirm;
-        
-        if (confirm != 'y' && confirm != 'Y') {
-            cout << "Sample data initialization cancelled.\n";
-            return;
+
+    // Headless --list for branches: most-borrowed or active-users
+    bool exportListing(ostream& out, const string& what, ListingWriter::Format format, size_t limit,
+                       const string& after) {
+        if (what != "most-borrowed" && what != "active-users") {
+            cerr << "Unknown listing: " << what << " (branches list most-borrowed or active-users)\n";
+            return false;
         }
-        
-        // Add sample books
-        Book* book1 = new Book("978-0134685991", "Effective Modern C++", "Scott Meyers", "Programming");
-        Book* book2 = new Book("978-0321563842", "The C++ Programming Language", "Bjarne Stroustrup", "Programming");
-        Book* book3 = new Book("978-0596809485", "97 Things Every Programmer Should Know", "Kevlin Henney", "Programming");
-        Book* book4 = new Book("978-0132350884", "Clean Code", "Robert C. Martin", "Programming");
-        Book* book5 = new Book("978-0201633610", "Design Patterns", "Gang of Four", "Software Engineering");
-        
-        bookInventory.insert(book1);
-        bookInventory.insert(book2);
-        bookInventory.insert(book3);
-        bookInventory.insert(book4);
-        bookInventory.insert(book5);
-        
-        bookSearchTree.insert(book1);
-        bookSearchTree.insert(book2);
-        bookSearchTree.insert(book3);
-        bookSearchTree.insert(book4);
-        bookSearchTree.insert(book5);
-        
-        // Add sample users
-        userManager.addUser("Alice Johnson", "alice@email.com");
-        userManager.addUser("Bob Smith", "bob@email.com");
-        userManager.addUser("Charlie Brown", "charlie@email.com");
-        
-        cout << "\nSample data initialized successfully!\n";
-        cout << "Added 5 programming books and 3 sample users to the system.\n";
-        cout << "\nSample Books Added:\n";
-        cout << "- Effective Modern C++ by Scott Meyers\n";
-        cout << "- The C++ Programming Language by Bjarne Stroustrup\n";
-        cout << "- 97 Things Every Programmer Should Know by Kevlin Henney\n";
-        cout << "- Clean Code by Robert C. Martin\n";
-        cout << "- Design Patterns by Gang of Four\n";
-        cout << "\nSample Users Added:\n";
-        cout << "- Alice Johnson (ID: 1)\n";
-        cout << "- Bob Smith (ID: 2)\n";
-        cout << "- Charlie Brown (ID: 3)\n";
+        if (!after.empty()) {
+            cerr << "The " << what << " listing has no cursor\n";
+            return false;
+        }
+        if (what == "most-borrowed") {
+            LibrarySystem::writeMostBorrowed(out, format, mostBorrowed(BorrowStatistics::ALL_TIME, limit ? limit : SIZE_MAX));
+        } else {
+            LibrarySystem::writeActiveUsers(out, format, activeUsers(), limit);
+        }
+        return true;
     }
 };
 
-int main() {
+#ifndef LIBRARY_NO_MAIN
+int main(int argc, char* argv[]) {
     LibrarySystem library;
-    library.run();
-    return 0;
-}
\ No newline at end of file
+    string batchFile;
+    string dataDirectory;
+    bool quiet = false;
+    bool sampleData = false;
+    bool compact = false;
+    unsigned threads = 1;
+    int64_t clockOffsetDays = 0;
+    string metricsFile;
+    int metricsInterval = 10;
+    bool stats = false;
+    string importFile;
+    string listing;
+    ListingWriter::Format listFormat = ListingWriter::TABLE;
+    size_t listLimit = 0;
+    string listAfter;
+    string serveSocket;
+    int tcpPort = 0;
+    bool holdsEnabled = true;
+    unsigned shards = 1;
+    
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--batch" && i + 1 < argc) {
+            batchFile = argv[++i];
+        } else if (arg == "--quiet") {
+            quiet = true;
+        } else if (arg == "--sample-data") {
+            sampleData = true;
+        } else if (arg == "--data-dir" && i + 1 < argc) {
+            dataDirectory = argv[++i];
+        } else if (arg == "--compact") {
+            compact = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = (unsigned)max(1, atoi(argv[++i]));
+        } else if (arg == "--clock-offset-days" && i + 1 < argc) {
+            clockOffsetDays = atoll(argv[++i]);
+        } else if (arg == "--metrics-file" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (arg == "--metrics-interval" && i + 1 < argc) {
+            metricsInterval = max(1, atoi(argv[++i]));
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--import" && i + 1 < argc) {
+            importFile = argv[++i];
+        } else if (arg == "--no-holds") {
+            holdsEnabled = false;
+        } else if (arg == "--list" && i + 1 < argc) {
+            listing = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc && ListingWriter::parseFormat(argv[i + 1], listFormat)) {
+            i++;
+        } else if (arg == "--limit" && i + 1 < argc) {
+            listLimit = (size_t)max(0LL, atoll(argv[++i]));
+        } else if (arg == "--after" && i + 1 < argc) {
+            listAfter = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveSocket = argv[++i];
+        } else if (arg == "--tcp-port" && i + 1 < argc) {
+            tcpPort = max(0, atoi(argv[++i]));
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shards = (unsigned)min(max(1, atoi(argv[++i])), (int)ShardedLibrary::MAX_BRANCHES);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--data-dir <dir> [--compact]] [--import <catalog.csv>] [--sample-data]"
+                 << " [--batch <file> [--quiet] [--threads <n>]] [--clock-offset-days <n>]"
+                 << " [--metrics-file <path> [--metrics-interval <seconds>]] [--stats] [--no-holds]"
+                 << " [--list books|users|most-borrowed|active-users [--format records|table|csv|jsonl] [--limit <n>] [--after <cursor>]]"
+                 << " [--serve <socket> [--tcp-port <port>]] [--shards <n>]\n";
+            return 1;
+        }
+    }
+    
+    // Loading, import and compaction start threads of their own
+    if (!serveSocket.empty()) {
+        LibraryServer::blockStopSignals();
+    }
+    
+    // Branches run headless batches and report listings
+    if (shards > 1) {
+        if (batchFile.empty() && listing.empty()) {
+            cerr << "--shards needs --batch or --list\n";
+            return 1;
+        }
+        if (!serveSocket.empty() || !importFile.empty() || !metricsFile.empty() || stats || threads > 1) {
+            cerr << "--shards does not combine with --serve, --import, --metrics-file, --stats or --threads\n";
+            return 1;
+        }
+        ios::sync_with_stdio(false);
+        ShardedLibrary branches(shards);
+        branches.setHoldsEnabled(holdsEnabled);
+        branches.advanceClock(clockOffsetDays * LibraryClock::SECONDS_PER_DAY);
+        if (!dataDirectory.empty() && !branches.openStorage(dataDirectory)) {
+            return 1;
+        }
+        if (sampleData) {
+            branches.loadSampleData();
+        }
+        branches.commitChanges(compact);
+        bool succeeded = batchFile.empty() || branches.runBatch(batchFile, quiet);
+        if (succeeded && !listing.empty()) {
+            succeeded = branches.exportListing(cout, listing, listFormat, listLimit, listAfter);
+        }
+        return succeeded ? 0 : 1;
+    }
+    
+    library.setHoldsEnabled(holdsEnabled);
+    library.advanceClock(clockOffsetDays * LibraryClock::SECONDS_PER_DAY);
+    
+    if (!dataDirectory.empty() && !library.openStorage(dataDirectory)) {
+        return 1;
+    }
+    
+    if (sampleData) {
+        library.loadSampleData();
+    }
+    if (!importFile.empty() && !library.importCatalog(importFile, max(1u, thread::hardware_concurrency()))) {
+        return 1;
+    }
+    library.commitChanges(compact);
+    if (!metricsFile.empty()) {
+        library.startMetricsDump(metricsFile, metricsInterval);
+    }
+    
+    // Headless mode: no prompts, and no stdio synchronisation to pay for
+    bool succeeded = true;
+    if (!serveSocket.empty()) {
+        LibraryServer server(library);
+        succeeded = server.open(serveSocket, tcpPort);
+        if (succeeded) {
+            server.run();
+        }
+    } else if (!batchFile.empty() || !listing.empty()) {
+        ios::sync_with_stdio(false);
+        if (!batchFile.empty()) {
+            succeeded = library.runBatch(batchFile, quiet, threads);
+        }
+        string next;
+        if (succeeded && !listing.empty()) {
+            succeeded = library.exportListing(cout, listing, listFormat, listLimit, listAfter, next);
+        }
+        if (!next.empty()) {
+            cerr << "More rows follow; continue with --after " << next << "\n";
+        }
+    } else {
+        library.run();
+    }
+    
+    if (stats) {
+        cout << "\n--- Operation Statistics ---\n";
+        library.printStatistics(cout);
+    }
+    return succeeded ? 0 : 1;
+}
+#endif
@@ -0,0 +1,301 @@
+// Load generator for the Smart Library Management System request server.
+// Build: g++ -std=c++17 -O2 -pthread LoadGenerator.cpp -o loadgen
+//
+// ./loadgen --make-data <dir> [--books <n>] [--users <n>]
+//     writes a synthetic catalogue for ./library --data-dir <dir> --serve
+// ./loadgen --socket <path> | --tcp <port> [--connections <n>] [--pipeline <n>]
+//           [--requests <n>] [--books <n>] [--users <n>] [--write-percent <n>]
+//     drives the server from one epoll loop and reports requests/sec and
+//     latency percentiles
+#define LIBRARY_NO_MAIN
+#include "Library.cpp"
+#include "SyntheticCatalog.h"
+
+#include <random>
+#include <sys/resource.h>
+
+static bool makeData(const string& directory, size_t books, size_t users) {
+    LibrarySystem library;
+    if (!library.openStorage(directory)) return false;
+    populate(library, books, users);
+    if (!library.commitChanges(true)) return false;
+    cout << "Wrote " << books << " books and " << users << " users to " << directory << "\n";
+    return true;
+}
+
+class LoadGenerator {
+private:
+    enum Kind { LOOKUP, ISSUE, RETURN };
+
+    struct Sent {
+        chrono::steady_clock::time_point at;
+        Kind kind;
+        IsbnKey isbn;
+    };
+
+    struct Client {
+        int fd = -1;
+        int userId = 0;
+        string output;
+        size_t sent = 0;
+        string input;
+        deque<Sent> inFlight; // replies come back in request order
+        vector<IsbnKey> loans;
+        bool writing = false;
+    };
+
+    size_t books;
+    size_t users;
+    int writePercent;
+    size_t pipeline;
+    size_t target;
+    size_t issued;
+    size_t answered;
+    size_t okReplies;
+    size_t errReplies;
+    int epollFd;
+    vector<Client> clients;
+    unordered_map<int, size_t> clientOf; // fd to index in clients
+    LatencyHistogram latency;
+    mt19937_64 rng;
+
+    void queueRequest(Client& client) {
+        Sent request{chrono::steady_clock::now(), LOOKUP, syntheticIsbn(rng() % books)};
+        int roll = (int)(rng() % 100);
+        if (roll < writePercent) {
+            if (!client.loans.empty() && (rng() & 1)) {
+                request.kind = RETURN;
+                request.isbn = client.loans[rng() % client.loans.size()];
+            } else {
+                request.kind = ISSUE;
+            }
+        }
+        string isbn = formatIsbn(request.isbn);
+        switch (request.kind) {
+            case ISSUE: client.output += "I," + to_string(client.userId) + "," + isbn + "\n"; break;
+            case RETURN: client.output += "R," + to_string(client.userId) + "," + isbn + "\n"; break;
+            case LOOKUP:
+                if (roll % 4 == 3) client.output += "U," + to_string(client.userId) + "\n";
+                else client.output += "S," + isbn + "\n";
+                break;
+        }
+        client.inFlight.push_back(request);
+        issued++;
+    }
+
+    void fill(Client& client) {
+        while (client.inFlight.size() < pipeline && issued < target) queueRequest(client);
+    }
+
+    bool flush(Client& client) {
+        while (client.sent < client.output.size()) {
+            ssize_t wrote = send(client.fd, client.output.data() + client.sent, client.output.size() - client.sent,
+                                 MSG_NOSIGNAL);
+            if (wrote > 0) {
+                client.sent += (size_t)wrote;
+            } else if (wrote < 0 && errno == EINTR) {
+                continue;
+            } else if (wrote < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return false;
+            }
+        }
+        if (client.sent == client.output.size()) {
+            client.output.clear();
+            client.sent = 0;
+        }
+        bool writing = !client.output.empty();
+        if (writing != client.writing) {
+            client.writing = writing;
+            epoll_event event{};
+            event.events = EPOLLIN | (writing ? (uint32_t)EPOLLOUT : 0u);
+            event.data.fd = client.fd;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, client.fd, &event);
+        }
+        return true;
+    }
+
+    // Matches complete replies to the requests they answer
+    bool receive(Client& client) {
+        char chunk[65536];
+        while (true) {
+            ssize_t got = recv(client.fd, chunk, sizeof(chunk), 0);
+            if (got > 0) {
+                client.input.append(chunk, (size_t)got);
+                continue;
+            }
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            cerr << "Server closed a connection\n";
+            return false;
+        }
+        auto now = chrono::steady_clock::now();
+        size_t start = 0;
+        for (size_t newline; (newline = client.input.find('\n', start)) != string::npos; start = newline + 1) {
+            if (client.inFlight.empty()) {
+                cerr << "Unexpected reply\n";
+                return false;
+            }
+            Sent request = client.inFlight.front();
+            client.inFlight.pop_front();
+            latency.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(now - request.at).count());
+            answered++;
+            bool ok = client.input.compare(start, 3, "OK ") == 0;
+            ok ? okReplies++ : errReplies++;
+            if (ok && request.kind == ISSUE) {
+                client.loans.push_back(request.isbn);
+            } else if (ok && request.kind == RETURN) {
+                client.loans.erase(find(client.loans.begin(), client.loans.end(), request.isbn));
+            }
+        }
+        client.input.erase(0, start);
+        return true;
+    }
+
+public:
+    LoadGenerator(size_t books, size_t users, int writePercent, size_t pipeline, size_t target)
+        : books(max<size_t>(1, books)), users(max<size_t>(1, users)), writePercent(writePercent),
+          pipeline(max<size_t>(1, pipeline)), target(target), issued(0), answered(0), okReplies(0),
+          errReplies(0), epollFd(epoll_create1(EPOLL_CLOEXEC)), rng(42) {}
+
+    ~LoadGenerator() {
+        for (Client& client : clients) {
+            if (client.fd >= 0) close(client.fd);
+        }
+        if (epollFd >= 0) close(epollFd);
+    }
+
+    bool connectAll(const string& socketPath, int tcpPort, size_t connections) {
+        clients.resize(connections);
+        for (size_t c = 0; c < connections; c++) {
+            int fd;
+            if (tcpPort > 0) {
+                sockaddr_in address{};
+                address.sin_family = AF_INET;
+                address.sin_port = htons((uint16_t)tcpPort);
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                    close(fd);
+                    fd = -1;
+                }
+                int on = 1;
+                if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            } else {
+                sockaddr_un address{};
+                address.sun_family = AF_UNIX;
+                strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+                fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            if (fd < 0) {
+                cerr << "Connection " << c << " failed: " << strerror(errno) << "\n";
+                return false;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            clients[c].fd = fd;
+            clients[c].userId = (int)(c % users) + 1;
+            clientOf[fd] = c;
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        }
+        return true;
+    }
+
+    bool run() {
+        auto start = chrono::steady_clock::now();
+        for (Client& client : clients) {
+            fill(client);
+            if (!flush(client)) return false;
+        }
+        epoll_event events[256];
+        while (answered < issued) {
+            int ready = epoll_wait(epollFd, events, 256, 10000);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) {
+                cerr << "Timed out with " << issued - answered << " requests unanswered\n";
+                return false;
+            }
+            for (int i = 0; i < ready; i++) {
+                Client& client = clients[clientOf[events[i].data.fd]];
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !receive(client)) return false;
+                fill(client);
+                if (!flush(client)) return false;
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << fixed << setprecision(1);
+        cout << answered << " requests over " << clients.size() << " connections (pipeline " << pipeline
+             << ") in " << seconds << " s: " << answered / seconds << " requests/sec\n";
+        cout << "Latency us: p50 " << latency.percentile(0.50) / 1000.0 << ", p99 "
+             << latency.percentile(0.99) / 1000.0 << ", p99.9 " << latency.percentile(0.999) / 1000.0
+             << ", max " << latency.maxNanoseconds() / 1000.0 << "\n";
+        cout << okReplies << " OK, " << errReplies << " ERR\n";
+        return true;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    string dataDirectory;
+    string socketPath;
+    int tcpPort = 0;
+    size_t connections = 1000;
+    size_t pipeline = 4;
+    size_t requests = 1000000;
+    size_t books = 10000;
+    size_t users = 1000;
+    int writePercent = 20;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--make-data" && i + 1 < argc) {
+            dataDirectory = argv[++i];
+        } else if (arg == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--tcp" && i + 1 < argc) {
+            tcpPort = atoi(argv[++i]);
+        } else if (arg == "--connections" && i + 1 < argc) {
+            connections = (size_t)max(1, atoi(argv[++i]));
+        } else if (arg == "--pipeline" && i + 1 < argc) {
+            pipeline = (size_t)max(1, atoi(argv[++i]));
+        } else if (arg == "--requests" && i + 1 < argc) {
+            requests = (size_t)max(1LL, atoll(argv[++i]));
+        } else if (arg == "--books" && i + 1 < argc) {
+            books = (size_t)max(1LL, atoll(argv[++i]));
+        } else if (arg == "--users" && i + 1 < argc) {
+            users = (size_t)max(1LL, atoll(argv[++i]));
+        } else if (arg == "--write-percent" && i + 1 < argc) {
+            writePercent = min(100, max(0, atoi(argv[++i])));
+        } else {
+            cerr << "Usage: " << argv[0] << " --make-data <dir> [--books <n>] [--users <n>]\n"
+                 << "       " << argv[0] << " --socket <path> | --tcp <port> [--connections <n>] [--pipeline <n>]"
+                 << " [--requests <n>] [--books <n>] [--users <n>] [--write-percent <n>]\n";
+            return 1;
+        }
+    }
+    if (!dataDirectory.empty()) {
+        return makeData(dataDirectory, books, users) ? 0 : 1;
+    }
+    if (socketPath.empty() && tcpPort <= 0) {
+        cerr << "Give --socket <path> or --tcp <port>\n";
+        return 1;
+    }
+
+    // Every connection needs a descriptor
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < connections + 64) {
+        files.rlim_cur = min<rlim_t>(files.rlim_max, connections + 64);
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    LoadGenerator generator(books, users, writePercent, pipeline, requests);
+    if (!generator.connectAll(socketPath, tcpPort, connections)) return 1;
+    return generator.run() ? 0 : 1;
+}
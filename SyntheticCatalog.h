@@ -0,0 +1,38 @@
+// Synthetic catalogue shared by Benchmark.cpp and LoadGenerator.cpp, which
+// include it after Library.cpp. Book i has ISBN syntheticIsbn(i), title
+// "Title i" and `copies` copies; user u is "User u" at useru@example.com.
+#pragma once
+
+// Adds the first `books` books and `users` users. Books and emails that
+// are already there are left alone; returns the IDs of the users it
+// registered, in order.
+inline vector<int> populate(LibrarySystem& library, size_t books, size_t users, uint32_t copies = 1) {
+    for (size_t i = 0; i < books; i++) {
+        library.addBookRecord(syntheticIsbn(i), "Title " + to_string(i), "Author", "Genre", copies);
+    }
+    vector<int> userIds;
+    userIds.reserve(users);
+    for (size_t u = 0; u < users; u++) {
+        const User* user = library.registerUser("User " + to_string(u), "user" + to_string(u) + "@example.com");
+        if (user) userIds.push_back(user->userId);
+    }
+    return userIds;
+}
+
+// The same catalogue across branches; each branch adds its own books
+inline vector<int> populate(ShardedLibrary& library, size_t books, size_t users, uint32_t copies = 1) {
+    library.forEachBranch([&](LibrarySystem& branch, unsigned index) {
+        for (size_t i = 0; i < books; i++) {
+            if (library.branchOf(syntheticIsbn(i)) == index) {
+                branch.addBookRecord(syntheticIsbn(i), "Title " + to_string(i), "Author", "Genre", copies);
+            }
+        }
+    });
+    vector<int> userIds;
+    userIds.reserve(users);
+    for (size_t u = 0; u < users; u++) {
+        int userId = library.registerUser("User " + to_string(u), "user" + to_string(u) + "@example.com");
+        if (userId) userIds.push_back(userId);
+    }
+    return userIds;
+}